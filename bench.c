@@ -0,0 +1,264 @@
+// headless benchmark, drives the editor from key scripts through the
+// memory terminal and reports how fast the hot paths are, run with make bench
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// count what the editor allocates, the libc and the harness aren't counted
+long long bench_allocs = 0;
+long long bench_alloc_bytes = 0;
+
+void *
+bench_malloc(size_t n)
+{
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_alloc_bytes, n, __ATOMIC_RELAXED);
+    return malloc(n);
+}
+
+void *
+bench_calloc(size_t n, size_t size)
+{
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_alloc_bytes, n * size, __ATOMIC_RELAXED);
+    return calloc(n, size);
+}
+
+void *
+bench_realloc(void *p, size_t n)
+{
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_alloc_bytes, n, __ATOMIC_RELAXED);
+    return realloc(p, n);
+}
+
+#define malloc(n) bench_malloc(n)
+#define calloc(n, size) bench_calloc(n, size)
+#define realloc(p, n) bench_realloc(p, n)
+#define main candy_main
+#include "candy.c"
+#undef main
+#undef malloc
+#undef calloc
+#undef realloc
+
+#define BENCH_ROWS 40
+#define BENCH_COLS 120
+// each case runs until it did its ops or ran out of time
+#define BENCH_BUDGET_NS 1000000000LL
+
+struct bench {
+    long long start;
+    long long allocs;
+    long long frames;
+    long long emitted;  // bytes written to the terminal
+};
+
+struct bench bench;
+
+long long
+bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void
+bench_start()
+{
+    bench.allocs = bench_allocs;
+    bench.frames = 0;
+    bench.emitted = 0;
+    bench.start = bench_now_ns();
+}
+
+int
+bench_over()
+{
+    return bench_now_ns() - bench.start > BENCH_BUDGET_NS;
+}
+
+void
+bench_stop(const char *name, long long ops)
+{
+    long long ns = bench_now_ns() - bench.start;
+    long long allocs = bench_allocs - bench.allocs;
+    ops = ops > 0 ? ops : 1;
+    printf("  %-18s %8lld ops %12.0f ops/s %10.2f us/op %8.2f allocs/op",
+            name, ops, ops * 1e9 / (ns > 0 ? ns : 1), ns / 1e3 / ops, (double)allocs / ops);
+    if (bench.frames > 0) {
+        printf(" %8.0f bytes/frame %6.2f allocs/frame",
+                (double)bench.emitted / bench.frames, (double)allocs / bench.frames);
+    }
+    printf("\n");
+}
+
+void
+bench_refresh()
+{
+    editor_refresh_screen();
+    bench.frames++;
+    bench.emitted += term_mem.out.len;
+    term_mem.out.len = 0;
+}
+
+// feed keys as if typed, with a refresh after each one like the main loop
+// does while the user types slowly
+void
+bench_type(const char *keys, int refresh)
+{
+    term_mem_feed(keys, strlen(keys));
+    while (editor_input_pending()) {
+        editor_process_keypress();
+        if (refresh) {
+            bench_refresh();
+        }
+    }
+}
+
+// a file of rows rows of text, or one row of that many bytes
+char *
+bench_make_file(const char *name, long long rows, int single)
+{
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char *path = malloc(strlen(dir) + strlen(name) + 16);
+    sprintf(path, "%s/candy-%s-%d", dir, name, (int)getpid());
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        die(path);
+    }
+    if (single) {
+        for (long long i = 0; i < rows; i++) {
+            fputc("abcdefgh XYZ\t0123 "[i % 18], fp);
+        }
+        fputc('\n', fp);
+    } else {
+        for (long long i = 0; i < rows; i++) {
+            fprintf(fp, "%lld: int x = foo(bar, %lld); // some text\n", i, i * 7);
+        }
+    }
+    fclose(fp);
+    return path;
+}
+
+void
+bench_open(const char *path)
+{
+    bench_start();
+    if ((config.buf = editor_new_buffer()) == NULL) {
+        die("malloc");
+    }
+    config.win->buf = config.buf;
+    config.win->cx = config.win->cy = config.win->rowoff = config.win->coloff = 0;
+    if (editor_open(path) == -1) {
+        die(path);
+    }
+    editor_index_rows(INT_MAX);
+    bench_stop("open", 1);
+}
+
+void
+bench_file(const char *name, long long rows, int single)
+{
+    char *path = bench_make_file(name, rows, single);
+    struct stat st;
+    stat(path, &st);
+    printf("%s, %lld bytes\n", name, (long long)st.st_size);
+
+    bench_open(path);
+    editor_invalidate_screen();
+    bench_refresh();
+
+    long long n;
+    bench_start();
+    for (n = 0; n < 1000 && !bench_over(); n++) {
+        editor_invalidate_screen();
+        bench_refresh();
+    }
+    bench_stop("full refresh", n);
+
+    bench_start();
+    for (n = 0; n < 1000 && !bench_over(); n++) {
+        bench_type(n % 20 < 10 ? "\x04" : "\x15", 1);
+    }
+    bench_stop("scroll refresh", n);
+
+    // the same with the rows wrapped, scrolling maps screen lines to rows
+    bench_type("gg", 0);
+    config.wrap = 1;
+    bench_start();
+    for (n = 0; n < 1000 && !bench_over(); n++) {
+        bench_type(n % 20 < 10 ? "\x04" : "\x15", 1);
+    }
+    bench_stop("wrap scroll", n);
+    config.wrap = 0;
+
+    bench_type("gg", 0);
+    bench_start();
+    bench_type("i", 0);
+    for (n = 0; n < 10000 && !bench_over(); n++) {
+        bench_type("x", 0);
+    }
+    bench_type("\x03", 0);
+    bench_stop("insert", n);
+
+    bench_type("j0", 0);  // a row of its own, not the one grown above
+    bench_start();
+    bench_type("i", 1);
+    for (n = 0; n < 1000 && !bench_over(); n++) {
+        bench_type("y", 1);
+    }
+    bench_type("\x03", 1);
+    bench_stop("insert refresh", n);
+
+    bench_start();
+    for (n = 0; n < 1000 && !bench_over(); n++) {
+        bench_type("oz\x03", 0);
+    }
+    bench_stop("o", n);
+
+    // the rows put share the register's text, undo takes them out again
+    bench_type("gg", 0);
+    bench_start();
+    for (n = 0; n < 100 && !bench_over(); n++) {
+        bench_type("100000yypu", 0);
+    }
+    bench_stop("100k rows yy p u", n);
+
+    bench_type("gg", 0);
+    bench_start();
+    for (n = 0; n < 1000 && config.buf->numrows > 1 && !bench_over(); n++) {
+        bench_type("dd", 0);
+    }
+    bench_stop("dd", n);
+
+    bench_start();
+    bench_type(":w\r", 0);
+    editor_save_wait();
+    bench_stop("save", 1);
+
+    editor_free_buffer(config.buf);
+    unlink(path);
+    free(path);
+}
+
+int
+main()
+{
+    term = &term_memory;
+    term_mem.rows = BENCH_ROWS;
+    term_mem.cols = BENCH_COLS;
+    term->size(&config.term_rows, &config.term_cols);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    init_editor();
+    editor_init_events();
+
+    bench_file("lines", 1000000, 0);
+    bench_file("single-line", 10 * 1024 * 1024, 1);
+    return 0;
+}
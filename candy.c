@@ -1,66 +1,566 @@
+#define _GNU_SOURCE  // memmem
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
 #include <time.h>
 #include <termios.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LIDX_X86
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define LIDX_NEON
+#endif
+
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#define FOLLOW_INOTIFY
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <sys/event.h>
+#define FOLLOW_KQUEUE
+#endif
 
 #define CTRLKEY(k) ((k) & 0x1f)
 
+// rows split off the mapped file per idle step, between input checks
+#define INDEX_STEP 65536
+// newline offsets collected per line index scan
+#define LIDX_BATCH 4096
+// keyboard input is read in bulk into a ring this big, a power of two
+#define INPUT_SIZE 4096
+// iovecs handed to a single writev when saving
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define SAVE_IOV IOV_MAX
+#else
+#define SAVE_IOV 1024
+#endif
+// bytes saved between two progress reports
+#define SAVE_REPORT (4 << 20)
+// longest the swap file writer waits for more changes before the next sync
+#define SWAP_DELAY_MS 100
+// most bytes read from a followed file at once
+#define FOLLOW_CHUNK (1 << 20)
+// bytes a pipe or decompressor is read in by the loading thread, and most
+// made into rows per event between input checks
+#define LOAD_CHUNK (1 << 20)
+#define LOAD_STEP (8 << 20)
+// edits :diff searches through before settling for a longer script than
+// the shortest, more for longer files
+#define DIFF_COST_MIN 256
+// diagonals Myers may go through on all the rows, before it starts over
+// on the rows the other side has too
+#define DIFF_BUDGET (1 << 22)
+// and on the rows left then, whatever it hasn't got to after that is taken
+// as changed as a whole
+#define DIFF_BUDGET_LEFT (1 << 28)
+// rows on either side of a row the other side has many of that are looked
+// at to tell whether it is among rows that aren't common
+#define DIFF_SCAN 100
+// rows between two remembered row starts in the pager, how many blocks of
+// that many rows are kept, bytes scanned per step and between progress
+// reports
+#define PAGER_CHECKPOINT 4096
+#define PAGER_BLOCKS 4
+#define PAGER_STEP (1 << 20)
+#define PAGER_REPORT (256 << 20)
+// rows are numbered with an int, the pager shows no more than this many,
+// a whole number of checkpoints
+#define PAGER_MAX_ROWS ((INT_MAX / PAGER_CHECKPOINT - 1) * PAGER_CHECKPOINT)
+// files smaller than this are split in a moment, no index cache is kept
+// next to them
+#define LCACHE_MIN (1 << 20)
+// what w and b jump between by default, runs of word characters or runs
+// of other non-blank characters, bytes above ascii count as word characters
+#define WORD_PATTERN "[A-Za-z0-9_\\x80-\\xff]+|[^A-Za-z0-9_\\x80-\\xff \\t]+"
+// hash buckets and most states of a lazily built DFA, and how many
+// compiled patterns are kept
+#define RX_HASH 1024
+#define RX_STATES 4096
+#define RX_CACHE 8
+// columns between tab stops
+#define TAB_STOP 8
+// bytes of a row between two character starts whose screen column is kept
+#define RENDER_CHECK 256
+// slab text no row refers to any more before compaction is worth it, and
+// rows compacted per idle step
+#define SLAB_COMPACT (1 << 20)
+#define SLAB_STEP 65536
+// keypresses whose latency :perf takes the percentiles of
+#define PERF_SAMPLES 1024
+// rows checked for highlighting per idle step, and how far above the
+// screen lexing starts when the states there aren't known yet
+#define HL_STEP 65536
+#define HL_LOOKBACK 2000
+// rows searched per idle step when collecting matches
+#define SEARCH_STEP 16384
+// longest search pattern
+#define SEARCH_MAX 128
+// most threads a substitute is split across, and the fewest rows worth
+// handing to a thread of their own
+#define SUBST_THREADS 16
+#define SUBST_MIN_ROWS 32768
+
 typedef enum Mode { INSERT, VIEW } Mode;
 
+// things the event loop wakes up for besides input
+enum Timer { TIMER_MESSAGE, TIMER_COUNT };
+
+// where the text of a row lives, only heap text is freed on its own
+enum RowStore {
+    ROW_HEAP,    // malloc'd, cap bytes
+    ROW_MAPPED,  // the mmap'd file, not ours to change
+    ROW_SLAB,    // the buffer's slab, copied out before a change
+    ROW_SHARED   // a register's text block, copied out before a change
+};
+
 typedef struct erow {
     int size;
+    int cap;  // bytes chars can hold, 0 when it can't be written to
     char *chars;
+    struct render *r;  // how the row looks on screen, NULL until it is drawn
+    unsigned int gen;  // bumped on every change, tells the screen what to redraw
+    unsigned int store : 2;     // enum RowStore
+    unsigned int hl_known : 1;  // hl_in and hl_out are worked out
+    unsigned int hl_in : 2;     // lexer state the row was lexed from
+    unsigned int hl_out : 2;    // lexer state at its end
+    unsigned int slab_gen : 1;  // compaction of the slab its text is from
+    // screen lines the row takes with wrap, 0 until it is measured, which
+    // counts as one
+    unsigned int vrows : 24;
 } erow_t;
 
+#define VROWS_MAX ((1 << 24) - 1)
+
+// text shared by a register and the rows put from it, each line has a
+// header in front that leads a row back to its block, rows copy their
+// text out before changing it and the block goes once nothing uses it
+struct shared {
+    int refs;
+    int nrows;
+    size_t used;
+    char data[];
+};
+
+struct shared_line {
+    struct shared *block;
+    int len;
+    char text[];
+};
+
+// rows are kept in fixed-size chunks hanging off an implicit treap ordered
+// by position, every node knows how many rows its subtree holds, so looking
+// up, inserting or deleting row N is O(log n) and never touches the tail.
+// The screen lines of the rows are summed the same way, which maps a
+// wrapped screen line to its row and back in O(log n) too
+#define ROPE_CHUNK 64
+
+typedef struct rnode {
+    struct rnode *left;
+    struct rnode *right;
+    unsigned int prio;
+    int count;  // rows in this chunk
+    int total;  // rows in the whole subtree
+    long long vcount;  // screen lines of the rows in this chunk
+    long long vtotal;  // and of the whole subtree
+    erow_t rows[ROPE_CHUNK];
+} rnode_t;
+
+typedef struct rope {
+    rnode_t *root;
+} rope_t;
+
+// view mode keys typed so far, \0 terminated
 typedef struct cmd {
     int size;
-    char chars[10];
+    char chars[16];
+    int reg;    // register picked with "x, 0 for the unnamed one
+    int count;  // rows a : command typed after a count works on
 } cmd_t;
 
-struct EditorConfig {
-    Mode mode;
+// a file being edited, every window showing it shares its rows
+struct buffer {
+    int numrows;  // total amount of rows in the buffer
+    char *filename;
+    int dirty;
+    rope_t rows;
+    // file opened by editor_open, mapped and split into rows on demand
+    char *map;
+    size_t map_size;
+    size_t map_off;  // everything before this offset has been made into rows
+    int partial;  // the file couldn't be read to the end
+    int ondisk;   // the file as saved, for :diff to compare with
+    struct stat mapped;  // the file as it was when mapped
+    // start of every PAGER_CHECKPOINT-th line of the mapped file, for the
+    // index cache
+    size_t *check;
+    int ncheck;
+    int capcheck;
+    int lines;  // lines of the mapped file made into rows
+    struct syntax *syntax;  // NULL when the file isn't highlighted
+    int hl_valid;  // lexer states of the rows before this one are right
+    // and from this one on, as long as they are entered in the state they
+    // were lexed from, INT_MAX when that isn't known
+    int hl_done;
+    int wrap_cols;  // width the screen lines of the rows were counted at
+    struct codec *codec;  // format the file is compressed in, NULL for none
+    struct journal *journal;
+    struct swap *swap;  // NULL when changes aren't logged
+    struct slab *slab;  // NULL until a row is kept in one
+    // where the cursor was when the last window left the buffer
+    int cx;
+    int cy;
+    int rowoff;
+    // where the index cache had the cursor, it is put back once the rows
+    // up to there are split unless it was moved off the first row before
+    int restore;
+    int restore_cx;
+    int restore_cy;
+    int restore_rowoff;
+    struct buffer *next;
+};
+
+// a view of a buffer, windows are stacked on top of each other and each
+// ends in a status bar
+struct window {
+    struct buffer *buf;
     // cursor position
     int cx;
     int cy;
+    int rx;      // screen column of the cursor, cx counts bytes
     int rowoff;  // row offset
     int coloff;  // column offset
+    int vskip;   // with wrap, screen lines of row rowoff above the window
+    int top;     // first screen line
     int screen_rows;
     int screen_cols;
-    int numrows;  // total amount of rows in current buffer
-    char *filename;
-    char status_msg[80];
+    int srow;    // where the cursor is in the window
+    int scol;
+    long long shown_top;  // first line the terminal shows, a screen line with wrap
+    int shown_coloff;     // and the coloff it shows
+    struct window *next;
+};
+
+struct EditorConfig {
+    Mode mode;
+    struct buffer *buf;  // buffer of the window with the cursor
+    struct window *win;  // window with the cursor
+    struct buffer *buffers;
+    struct window *windows;
+    int term_rows;
+    int term_cols;
+    char status_msg[160];
     time_t status_msg_time;
-    int dirty;
-    erow_t *row;
+    unsigned int gen;  // last generation handed out, moves on every edit
+    // given to rows as they are loaded, counting down so they don't meet
+    // the ones edits get
+    unsigned int load_gen;
     cmd_t cmd;
+    char *word;  // pattern of what w and b take for a word
+    int wrap;    // rows too long for the window go on over the lines below
     struct termios orig_termios;
 };
 
 struct EditorConfig config;
 
+// bytes read from the terminal but not handled yet
+struct input {
+    char b[INPUT_SIZE];
+    unsigned int rd;  // free running, masked on access
+    unsigned int wr;
+} input;
+
+struct timer {
+    long long when;  // deadline in ms on the monotonic clock, 0 when idle
+    void (*fn)();
+} timers[TIMER_COUNT];
+
+// where keys come from, frames go and the screen size is found out
+struct term {
+    int fd;  // polled for input, -1 when there is never anything to wait for
+    int (*wait)(int timeout);  // whether input arrives within timeout ms
+    int (*read)(char *buf, int len);  // 0 when there is none, -1 for no more
+    void (*write)(const char *s, int len);
+    int (*size)(int *rows, int *cols);
+};
+
+// the tty by default, the one in memory drives the editor without one
+struct term *term;
+
+enum PerfStage {
+    PERF_READ, PERF_DISPATCH, PERF_SCROLL, PERF_DRAW, PERF_WRITE, PERF_WAIT,
+    PERF_STAGES
+};
+
+// where the time between a key arriving and the frame showing it goes,
+// counted since the start
+struct perf {
+    long long accounted;  // ns put down to any stage so far
+    long long stage[PERF_STAGES];  // ns spent in each, not in those nested
+    long long key_at;  // when input came that no frame shows yet, 0 for none
+    int lat[PERF_SAMPLES];  // us from key to paint of the last ones
+    long long painted;  // frames that showed new input
+    long long frames;
+    long long emitted;  // bytes written to the terminal
+    long long reallocs;  // of frame and row buffers
+    FILE *trace;  // chrome trace events go here, NULL for none
+    int events;
+} perf;
+
+// start of something to time
+struct perf_mark {
+    long long at;
+    long long accounted;
+};
+
+// SIGWINCH handler pokes this, so a resize wakes up the event loop
+int winch_pipe[2] = {-1, -1};
+
+// background save, a forked worker writes the file from its copy-on-write
+// view of the rows and reports how far it got through a pipe
+struct save {
+    pid_t pid;  // 0 when no save is running
+    int fd;     // progress pipe
+    long long total;
+    long long done;
+    struct buffer *buf;  // buffer being saved
+    int dirty;  // its dirty count when the worker was started
+    long long swap_off;  // what its swap file had logged by then
+    char *filename;
+} save = {0, -1, 0, 0, NULL, 0, 0, NULL};
+
+// :follow, the file of a buffer is watched and whatever gets written to it
+// is appended as new rows
+struct follow {
+    struct buffer *buf;  // NULL when nothing is followed
+    int fd;       // the file, read from off on
+    int wfd;      // inotify or kqueue descriptor telling it was written to
+    off_t off;
+    int limit;    // most rows kept, 0 for all of them
+    int partial;  // the last row isn't finished by a newline yet
+} follow = {NULL, -1, -1, 0, 0, 0};
+
+// text read by the loading thread, whole lines but for the last chunk
+struct lchunk {
+    struct lchunk *next;
+    size_t len;
+    char text[];
+};
+
+// pipes and compressed files are read by a thread of their own, which
+// queues what came in for the event loop to make into rows, so the first
+// screen shows and keys work while the rest is still coming. Any number of
+// buffers can be loading at once
+struct load {
+    struct load *next;
+    struct buffer *buf;
+    int fd;      // read by the thread
+    int src;     // file a decompressor reads, -1 for none
+    off_t size;  // of src, its offset says how far the decompressor got
+    pid_t pid;   // decompressor, 0 for none
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct lchunk *head;  // queued and not made into rows yet
+    struct lchunk *tail;
+    int done;    // the thread is finished, all it read is queued
+    int failed;  // reading or decompressing failed
+};
+
+struct loads {
+    struct load *list;  // NULL when nothing is loading
+    int wake[2];  // the threads write a byte for every chunk they queue
+} loads = {NULL, {-1, -1}};
+
+// alen rows of a buffer from a, standing where blen rows of its file
+// from b were
+struct hunk {
+    int a;
+    int alen;
+    int b;
+    int blen;
+};
+
+// :diff compares a buffer with its file as saved, shown read only in a
+// window above it, a thread runs Myers over the hashes of their rows and
+// runs again once the buffer changed and the editor is idle
+struct diff {
+    struct buffer *buf;   // NULL when nothing is compared
+    struct buffer *disk;  // the file as saved
+    struct hunk *hunks;   // what the last finished run found
+    int nhunks;
+    unsigned int gen;     // config.gen of the rows they were found in
+    int announce;         // the first run says what it found
+    // the run going on, the thread owns what is below until it's done
+    int running;
+    int cancel;
+    int wake[2];
+    pthread_t thread;
+    unsigned int run_gen;
+    // hashes of the buffer rows and their gens, which change with the text,
+    // kept for the next run to hash only the rows that got a gen since
+    unsigned long long *ha;
+    unsigned int *ha_gen;
+    int na;
+    unsigned int ha_since;       // config.gen and config.load_gen when hashed
+    unsigned int ha_load_since;
+    unsigned long long *hb;  // of the file rows, made by the first run
+    int nb;
+    struct hunk *out;
+    int nout;
+    int failed;
+} diff;
+
+// rows made from the file for one checkpoint
+struct pager_block {
+    int first;   // first row, a multiple of PAGER_CHECKPOINT
+    int count;   // 0 when unused
+    unsigned int used;  // when it was last looked at
+    erow_t rows[PAGER_CHECKPOINT];
+};
+
+// candy -R, rows aren't kept in the rope but made from the mapped file
+// when they are looked at
+struct pager {
+    int on;
+    char *map;
+    size_t size;
+    size_t pagesize;
+    size_t *check;  // start of row k * PAGER_CHECKPOINT
+    int ncheck;
+    int capcheck;
+    size_t scanned;  // rows before this offset are counted
+    size_t dropped;  // pages before this offset were given back
+    int lines;       // newlines found
+    int cut;         // the file has more than PAGER_MAX_ROWS, size ends there
+    unsigned int clock;
+    struct pager_block blocks[PAGER_BLOCKS];
+} pager;
+
 void editor_set_status_message(const char *fmt, ...);
 void editor_save(char *);
 void editor_del_row(int);
+void editor_del_rows(int at, int n);
+void editor_insert_text_rows(int at, const char *s, size_t len);
+void editor_insert_rows(int at, struct shared *block);
+void editor_shared_unref(struct shared *block, int n);
+void editor_yank_rows(int at, int n);
+void editor_yank_text(int y, int from, int to);
+void editor_put(int after, int count);
+void editor_move_to(const char *arg);
+void editor_clamp_cursor();
+void editor_clamp_window();
 void editor_del_char(int, int);
 void editor_move_cursor(char key);
 void editor_insert_row(int at, char *s, size_t len);
 void editor_refresh_screen();
+void editor_index_rows(int);
 void editor_cli_prompt();
+void editor_wait_event();
+void editor_invalidate_screen();
+void editor_saved(struct buffer *b, const char *filename, long long bytes, int dirty,
+                  long long swap_off);
+void editor_save_progress();
+void editor_save_wait();
+void editor_row_insert_string(int y, int at, const char *s, size_t len);
+void editor_row_del_string(int y, int at, size_t len);
+void editor_undo();
+void editor_redo();
+void editor_search_prompt(int dir);
+void editor_search_next(int dir);
+int editor_search_pending();
+void editor_search_missing(const char *pat);
+void editor_search_step();
+void editor_substitute(const char *cmd, int all);
+void editor_set_option(const char *opt);
+struct rx *rx_get(const char *pat);
+void editor_row_invalidate(int y);
+void editor_row_changed(int y, int at);
+void editor_render_free(struct render *r);
+void editor_render_cut(struct render *r, int at);
+void editor_hl_changed(int at, int n);
+void editor_hl_shift(int at, int delta);
+void editor_select_syntax(const char *filename);
+int editor_hl_pending();
+void editor_hl_step();
+void editor_hl_prepare();
+void editor_search_reset();
+void editor_search_shift(int at, int delta);
+void editor_search_changed(int at, int n);
+void editor_layout();
+void editor_next_window();
+void editor_edit(const char *filename);
+void editor_next_buffer(int dir);
+void editor_list_buffers();
+void editor_split(const char *filename);
+void editor_close_window();
+struct buffer *editor_dirty_buffer();
+erow_t *editor_row(int at);
+erow_t *editor_pager_row(int at);
+void editor_pager_index(int want);
+int editor_pager_pending();
+int editor_pager_refuse();
+int editor_rows_pending();
+void editor_follow_event();
+void editor_load_event();
+void editor_load_wait();
+int editor_loading();
+void editor_follow(const char *arg);
+int editor_open(const char *filename);
+void editor_swap_log(int type, int row, int col, const char *s, size_t len);
+void editor_swap_log_rows(int row, struct shared *block);
+void editor_swap_saved(struct buffer *b, long long keep);
+long long editor_swap_logged(struct buffer *b);
+void editor_swap_open();
+void editor_swap_remove();
+void editor_lcache_load();
+int editor_lcache_restore();
+void editor_lcache_save();
+void editor_add_check(size_t **check, int *n, int *cap, size_t off);
+void editor_index_checks(int before);
+struct perf_mark editor_perf_mark();
+void editor_perf_stage(int stage, struct perf_mark m);
+void editor_perf_frame(int bytes);
+void editor_perf_report();
+void editor_handle_key(char c);
+int editor_slab_copy(erow_t *row, const char *s, size_t len);
+void editor_slab_shift(int at, int delta);
+void editor_slab_rewind(int at);
+int editor_slab_pending();
+void editor_slab_step();
+int editor_wrap_on();
+void editor_wrap_move(int n);
+int editor_diff_pending();
+void editor_diff_start();
+void editor_diff_event();
+void editor_diff_saved(struct buffer *b);
+int editor_diff_color(int filerow);
+void editor_diff(const char *arg);
+void editor_cmd_next_hunk(int count);
+void editor_cmd_prev_hunk(int count);
 
 /*** terminal ***/
 
 void
 die(const char *s)
 {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    term->write("\x1b[2J", 4);
+    term->write("\x1b[H", 3);
     perror(s);
     exit(1);
 }
@@ -68,6 +568,7 @@ die(const char *s)
 void
 disable_raw_mode()
 {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);  // bracketed paste off
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &config.orig_termios) == -1) {
         die("tcsetattr");
     }
@@ -89,25 +590,125 @@ enable_raw_mode()
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | ISIG);
+    // never block in read, the event loop polls before reading
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
         die("tcsetattr");
     }
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);  // bracketed paste on
+}
+
+int
+editor_wait_input(int timeout)
+{
+    return term->wait(timeout);
+}
+
+int
+editor_input_pending()
+{
+    return input.rd != input.wr || editor_wait_input(0);
+}
+
+// read whatever the terminal has for us in one go, returns bytes added
+int
+editor_fill_input()
+{
+    unsigned int used = input.wr - input.rd;
+    unsigned int at = input.wr & (INPUT_SIZE - 1);
+    unsigned int room = INPUT_SIZE - used;
+    if (room > INPUT_SIZE - at) {
+        room = INPUT_SIZE - at;
+    }
+    if (room == 0) {
+        return 0;
+    }
+
+    struct perf_mark m = editor_perf_mark();
+    int nread = term->read(&input.b[at], room);
+    editor_perf_stage(PERF_READ, m);
+    if (nread == -1) {
+        die("read");
+    }
+    if (nread == 0) {
+        return 0;
+    }
+    if (perf.key_at == 0) {
+        perf.key_at = m.at;
+    }
+    input.wr += nread;
+    return nread;
+}
+
+// consume seq if the pending input starts with it, waiting a little for
+// the rest of an escape sequence to arrive
+int
+editor_match_input(const char *seq)
+{
+    unsigned int len = strlen(seq);
+    while (input.wr - input.rd < len) {
+        if (!editor_wait_input(25) || editor_fill_input() == 0) {
+            break;
+        }
+    }
+    for (unsigned int i = 0; i < len; i++) {
+        if (input.rd + i == input.wr || input.b[(input.rd + i) & (INPUT_SIZE - 1)] != seq[i]) {
+            return 0;
+        }
+    }
+    input.rd += len;
+    return 1;
 }
 
 char
 editor_read_key()
 {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) {
-            die("read");
+    if (input.rd == input.wr) {
+        // one wait for the key however many idle passes it takes, not an
+        // event per pass in the trace
+        struct perf_mark m = editor_perf_mark();
+        while (input.rd == input.wr) {
+            editor_wait_event();
+        }
+        editor_perf_stage(PERF_WAIT, m);
+    }
+    return input.b[input.rd++ & (INPUT_SIZE - 1)];
+}
+
+// the terminal we run in
+int
+term_tty_wait(int timeout)
+{
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, timeout) > 0;
+}
+
+int
+term_tty_read(char *buf, int len)
+{
+    int nread = read(STDIN_FILENO, buf, len);
+    if (nread == -1 && errno == EAGAIN) {
+        return 0;
+    }
+    return nread;
+}
+
+void
+term_tty_write(const char *s, int len)
+{
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, s, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
         }
+        s += n;
+        len -= n;
     }
-    return c;
 }
 
 int
@@ -121,7 +722,7 @@ get_cursor_position(int *rows, int *cols)
     }
 
     while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+        if (!term_tty_wait(100) || read(STDIN_FILENO, &buf[i], 1) != 1) {
             break;
         }
         if (buf[i] == 'R') {
@@ -158,577 +759,8649 @@ get_window_size(int *rows, int *cols)
     
 }
 
-/*** command buffer ***/
+struct term term_tty = {
+    STDIN_FILENO, term_tty_wait, term_tty_read, term_tty_write, get_window_size
+};
 
-void
-editor_process_cmd(char c)
-{
-    config.cmd.chars[config.cmd.size] = c;
-    config.cmd.size++;
+struct term *term = &term_tty;
 
-    // flag to show, that cmd in buffer executed and we need to clear it
-    int exec = 0;
+/*** events ***/
 
-    switch (config.cmd.chars[0]) {
-        case ':':
-            editor_cli_prompt();
-            exec = 1;
-            break;
-        case '\r':
-            exec = 1;
-            break;
-        case 'b':
-        case 'w':
-        case '$':
-        case '0':
-        case CTRLKEY('d'):
-        case CTRLKEY('u'):
-        case 'j':
-        case 'k':
-        case 'h':
-        case 'l':
-            exec = 1;
-            editor_move_cursor(c);
-            break;
-        case 'i':
-            exec = 1;
-            config.mode = INSERT;
-            break;
-        case 'a':
-            config.cx += 1;
-            config.mode = INSERT;
-            exec = 1;
-            break;
-        case 'o':
-            editor_insert_row(config.cy + 1, "", 0);
-            exec = 1;
-            config.mode = INSERT;
-            config.cy++;
-            config.cx = 0;
-            break;
-        case 'Z':
-            editor_save(NULL);
-            exec = 1;
-            break;
-        case 'x':
-            exec = 1;
-            break;
-        case 'X':
-            exec = 1;
-            editor_del_char(-1, -1);
-            break;
-        case 'G':
-            config.cy = config.numrows - 1;
-            exec = 1;
-            break;
-        // compound commands
-        case 'd':
-            switch (config.cmd.chars[1]) {
-                case '_':
-                    break;
-                case 'd':
-                    editor_del_row(config.cy);
-                    exec = 1;
-                    break;
-                default:
-                    exec = 1;
-                    break;
-            }
-            break;
-        case 'g':
-            switch (config.cmd.chars[1]) {
-                case '_':
-                    break;
-                case 'g':
-                    config.cy = 0;
-                    exec = 1;
-                    break;
-                default:
-                    exec = 1;
-                    break;
-            }
-            break;
-        default:
-            exec = 1;
-            break;
-    }
-    if (exec) {
-        config.cmd.size = 0;
-        for (int i = 0; i < 10; i++) {
-            config.cmd.chars[i] = '_';
-        }
-    }
+long long
+editor_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-/*** Cli prompt ***/
-
 void
-editor_cli_prompt()
+editor_set_timer(int id, int ms, void (*fn)())
 {
-    size_t bufsize = 20;
-    char *buf;
-    if ((buf = malloc(bufsize)) == NULL) {
-        return;
-    }
-    size_t buflen = 1;
-    buf[0] = ':';
-    buf[1] = '\0';
+    timers[id].when = editor_now_ms() + ms;
+    timers[id].fn = fn;
+}
 
-    while (1) {
-        editor_set_status_message(buf);
-        editor_refresh_screen();
-        
-        char c = editor_read_key();
-        if (c == '\r') {
-            editor_set_status_message("");
-            break;
-        } else if (c == '\x1b') {
-            editor_set_status_message("");
-            config.mode = VIEW;
-            return;
-        } else if (c == 127) {
-            if (buflen == 1) {
-                editor_set_status_message("");
-                config.mode = VIEW;
-                return;
-            } else {
-                buflen--;
-                buf[buflen] = '\0';
-                continue;
-            }
-        } else {
-            if (buflen >= bufsize) {
-                continue;
-            } else {
-                buf[buflen] = c;
-                buf[buflen + 1] = '\0';
-                buflen++;
-            }
+// ms until the closest timer is due, -1 when none is armed
+int
+editor_next_timeout()
+{
+    long long now = editor_now_ms();
+    int timeout = -1;
+    for (int i = 0; i < TIMER_COUNT; i++) {
+        if (timers[i].when == 0) {
+            continue;
+        }
+        long long left = timers[i].when - now;
+        left = left < 0 ? 0 : left;
+        if (timeout == -1 || left < timeout) {
+            timeout = left;
         }
     }
-    char *filename;
-    int fn_size = 0;
-
-    switch (buf[1]) {
-        case 'w':
-            if ((filename = malloc(255)) == NULL) {
-                return;
-            }
-            filename[fn_size] = '\0';
-
-            char *fn_start = &buf[2];
-            while (*fn_start == ' '
-                   && fn_start < &buf[bufsize]
-                   && *fn_start != '\0') {
-                fn_start++;
-            }
-
-            while (*fn_start != ' '
-                   && fn_size < 254
-                   && fn_start < &buf[bufsize]
-                   && *fn_start != '\0') {
-                filename[fn_size] = *fn_start;
-                filename[fn_size + 1] = '\0';
-                fn_size++;
-                fn_start++;
-            }
-
-            editor_save(fn_size ? filename : NULL);
-            break;
-        case 'q':
-            switch (buf[2]) {
-                case '!':
-                    write(STDOUT_FILENO, "\x1b[2J", 4);
-                    write(STDOUT_FILENO, "\x1b[H", 3);
-                    exit(0);
-                default:
-                    if (config.dirty) {
-                        editor_set_status_message("save file before or q!");
-                    } else {
-                        write(STDOUT_FILENO, "\x1b[2J", 4);
-                        write(STDOUT_FILENO, "\x1b[H", 3);
-                        exit(0);
-                    }
-            }
-            break;
-        default:
-            editor_set_status_message("Undefined cmd: %s", &buf[1]);
-            break;
-    }
+    return timeout;
 }
 
-/*** Append buffer ***/
-
-#define ABUF_INIT {NULL, 0}
-
-// Append buffer
-struct abuf {
-    char *b;
-    int len;
-};
-
 void
-ab_append(struct abuf *ab, const char *s, int len)
+editor_run_timers()
 {
-    char *new = realloc(ab->b, ab->len + len);
-    if (new == NULL) {
-        return;
+    long long now = editor_now_ms();
+    for (int i = 0; i < TIMER_COUNT; i++) {
+        if (timers[i].when != 0 && timers[i].when <= now) {
+            timers[i].when = 0;
+            timers[i].fn();
+        }
     }
-    
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
 }
 
 void
-ab_free(struct  abuf *ab)
+editor_sigwinch(int sig)
 {
-    free(ab->b);
+    (void)sig;
+    int saved = errno;
+    write(winch_pipe[1], "", 1);
+    errno = saved;
 }
 
-/*** row operations ***/
-
 void
-editor_insert_row(int at, char *s, size_t len)
+editor_init_events()
 {
-    if (at < 0 || at > config.numrows) {
-        return;
+    if (pipe(winch_pipe) == -1) {
+        die("pipe");
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(winch_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(winch_pipe[i], F_SETFD, FD_CLOEXEC);
     }
 
-    erow_t *n_row = realloc(config.row, sizeof(erow_t) * (config.numrows + 1));
-    if (n_row == NULL) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editor_sigwinch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGWINCH, &sa, NULL) == -1) {
+        die("sigaction");
+    }
+    // a compressor dying mid save shows up as a failed write instead
+    signal(SIGPIPE, SIG_IGN);
+}
+
+void
+editor_handle_resize()
+{
+    char buf[64];
+    while (read(winch_pipe[0], buf, sizeof(buf)) > 0) {
+        ;
+    }
+    if (term->size(&config.term_rows, &config.term_cols) == -1) {
+        die("get_window_size");
+    }
+    editor_layout();
+    editor_refresh_screen();
+}
+
+// sleep until there is input, the window was resized or a timer is due,
+// work that can be done in the background runs while nothing else happens
+void
+editor_wait_event()
+{
+    int idle = editor_rows_pending() || editor_search_pending()
+        || editor_hl_pending() || editor_slab_pending() || editor_diff_pending();
+    // input kept in memory is never waited for
+    int timeout = idle || term->fd == -1 ? 0 : editor_next_timeout();
+
+    struct pollfd pfd[6] = {
+        {term->fd, POLLIN, 0},
+        {winch_pipe[0], POLLIN, 0},
+        {save.fd, POLLIN, 0},  // ignored by poll while it is -1
+        {follow.wfd, POLLIN, 0},
+        {loads.list != NULL ? loads.wake[0] : -1, POLLIN, 0},
+        {diff.running ? diff.wake[0] : -1, POLLIN, 0},
+    };
+    int n = poll(pfd, 6, timeout);
+    if (n == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+        die("poll");
+    }
+
+    if (pfd[1].revents & POLLIN) {
+        editor_handle_resize();
+    }
+    if (pfd[2].revents & (POLLIN | POLLHUP)) {
+        editor_save_progress();
+    }
+    if (pfd[3].revents & POLLIN) {
+        editor_follow_event();
+    }
+    if (pfd[4].revents & POLLIN) {
+        editor_load_event();
+    }
+    if (pfd[5].revents & POLLIN) {
+        editor_diff_event();
+    }
+    // out of keys in memory is only the end once there is nothing else to do
+    int more = term->fd == -1 && (term->wait(0) || !idle);
+    if ((pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) || more) {
+        if (editor_fill_input() == 0 && (pfd[0].revents & (POLLHUP | POLLERR))) {
+            die("read");
+        }
+    }
+    editor_run_timers();
+
+    if (n == 0 && idle) {
+        // keep splitting the mapped file while the user is not typing
+        if (editor_rows_pending()) {
+            editor_index_rows(config.buf->numrows + INDEX_STEP);
+            if (editor_lcache_restore() || !editor_rows_pending()) {
+                editor_refresh_screen();
+            }
+        }
+        if (editor_search_pending()) {
+            editor_search_step();
+        }
+        if (editor_hl_pending()) {
+            editor_hl_step();
+        }
+        if (editor_slab_pending()) {
+            editor_slab_step();
+        }
+        if (editor_diff_pending()) {
+            editor_diff_start();
+        }
+    }
+}
+
+/*** perf ***/
+
+char *perf_names[PERF_STAGES] = {"read", "dispatch", "scroll", "draw", "write", "wait"};
+
+struct perf_mark
+editor_perf_mark()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    struct perf_mark m = {(long long)ts.tv_sec * 1000000000LL + ts.tv_nsec, perf.accounted};
+    return m;
+}
+
+void
+editor_perf_event(const char *name, long long from, long long to)
+{
+    fprintf(perf.trace, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}\n",
+            perf.events++ ? "," : "", name, from / 1e3, (to - from) / 1e3);
+}
+
+// put the time since m down to stage, less what stages nested in it took
+void
+editor_perf_stage(int stage, struct perf_mark m)
+{
+    struct perf_mark now = editor_perf_mark();
+    long long spent = now.at - m.at;
+    perf.stage[stage] += spent - (perf.accounted - m.accounted);
+    perf.accounted = m.accounted + spent;
+    if (perf.trace != NULL) {
+        editor_perf_event(perf_names[stage], m.at, now.at);
+    }
+}
+
+// a frame was written, it shows the input that came in before
+void
+editor_perf_frame(int bytes)
+{
+    perf.frames++;
+    perf.emitted += bytes;
+    if (perf.key_at == 0) {
+        return;
+    }
+    long long now = editor_perf_mark().at;
+    perf.lat[perf.painted++ % PERF_SAMPLES] = (now - perf.key_at) / 1000;
+    if (perf.trace != NULL) {
+        editor_perf_event("key to paint", perf.key_at, now);
+    }
+    perf.key_at = 0;
+}
+
+int
+editor_perf_cmp(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// :perf, latency percentiles and where the time of a frame goes
+void
+editor_perf_report()
+{
+    int n = perf.painted < PERF_SAMPLES ? perf.painted : PERF_SAMPLES;
+    if (n == 0) {
+        editor_set_status_message("No keys timed yet");
+        return;
+    }
+    int lat[PERF_SAMPLES];
+    memcpy(lat, perf.lat, n * sizeof(int));
+    qsort(lat, n, sizeof(int), editor_perf_cmp);
+
+    char stages[96];
+    int len = 0;
+    for (int i = 0; i < PERF_WAIT && len < (int)sizeof(stages); i++) {
+        len += snprintf(stages + len, sizeof(stages) - len, " %s %lld",
+                        perf_names[i], perf.stage[i] / 1000 / perf.frames);
+    }
+    editor_set_status_message("key to paint p50 %.2fms p99 %.2fms of %d, us/frame%s, %lld bytes/frame, %lld reallocs",
+                              lat[n / 2] / 1e3, lat[n * 99 / 100] / 1e3, n, stages,
+                              perf.emitted / perf.frames, perf.reallocs);
+}
+
+void
+editor_perf_trace_end()
+{
+    fprintf(perf.trace, "]\n");
+    fclose(perf.trace);
+}
+
+// --trace file, every stage timed goes there as a chrome trace event, the
+// closing bracket is optional so a trace cut short still loads
+void
+editor_perf_trace(const char *filename)
+{
+    if ((perf.trace = fopen(filename, "w")) == NULL) {
+        perror(filename);
+        exit(1);
+    }
+    fprintf(perf.trace, "[\n");
+    atexit(editor_perf_trace_end);
+}
+
+/*** command buffer ***/
+
+// view mode keys go through a small grammar: [count] command, or
+// [count] operator [count] motion, where the operator doubled means whole
+// rows, as in 5dd, d10j or 100G
+enum KeyFlags {
+    K_MOTION = 1,     // moves the cursor, an operator can be applied over it
+    K_LINEWISE = 2,   // an operator over it takes whole rows
+    K_FORWARD = 4,    // moves forward within the row
+    K_TO_END = 8,     // an operator over it runs through the end of the row
+    K_EDIT = 16,      // changes the buffer
+    K_OPERATOR = 32   // waits for a motion
+};
+
+// counts past this are taken as this, it is more rows than a file can have
+#define CMD_COUNT_MAX 100000000
+
+struct keymap {
+    char *keys;
+    int flags;
+    void (*fn)(int count);  // count is 0 when none was typed
+    void (*op)(int y0, int x0, int y1, int x1, int linewise);
+};
+
+int
+editor_count(int count)
+{
+    return count ? count : 1;
+}
+
+void
+editor_cmd_move(char key, int count)
+{
+    for (int i = editor_count(count); i > 0; i--) {
+        editor_move_cursor(key);
+    }
+}
+
+void
+editor_cmd_left(int count)
+{
+    editor_cmd_move('h', count);
+}
+
+void
+editor_cmd_right(int count)
+{
+    editor_cmd_move('l', count);
+}
+
+void
+editor_cmd_word(int count)
+{
+    editor_cmd_move('w', count);
+}
+
+void
+editor_cmd_word_back(int count)
+{
+    editor_cmd_move('b', count);
+}
+
+void
+editor_cmd_line_start(int count)
+{
+    (void)count;
+    editor_move_cursor('0');
+}
+
+void
+editor_cmd_line_end(int count)
+{
+    (void)count;
+    editor_move_cursor('$');
+}
+
+void
+editor_cmd_half_down(int count)
+{
+    editor_cmd_move(CTRLKEY('d'), count);
+}
+
+void
+editor_cmd_half_up(int count)
+{
+    editor_cmd_move(CTRLKEY('u'), count);
+}
+
+// an absolute row move, clamped to the file
+void
+editor_cmd_goto(int y)
+{
+    editor_index_rows(y + 1);
+    int last = config.buf->numrows > 0 ? config.buf->numrows - 1 : 0;
+    config.win->cy = y < 0 ? 0 : y > last ? last : y;
+    editor_move_cursor('\0');  // puts cx back on the row
+}
+
+void
+editor_cmd_down(int count)
+{
+    editor_cmd_goto(config.win->cy + editor_count(count));
+}
+
+void
+editor_cmd_up(int count)
+{
+    editor_cmd_goto(config.win->cy - editor_count(count));
+}
+
+void
+editor_cmd_last_row(int count)
+{
+    if (count == 0) {
+        editor_index_rows(INT_MAX);
+        count = config.buf->numrows;
+    }
+    editor_cmd_goto(count - 1);
+    if (count == config.buf->numrows && editor_loading()) {
+        editor_set_status_message("Still loading %s, %d lines so far",
+                                  config.buf->filename, config.buf->numrows);
+    }
+}
+
+void
+editor_cmd_first_row(int count)
+{
+    editor_cmd_goto(editor_count(count) - 1);
+}
+
+void
+editor_cmd_prompt(int count)
+{
+    config.cmd.count = editor_count(count);
+    editor_cli_prompt();
+}
+
+void
+editor_cmd_insert(int count)
+{
+    (void)count;
+    config.mode = INSERT;
+}
+
+void
+editor_cmd_append(int count)
+{
+    (void)count;
+    config.win->cx += 1;
+    config.mode = INSERT;
+}
+
+void
+editor_cmd_open_row(int count)
+{
+    (void)count;
+    editor_insert_row(config.win->cy + 1, "", 0);
+    config.mode = INSERT;
+    config.win->cy++;
+    config.win->cx = 0;
+}
+
+void
+editor_cmd_save(int count)
+{
+    (void)count;
+    editor_save(NULL);
+}
+
+void
+editor_cmd_del_back(int count)
+{
+    for (int i = editor_count(count); i > 0; i--) {
+        editor_del_char(-1, -1);
+    }
+}
+
+void
+editor_cmd_search(int count)
+{
+    (void)count;
+    editor_search_prompt(1);
+}
+
+void
+editor_cmd_search_back(int count)
+{
+    (void)count;
+    editor_search_prompt(-1);
+}
+
+void
+editor_cmd_next(int count)
+{
+    for (int i = editor_count(count); i > 0; i--) {
+        editor_search_next(1);
+    }
+}
+
+void
+editor_cmd_prev(int count)
+{
+    for (int i = editor_count(count); i > 0; i--) {
+        editor_search_next(-1);
+    }
+}
+
+void
+editor_cmd_undo(int count)
+{
+    for (int i = editor_count(count); i > 0; i--) {
+        editor_undo();
+    }
+}
+
+void
+editor_cmd_redo(int count)
+{
+    for (int i = editor_count(count); i > 0; i--) {
+        editor_redo();
+    }
+}
+
+void
+editor_cmd_put(int count)
+{
+    editor_put(1, editor_count(count));
+}
+
+void
+editor_cmd_put_before(int count)
+{
+    editor_put(0, editor_count(count));
+}
+
+void
+editor_cmd_window(int count)
+{
+    for (int i = editor_count(count); i > 0; i--) {
+        editor_next_window();
+    }
+}
+
+// d, rows y0 to y1 when linewise, else the text between x0 and x1 on row y0
+void
+editor_op_delete(int y0, int x0, int y1, int x1, int linewise)
+{
+    if (linewise) {
+        int from = y0 < y1 ? y0 : y1;
+        int to = y0 < y1 ? y1 : y0;
+        editor_yank_rows(from, to - from + 1);
+        editor_del_rows(from, to - from + 1);
+        config.win->cy = from;
+        config.win->cx = 0;
+        // the last rows went, the cursor goes up to the new last
+        editor_clamp_cursor();
+        return;
+    }
+    int from = x0 < x1 ? x0 : x1;
+    int to = x0 < x1 ? x1 : x0;
+    if (to > from) {
+        editor_yank_text(y0, from, to);
+        editor_row_del_string(y0, from, to - from);
+    }
+    config.win->cy = y0;
+    config.win->cx = from;
+    editor_move_cursor('\0');
+}
+
+// y, the same spans as d, the cursor goes to the start of what was taken
+void
+editor_op_yank(int y0, int x0, int y1, int x1, int linewise)
+{
+    int from = linewise ? (y0 < y1 ? y0 : y1) : (x0 < x1 ? x0 : x1);
+    int to = linewise ? (y0 < y1 ? y1 : y0) : (x0 < x1 ? x1 : x0);
+    if (linewise) {
+        editor_yank_rows(from, to - from + 1);
+        config.win->cy = from;
+    } else if (to > from) {
+        editor_yank_text(y0, from, to);
+        config.win->cx = from;
+    }
+    editor_move_cursor('\0');
+}
+
+struct keymap keymap[] = {
+    {"h", K_MOTION, editor_cmd_left, NULL},
+    {"l", K_MOTION | K_FORWARD, editor_cmd_right, NULL},
+    {"w", K_MOTION | K_FORWARD, editor_cmd_word, NULL},
+    {"b", K_MOTION, editor_cmd_word_back, NULL},
+    {"0", K_MOTION, editor_cmd_line_start, NULL},
+    {"$", K_MOTION | K_FORWARD | K_TO_END, editor_cmd_line_end, NULL},
+    {"j", K_MOTION | K_LINEWISE, editor_cmd_down, NULL},
+    {"k", K_MOTION | K_LINEWISE, editor_cmd_up, NULL},
+    {"\x04", K_MOTION | K_LINEWISE, editor_cmd_half_down, NULL},
+    {"\x15", K_MOTION | K_LINEWISE, editor_cmd_half_up, NULL},
+    {"G", K_MOTION | K_LINEWISE, editor_cmd_last_row, NULL},
+    {"gg", K_MOTION | K_LINEWISE, editor_cmd_first_row, NULL},
+    {":", 0, editor_cmd_prompt, NULL},
+    {"i", K_EDIT, editor_cmd_insert, NULL},
+    {"a", K_EDIT, editor_cmd_append, NULL},
+    {"o", K_EDIT, editor_cmd_open_row, NULL},
+    {"Z", K_EDIT, editor_cmd_save, NULL},
+    {"X", K_EDIT, editor_cmd_del_back, NULL},
+    {"/", 0, editor_cmd_search, NULL},
+    {"?", 0, editor_cmd_search_back, NULL},
+    {"n", 0, editor_cmd_next, NULL},
+    {"N", 0, editor_cmd_prev, NULL},
+    {"u", K_EDIT, editor_cmd_undo, NULL},
+    {"\x12", K_EDIT, editor_cmd_redo, NULL},
+    {"\x17w", 0, editor_cmd_window, NULL},
+    {"\x17\x17", 0, editor_cmd_window, NULL},
+    {"p", K_EDIT, editor_cmd_put, NULL},
+    {"P", K_EDIT, editor_cmd_put_before, NULL},
+    {"d", K_EDIT | K_OPERATOR, NULL, editor_op_delete},
+    {"y", K_OPERATOR, NULL, editor_op_yank},
+    {"]c", K_MOTION | K_LINEWISE, editor_cmd_next_hunk, NULL},
+    {"[c", K_MOTION | K_LINEWISE, editor_cmd_prev_hunk, NULL},
+};
+
+#define KEYMAP_ENTRIES (sizeof(keymap) / sizeof(keymap[0]))
+
+// the entry keys start with, NULL when there is none, *more tells whether
+// keys could still grow into one
+struct keymap *
+editor_keymap_find(const char *keys, int len, int *more)
+{
+    *more = 0;
+    for (unsigned int i = 0; i < KEYMAP_ENTRIES; i++) {
+        int klen = strlen(keymap[i].keys);
+        if (len >= klen && memcmp(keys, keymap[i].keys, klen) == 0) {
+            return &keymap[i];
+        }
+        if (strncmp(keys, keymap[i].keys, len) == 0) {
+            *more = 1;
+        }
+    }
+    return NULL;
+}
+
+// a count at keys[*at], 0 when there is none, a lone 0 is the motion
+int
+editor_parse_count(const char *keys, int len, int *at)
+{
+    int count = 0;
+    while (*at < len && keys[*at] >= (count ? '0' : '1') && keys[*at] <= '9') {
+        if (count < CMD_COUNT_MAX / 10) {
+            count = count * 10 + keys[*at] - '0';
+        }
+        (*at)++;
+    }
+    return count;
+}
+
+// apply op over where motion m takes the cursor
+void
+editor_operate(struct keymap *op, struct keymap *m, int count)
+{
+    int y0 = config.win->cy;
+    int x0 = config.win->cx;
+    m->fn(count);
+    int y1 = config.win->cy;
+    int x1 = config.win->cx;
+    config.win->cy = y0;
+    config.win->cx = x0;
+
+    int linewise = (m->flags & K_LINEWISE) != 0;
+    if (!linewise) {
+        // charwise stays on the row, a motion that leaves it or gets
+        // nowhere forward takes in the rest of the row
+        erow_t *row = editor_row(y0);
+        if (row == NULL) {
+            return;
+        }
+        if ((m->flags & K_TO_END) || ((m->flags & K_FORWARD) && (y1 != y0 || x1 <= x0))) {
+            x1 = row->size;
+        } else if (y1 != y0) {
+            x1 = 0;
+        }
+        y1 = y0;
+    }
+    op->op(y0, x0, y1, x1, linewise);
+}
+
+// run what the keys so far say, 0 while they aren't a whole command yet
+int
+editor_run_cmd(const char *keys, int len)
+{
+    int at = 0;
+    int more;
+    config.cmd.reg = 0;
+    if (keys[0] == '"') {
+        if (len < 2) {
+            return 0;
+        }
+        if (keys[1] < 'a' || keys[1] > 'z') {
+            return 1;
+        }
+        config.cmd.reg = keys[1] - 'a' + 1;
+        at = 2;
+    }
+    int count = editor_parse_count(keys, len, &at);
+    struct keymap *k = editor_keymap_find(keys + at, len - at, &more);
+    if (k == NULL) {
+        return !more;
+    }
+    if ((k->flags & K_EDIT) && editor_pager_refuse()) {
+        return 1;
+    }
+    if (!(k->flags & K_OPERATOR)) {
+        k->fn(count);
+        return 1;
+    }
+
+    at += strlen(k->keys);
+    int count2 = editor_parse_count(keys, len, &at);
+    if (count2) {
+        long long n = (long long)editor_count(count) * count2;
+        count = n < CMD_COUNT_MAX ? n : CMD_COUNT_MAX;
+    }
+    if (at == len) {
+        return 0;
+    }
+    if (strcmp(keys + at, k->keys) == 0) {
+        // doubled, count rows from the cursor on
+        int y = config.win->cy;
+        k->op(y, 0, y + editor_count(count) - 1, 0, 1);
+        return 1;
+    }
+    struct keymap *m = editor_keymap_find(keys + at, len - at, &more);
+    if (m == NULL) {
+        return !more && strncmp(keys + at, k->keys, len - at) != 0;
+    }
+    if (m->flags & K_MOTION) {
+        editor_operate(k, m, count);
+    }
+    return 1;
+}
+
+void
+editor_process_cmd(char c)
+{
+    cmd_t *cmd = &config.cmd;
+    cmd->chars[cmd->size] = c;
+    cmd->size++;
+
+    // clear it once it ran, or once it can't become anything
+    if (editor_run_cmd(cmd->chars, cmd->size) || cmd->size == sizeof(cmd->chars) - 1) {
+        cmd->size = 0;
+        memset(cmd->chars, '\0', sizeof(cmd->chars));
+    }
+}
+
+/*** Cli prompt ***/
+
+// argument of a command with the blanks around it dropped, NULL when there
+// is none
+char *
+editor_cmd_arg(char *s)
+{
+    while (*s == ' ') {
+        s++;
+    }
+    size_t len = strlen(s);
+    while (len > 0 && s[len - 1] == ' ') {
+        s[--len] = '\0';
+    }
+    return len > 0 ? s : NULL;
+}
+
+void
+editor_cli_prompt()
+{
+    size_t bufsize = 256;
+    char *buf;
+    if ((buf = malloc(bufsize)) == NULL) {
+        return;
+    }
+    size_t buflen = 1;
+    buf[0] = ':';
+    buf[1] = '\0';
+
+    while (1) {
+        editor_set_status_message("%s", buf);
+        if (!editor_input_pending()) {
+            editor_refresh_screen();
+        }
+        
+        char c = editor_read_key();
+        if (c == '\r') {
+            editor_set_status_message("");
+            break;
+        } else if (c == '\x1b') {
+            editor_set_status_message("");
+            config.mode = VIEW;
+            return;
+        } else if (c == 127) {
+            if (buflen == 1) {
+                editor_set_status_message("");
+                config.mode = VIEW;
+                return;
+            } else {
+                buflen--;
+                buf[buflen] = '\0';
+                continue;
+            }
+        } else {
+            if (buflen + 1 >= bufsize) {
+                continue;
+            } else {
+                buf[buflen] = c;
+                buf[buflen + 1] = '\0';
+                buflen++;
+            }
+        }
+    }
+    char *filename;
+    int fn_size = 0;
+
+    // writing, substituting and opening other files need rows of their own
+    if (buf[1] != '\0' && strchr("ws%efm", buf[1]) != NULL
+        && strncmp(&buf[1], "set ", 4) != 0 && strcmp(&buf[1], "sp") != 0
+        && editor_pager_refuse()) {
+        return;
+    }
+
+    switch (buf[1]) {
+        case 'w':
+            if ((filename = malloc(255)) == NULL) {
+                return;
+            }
+            filename[fn_size] = '\0';
+
+            char *fn_start = &buf[2];
+            while (*fn_start == ' '
+                   && fn_start < &buf[bufsize]
+                   && *fn_start != '\0') {
+                fn_start++;
+            }
+
+            while (*fn_start != ' '
+                   && fn_size < 254
+                   && fn_start < &buf[bufsize]
+                   && *fn_start != '\0') {
+                filename[fn_size] = *fn_start;
+                filename[fn_size + 1] = '\0';
+                fn_size++;
+                fn_start++;
+            }
+
+            editor_save(fn_size ? filename : NULL);
+            break;
+        case 'e':
+            if (buf[2] == ' ' && editor_cmd_arg(&buf[3]) != NULL) {
+                editor_edit(editor_cmd_arg(&buf[3]));
+            } else {
+                editor_set_status_message("Usage: e file");
+            }
+            break;
+        case 'b':
+            if (strcmp(&buf[1], "bn") == 0 || strcmp(&buf[1], "bp") == 0) {
+                editor_next_buffer(buf[2] == 'n' ? 1 : -1);
+            } else {
+                editor_set_status_message("Undefined cmd: %s", &buf[1]);
+            }
+            break;
+        case 'd':
+            if (strncmp(&buf[1], "diff", 4) == 0 && (buf[5] == ' ' || buf[5] == '\0')) {
+                editor_diff(editor_cmd_arg(&buf[5]));
+            } else {
+                editor_set_status_message("Undefined cmd: %s", &buf[1]);
+            }
+            break;
+        case 'p':
+            if (strcmp(&buf[1], "perf") == 0) {
+                editor_perf_report();
+            } else {
+                editor_set_status_message("Undefined cmd: %s", &buf[1]);
+            }
+            break;
+        case 'f':
+            if (strncmp(&buf[1], "follow", 6) == 0 && (buf[7] == ' ' || buf[7] == '\0')) {
+                editor_follow(editor_cmd_arg(&buf[7]));
+            } else {
+                editor_set_status_message("Undefined cmd: %s", &buf[1]);
+            }
+            break;
+        case 'm':
+            if (buf[2] == ' ' && editor_cmd_arg(&buf[3]) != NULL) {
+                editor_move_to(editor_cmd_arg(&buf[3]));
+            } else {
+                editor_set_status_message("Usage: m row");
+            }
+            break;
+        case 'l':
+            if (strcmp(&buf[1], "ls") == 0) {
+                editor_list_buffers();
+            } else {
+                editor_set_status_message("Undefined cmd: %s", &buf[1]);
+            }
+            break;
+        case 's':
+            if (strncmp(&buf[1], "set ", 4) == 0) {
+                editor_set_option(&buf[5]);
+            } else if (strncmp(&buf[1], "sp", 2) == 0 && (buf[3] == ' ' || buf[3] == '\0')) {
+                editor_split(editor_cmd_arg(&buf[3]));
+            } else {
+                editor_substitute(&buf[1], 0);
+            }
+            break;
+        case '%':
+            if (buf[2] == 's') {
+                editor_substitute(&buf[2], 1);
+            } else {
+                editor_set_status_message("Undefined cmd: %s", &buf[1]);
+            }
+            break;
+        case 'q':
+            switch (buf[2]) {
+                case '!':
+                    editor_swap_remove();
+                    editor_lcache_save();
+                    term->write("\x1b[2J", 4);
+                    term->write("\x1b[H", 3);
+                    exit(0);
+                default:
+                    if (config.windows->next != NULL) {
+                        editor_close_window();
+                        break;
+                    }
+                    editor_save_wait();
+                    if (editor_dirty_buffer() == config.buf) {
+                        editor_set_status_message("save file before or q!");
+                    } else if (editor_dirty_buffer() != NULL) {
+                        editor_set_status_message("save %s before or q!",
+                                                  editor_dirty_buffer()->filename);
+                    } else {
+                        editor_swap_remove();
+                        editor_lcache_save();
+                        term->write("\x1b[2J", 4);
+                        term->write("\x1b[H", 3);
+                        exit(0);
+                    }
+            }
+            break;
+        default:
+            editor_set_status_message("Undefined cmd: %s", &buf[1]);
+            break;
+    }
+}
+
+// :set name=value, and :set name to show the value
+void
+editor_set_option(const char *opt)
+{
+    while (*opt == ' ') {
+        opt++;
+    }
+    if (strcmp(opt, "wrap") == 0 || strcmp(opt, "nowrap") == 0) {
+        config.wrap = opt[0] == 'w';
+        if (config.wrap && pager.on) {
+            editor_set_status_message("No wrap with -R, rows aren't kept");
+        }
+        editor_invalidate_screen();
+        return;
+    }
+    if (strncmp(opt, "word", 4) != 0 || (opt[4] != '=' && opt[4] != '\0')) {
+        editor_set_status_message("Unknown option: %s", opt);
+        return;
+    }
+    if (opt[4] == '\0') {
+        editor_set_status_message("word=%s", config.word);
+        return;
+    }
+    char *word = strdup(&opt[5]);
+    if (word == NULL) {
+        return;
+    }
+    if (rx_get(word) == NULL) {
+        editor_set_status_message("Invalid pattern: %s", word);
+        free(word);
+        return;
+    }
+    free(config.word);
+    config.word = word;
+}
+
+/*** Append buffer ***/
+
+#define ABUF_INIT {NULL, 0, 0}
+
+// Append buffer
+struct abuf {
+    char *b;
+    int len;
+    int cap;
+};
+
+// screen contents are built here, the memory is kept between refreshes
+struct abuf frame = ABUF_INIT;
+
+// make room for len more bytes, growing geometrically
+int
+ab_reserve(struct abuf *ab, int len)
+{
+    if (ab->len + len <= ab->cap) {
+        return 0;
+    }
+    int n_cap = ab->cap ? ab->cap * 2 : 1024;
+    while (n_cap < ab->len + len) {
+        n_cap *= 2;
+    }
+    char *new = realloc(ab->b, n_cap);
+    perf.reallocs++;
+    if (new == NULL) {
+        return -1;
+    }
+    ab->b = new;
+    ab->cap = n_cap;
+    return 0;
+}
+
+void
+ab_append(struct abuf *ab, const char *s, int len)
+{
+    if (len <= 0 || ab_reserve(ab, len) == -1) {
+        return;
+    }
+    
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
+}
+
+void
+ab_fill(struct abuf *ab, char c, int len)
+{
+    if (len <= 0 || ab_reserve(ab, len) == -1) {
+        return;
+    }
+
+    memset(&ab->b[ab->len], c, len);
+    ab->len += len;
+}
+
+void
+ab_free(struct  abuf *ab)
+{
+    free(ab->b);
+}
+
+/*** memory terminal ***/
+
+// keys fed from a buffer and frames kept in another, so rendering can be
+// timed or compared frame by frame without a pty
+struct term_mem {
+    struct abuf in;
+    int in_off;      // how far the editor has read in
+    struct abuf out;  // everything written since it was last emptied
+    int rows;
+    int cols;
+} term_mem = {ABUF_INIT, 0, ABUF_INIT, 24, 80};
+
+int
+term_mem_wait(int timeout)
+{
+    (void)timeout;  // nothing more arrives while we wait
+    return term_mem.in_off < term_mem.in.len;
+}
+
+int
+term_mem_read(char *buf, int len)
+{
+    int left = term_mem.in.len - term_mem.in_off;
+    if (left == 0) {
+        return -1;  // out of keys, whatever wanted one can't go on
+    }
+    len = len < left ? len : left;
+    memcpy(buf, term_mem.in.b + term_mem.in_off, len);
+    term_mem.in_off += len;
+    return len;
+}
+
+void
+term_mem_write(const char *s, int len)
+{
+    ab_append(&term_mem.out, s, len);
+}
+
+int
+term_mem_size(int *rows, int *cols)
+{
+    *rows = term_mem.rows;
+    *cols = term_mem.cols;
+    return 0;
+}
+
+struct term term_memory = {-1, term_mem_wait, term_mem_read, term_mem_write, term_mem_size};
+
+// queue keys for the editor to read from the memory terminal
+void
+term_mem_feed(const char *keys, int len)
+{
+    if (term_mem.in_off == term_mem.in.len) {
+        term_mem.in.len = 0;
+        term_mem.in_off = 0;
+    }
+    ab_append(&term_mem.in, keys, len);
+}
+
+/*** arena ***/
+
+// bytes per arena block, bigger allocations get a block of their own
+#define ARENA_BLOCK (64 << 10)
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+struct arena_block {
+    struct arena_block *prev;
+    size_t used;
+    size_t cap;
+    char data[];
+};
+
+// stack-like allocator, memory is handed out from big blocks and given back
+// only by popping everything allocated after some point
+typedef struct arena {
+    struct arena_block *top;
+} arena_t;
+
+// n bytes right after the last ones, for arenas holding only text
+void *
+arena_alloc_packed(arena_t *a, size_t n)
+{
+    struct arena_block *b = a->top;
+    if (b == NULL || b->cap - b->used < n) {
+        size_t cap = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        if ((b = malloc(sizeof(struct arena_block) + cap)) == NULL) {
+            return NULL;
+        }
+        b->prev = a->top;
+        b->used = 0;
+        b->cap = cap;
+        a->top = b;
+    }
+    void *p = &b->data[b->used];
+    b->used += n;
+    return p;
+}
+
+void *
+arena_alloc(arena_t *a, size_t n)
+{
+    return arena_alloc_packed(a, ARENA_ALIGN(n));
+}
+
+// grow the newest allocation p in place, fails if it doesn't fit its block
+int
+arena_grow(arena_t *a, void *p, size_t size, size_t n_size)
+{
+    struct arena_block *b = a->top;
+    if (b == NULL || (char *)p + ARENA_ALIGN(size) != &b->data[b->used]) {
+        return -1;
+    }
+    size_t off = (char *)p - b->data;
+    if (b->cap - off < ARENA_ALIGN(n_size)) {
+        return -1;
+    }
+    b->used = off + ARENA_ALIGN(n_size);
+    return 0;
+}
+
+// free everything allocated from p on, NULL frees it all
+void
+arena_pop(arena_t *a, void *p)
+{
+    while (a->top != NULL) {
+        struct arena_block *b = a->top;
+        if (p != NULL && (char *)p >= b->data && (char *)p <= &b->data[b->cap]) {
+            b->used = (char *)p - b->data;
+            return;
+        }
+        a->top = b->prev;
+        free(b);
+    }
+}
+
+/*** screen state ***/
+
+// what the terminal shows right now, line by line, so a refresh only sends
+// the lines that changed since the last one
+struct sline {
+    int filerow;       // row drawn on this line
+    int part;          // which of its screen lines, with wrap
+    unsigned int gen;  // its generation at the time
+    struct abuf text;
+};
+
+struct screen {
+    struct sline *lines;  // the windows with their status bars, then the message bar
+    int nlines;
+    int damage_from;  // rows from here on moved or changed and must be rebuilt
+    int invalid;      // terminal contents are unknown, clear and repaint
+    int cx;
+    int cy;
+} screen = {NULL, 0, INT_MAX, 1, -1, -1};
+
+// line being built, compared against the shadow before it is sent
+struct abuf scratch = ABUF_INIT;
+
+// forget what the terminal shows, the next refresh repaints everything
+void
+editor_invalidate_screen()
+{
+    screen.invalid = 1;
+}
+
+void
+editor_damage_rows(int from)
+{
+    if (from < screen.damage_from) {
+        screen.damage_from = from;
+    }
+}
+
+/*** rope ***/
+
+unsigned int rope_seed = 2463534242u;
+
+unsigned int
+rope_rand()
+{
+    // xorshift32, priorities only need to look random
+    rope_seed ^= rope_seed << 13;
+    rope_seed ^= rope_seed >> 17;
+    rope_seed ^= rope_seed << 5;
+    return rope_seed;
+}
+
+int
+rope_total(rnode_t *t)
+{
+    return t ? t->total : 0;
+}
+
+long long
+rope_vtotal(rnode_t *t)
+{
+    return t ? t->vtotal : 0;
+}
+
+// screen lines a row counts for in the sums
+int
+rope_lines(erow_t *row)
+{
+    return row->vrows ? row->vrows : 1;
+}
+
+long long
+rope_chunk_lines(rnode_t *t, int from, int to)
+{
+    long long n = 0;
+    for (int i = from; i < to; i++) {
+        n += rope_lines(&t->rows[i]);
+    }
+    return n;
+}
+
+void
+rope_update(rnode_t *t)
+{
+    t->total = rope_total(t->left) + t->count + rope_total(t->right);
+    t->vtotal = rope_vtotal(t->left) + t->vcount + rope_vtotal(t->right);
+}
+
+rnode_t*
+rope_new_node()
+{
+    rnode_t *t = malloc(sizeof(rnode_t));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->left = NULL;
+    t->right = NULL;
+    t->prio = rope_rand();
+    t->count = 0;
+    t->total = 0;
+    t->vcount = 0;
+    t->vtotal = 0;
+    return t;
+}
+
+// split into rows [0, k) and [k, total), k must fall on a chunk boundary
+void
+rope_split(rnode_t *t, int k, rnode_t **l, rnode_t **r)
+{
+    if (t == NULL) {
+        *l = NULL;
+        *r = NULL;
+        return;
+    }
+    int lt = rope_total(t->left);
+    if (k <= lt) {
+        rope_split(t->left, k, l, &t->left);
+        *r = t;
+    } else {
+        rope_split(t->right, k - lt - t->count, &t->right, r);
+        *l = t;
+    }
+    rope_update(t);
+}
+
+rnode_t*
+rope_merge(rnode_t *a, rnode_t *b)
+{
+    if (a == NULL) {
+        return b;
+    }
+    if (b == NULL) {
+        return a;
+    }
+    if (a->prio > b->prio) {
+        a->right = rope_merge(a->right, b);
+        rope_update(a);
+        return a;
+    }
+    b->left = rope_merge(a, b->left);
+    rope_update(b);
+    return b;
+}
+
+// find the chunk holding position at (at == total lands past the last row),
+// *off gets the position inside the chunk, *start the index of its first row,
+// delta and vdelta are added to the row and screen line totals along the
+// way down
+rnode_t*
+rope_locate(rope_t *rope, int at, int delta, long long vdelta, int *off, int *start)
+{
+    rnode_t *t = rope->root;
+    int base = 0;
+    while (t != NULL) {
+        t->total += delta;
+        t->vtotal += vdelta;
+        int lt = rope_total(t->left);
+        if (at < lt) {
+            t = t->left;
+        } else if (at < lt + t->count || t->right == NULL) {
+            *off = at - lt;
+            *start = base + lt;
+            return t;
+        } else {
+            at -= lt + t->count;
+            base += lt + t->count;
+            t = t->right;
+        }
+    }
+    return NULL;
+}
+
+erow_t*
+rope_get(rope_t *rope, int at)
+{
+    if (at < 0 || at >= rope_total(rope->root)) {
+        return NULL;
+    }
+    rnode_t *t = rope->root;
+    while (t != NULL) {
+        int lt = rope_total(t->left);
+        if (at < lt) {
+            t = t->left;
+        } else if (at < lt + t->count) {
+            return &t->rows[at - lt];
+        } else {
+            at -= lt + t->count;
+            t = t->right;
+        }
+    }
+    return NULL;
+}
+
+// cut a chunk in two after its first k rows, halves make room for the
+// next insert, other cuts let the rope be split in the middle of a chunk
+int
+rope_split_chunk(rope_t *rope, rnode_t *t, int start, int k)
+{
+    rnode_t *n = rope_new_node();
+    if (n == NULL) {
+        return -1;
+    }
+    rnode_t *l, *m, *r;
+    rope_split(rope->root, start, &l, &r);
+    rope_split(r, t->count, &m, &r);
+
+    n->count = t->count - k;
+    memcpy(n->rows, &t->rows[k], sizeof(erow_t) * n->count);
+    n->vcount = rope_chunk_lines(n, 0, n->count);
+    t->count = k;
+    t->vcount -= n->vcount;
+    rope_update(t);
+    rope_update(n);
+
+    rope->root = rope_merge(rope_merge(l, rope_merge(m, n)), r);
+    return 0;
+}
+
+int
+rope_insert(rope_t *rope, int at, erow_t *row)
+{
+    if (rope->root == NULL) {
+        if ((rope->root = rope_new_node()) == NULL) {
+            return -1;
+        }
+    }
+
+    int off, start;
+    rnode_t *t = rope_locate(rope, at, 0, 0, &off, &start);
+    if (t->count == ROPE_CHUNK) {
+        if (rope_split_chunk(rope, t, start, t->count / 2) == -1) {
+            return -1;
+        }
+    }
+    int lines = rope_lines(row);
+    t = rope_locate(rope, at, 1, lines, &off, &start);
+
+    memmove(&t->rows[off + 1], &t->rows[off], sizeof(erow_t) * (t->count - off));
+    t->rows[off] = *row;
+    t->count++;
+    t->vcount += lines;
+    return 0;
+}
+
+// remove n rows from at on, a chunk at a time, those losing all their rows
+// are dropped rather than kept around empty
+void
+rope_delete(rope_t *rope, int at, int n)
+{
+    while (n > 0) {
+        int off, start;
+        rnode_t *t = rope_locate(rope, at, 0, 0, &off, &start);
+        int k = t->count - off < n ? t->count - off : n;
+        if (k == t->count) {
+            rnode_t *l, *m, *r;
+            rope_split(rope->root, start, &l, &r);
+            rope_split(r, t->count, &m, &r);
+            free(m);
+            rope->root = rope_merge(l, r);
+        } else {
+            long long lines = rope_chunk_lines(t, off, off + k);
+            t = rope_locate(rope, at, -k, -lines, &off, &start);
+            memmove(&t->rows[off], &t->rows[off + k], sizeof(erow_t) * (t->count - off - k));
+            t->count -= k;
+            t->vcount -= lines;
+        }
+        n -= k;
+    }
+}
+
+// call fn on every row in order, cheaper than rope_get in a loop
+void
+rope_walk(rnode_t *t, void (*fn)(erow_t *, void *), void *arg)
+{
+    while (t != NULL) {
+        rope_walk(t->left, fn, arg);
+        for (int i = 0; i < t->count; i++) {
+            fn(&t->rows[i], arg);
+        }
+        t = t->right;
+    }
+}
+
+// free the chunks, the rows in them are the caller's business
+void
+rope_free(rnode_t *t)
+{
+    while (t != NULL) {
+        rope_free(t->left);
+        rnode_t *right = t->right;
+        free(t);
+        t = right;
+    }
+}
+
+// make at fall on a chunk boundary, so the rope can be split there
+int
+rope_cut(rope_t *rope, int at)
+{
+    if (at <= 0 || at >= rope_total(rope->root)) {
+        return 0;
+    }
+    int off, start;
+    rnode_t *t = rope_locate(rope, at, 0, 0, &off, &start);
+    return off == 0 ? 0 : rope_split_chunk(rope, t, start, off);
+}
+
+// put n rows in at at, a few go in one by one, more are packed into full
+// chunks of their own that are merged in at once
+int
+rope_insert_rows(rope_t *rope, int at, erow_t *rows, int n)
+{
+    if (n < ROPE_CHUNK) {
+        for (int i = 0; i < n; i++) {
+            if (rope_insert(rope, at + i, &rows[i]) == -1) {
+                rope_delete(rope, at, i);
+                return -1;
+            }
+        }
+        return 0;
+    }
+    if (rope_cut(rope, at) == -1) {
+        return -1;
+    }
+    rnode_t *m = NULL;
+    for (int i = 0; i < n; i += ROPE_CHUNK) {
+        rnode_t *t = rope_new_node();
+        if (t == NULL) {
+            rope_free(m);
+            return -1;
+        }
+        t->count = n - i < ROPE_CHUNK ? n - i : ROPE_CHUNK;
+        memcpy(t->rows, &rows[i], sizeof(erow_t) * t->count);
+        t->vcount = rope_chunk_lines(t, 0, t->count);
+        rope_update(t);
+        m = rope_merge(m, t);
+    }
+    rnode_t *l, *r;
+    rope_split(rope->root, at, &l, &r);
+    rope->root = rope_merge(rope_merge(l, m), r);
+    return 0;
+}
+
+// move rows [from, from + n) so that, once they are out, they go back in
+// at to, whole subtrees are relinked and no row is copied
+int
+rope_move(rope_t *rope, int from, int n, int to)
+{
+    if (rope_cut(rope, from) == -1 || rope_cut(rope, from + n) == -1) {
+        return -1;
+    }
+    rnode_t *l, *m, *r;
+    rope_split(rope->root, from, &l, &r);
+    rope_split(r, n, &m, &r);
+    rope->root = rope_merge(l, r);
+    // from is still a boundary, they go back there when to can't be cut
+    int ok = rope_cut(rope, to) == 0;
+    rope_split(rope->root, ok ? to : from, &l, &r);
+    rope->root = rope_merge(rope_merge(l, m), r);
+    return ok ? 0 : -1;
+}
+
+// row at now takes lines screen lines, 0 for not known, the sums above it
+// follow
+void
+rope_set_lines(rope_t *rope, int at, int lines)
+{
+    erow_t *row = rope_get(rope, at);
+    if (row == NULL) {
+        return;
+    }
+    int d = (lines ? lines : 1) - rope_lines(row);
+    row->vrows = lines;
+    if (d != 0) {
+        int off, start;
+        rope_locate(rope, at, 0, d, &off, &start)->vcount += d;
+    }
+}
+
+// screen lines taken by the rows before at
+long long
+rope_lines_before(rope_t *rope, int at)
+{
+    long long n = 0;
+    rnode_t *t = rope->root;
+    while (t != NULL) {
+        int lt = rope_total(t->left);
+        if (at < lt) {
+            t = t->left;
+        } else if (at < lt + t->count) {
+            return n + rope_vtotal(t->left) + rope_chunk_lines(t, 0, at - lt);
+        } else {
+            n += rope_vtotal(t->left) + t->vcount;
+            at -= lt + t->count;
+            t = t->right;
+        }
+    }
+    return n;
+}
+
+// the row screen line v falls on, the last one when v is past the end,
+// *before gets the screen lines taken by the rows before it
+int
+rope_find_line(rope_t *rope, long long v, long long *before)
+{
+    rnode_t *t = rope->root;
+    int base = 0;
+    *before = 0;
+    if (t == NULL || t->total == 0) {
+        return 0;
+    }
+    if (v >= t->vtotal) {
+        v = t->vtotal - 1;
+    }
+    while (t != NULL) {
+        long long lv = rope_vtotal(t->left);
+        if (v < lv) {
+            t = t->left;
+        } else if (v < lv + t->vcount) {
+            v -= lv;
+            *before += lv;
+            base += rope_total(t->left);
+            int i = 0;
+            while (i < t->count - 1 && v >= rope_lines(&t->rows[i])) {
+                v -= rope_lines(&t->rows[i]);
+                *before += rope_lines(&t->rows[i]);
+                i++;
+            }
+            return base + i;
+        } else {
+            v -= lv + t->vcount;
+            *before += lv + t->vcount;
+            base += rope_total(t->left) + t->count;
+            t = t->right;
+        }
+    }
+    return base - 1;
+}
+
+// forget how many screen lines every row takes, they were measured at
+// another width
+void
+rope_forget_lines(rnode_t *t)
+{
+    while (t != NULL) {
+        rope_forget_lines(t->left);
+        for (int i = 0; i < t->count; i++) {
+            t->rows[i].vrows = 0;
+        }
+        t->vcount = t->count;
+        t->vtotal = t->total;
+        t = t->right;
+    }
+}
+
+/*** undo journal ***/
+
+// the _ROWS ops take col rows at once, their text joined by newlines
+enum Jop { JOP_INS_ROW, JOP_DEL_ROW, JOP_INS_TEXT, JOP_DEL_TEXT, JOP_INS_ROWS, JOP_DEL_ROWS };
+
+// one edit, the text it inserted or removed follows the header, so undoing
+// or redoing it costs as much as the edit itself. Rows put from a register
+// keep a reference to its block instead
+typedef struct jop {
+    struct jop *prev;
+    struct jop *next;
+    unsigned int group;  // ops undone together, one command or insert session
+    int type;
+    int row;
+    int col;
+    struct shared *block;  // the text of a JOP_INS_ROWS, NULL when it follows
+    size_t len;
+    char text[];
+} jop_t;
+
+// append-only log of edits, everything after cur has been undone and is
+// kept for redo until the next edit throws it away
+struct journal {
+    arena_t arena;
+    jop_t *first;
+    jop_t *last;
+    jop_t *cur;  // newest op in effect, NULL when everything is undone
+    unsigned int group;
+    int brk;     // the next op starts a new group
+    int replay;  // undo or redo is running, don't record
+};
+
+// end the current group, the next edit can't be merged into it
+void
+editor_journal_break()
+{
+    struct journal *j = config.buf->journal;
+    j->brk = 1;
+}
+
+// add text to the newest op, typing a run of characters or deleting
+// one with x or backspace builds a single op instead of one per key
+int
+editor_journal_extend(int type, int row, int col, const char *s, size_t len)
+{
+    struct journal *j = config.buf->journal;
+    jop_t *op = j->last;
+    if (j->brk || op == NULL || op != j->cur || op->type != type
+        || op->row != row) {
+        return -1;
+    }
+    int append;
+    if (type == JOP_INS_TEXT && (size_t)col == op->col + op->len) {
+        append = 1;
+    } else if (type == JOP_DEL_TEXT && col == op->col) {
+        append = 1;
+    } else if (type == JOP_DEL_TEXT && col + len == (size_t)op->col) {
+        append = 0;
+    } else {
+        return -1;
+    }
+    if (arena_grow(&j->arena, op, sizeof(jop_t) + op->len,
+                   sizeof(jop_t) + op->len + len) == -1) {
+        return -1;
+    }
+    if (append) {
+        memcpy(&op->text[op->len], s, len);
+    } else {
+        memmove(&op->text[len], op->text, op->len);
+        memcpy(op->text, s, len);
+        op->col = col;
+    }
+    op->len += len;
+    return 0;
+}
+
+// let go of the blocks of op and the ops after it
+void
+editor_journal_unref(jop_t *op)
+{
+    for (; op != NULL; op = op->next) {
+        editor_shared_unref(op->block, 1);
+    }
+}
+
+// a new edit after undo makes the undone ops unreachable
+void
+editor_journal_cut()
+{
+    struct journal *j = config.buf->journal;
+    if (j->cur != j->last) {
+        editor_journal_unref(j->cur != NULL ? j->cur->next : j->first);
+        if (j->cur == NULL) {
+            arena_pop(&j->arena, NULL);
+            j->first = NULL;
+        } else {
+            arena_pop(&j->arena, (char *)j->cur
+                      + ARENA_ALIGN(sizeof(jop_t) + j->cur->len));
+            j->cur->next = NULL;
+        }
+        j->last = j->cur;
+    }
+}
+
+// a new op with room for len bytes of text after the others, NULL when
+// out of memory
+jop_t *
+editor_journal_push(int type, int row, int col, size_t len)
+{
+    struct journal *j = config.buf->journal;
+    jop_t *op = arena_alloc(&j->arena, sizeof(jop_t) + len);
+    if (op == NULL) {
+        return NULL;
+    }
+    if (j->brk) {
+        j->group++;
+        j->brk = 0;
+    }
+    op->prev = j->last;
+    op->next = NULL;
+    op->group = j->group;
+    op->type = type;
+    op->row = row;
+    op->col = col;
+    op->block = NULL;
+    op->len = len;
+    if (j->last != NULL) {
+        j->last->next = op;
+    } else {
+        j->first = op;
+    }
+    j->last = op;
+    j->cur = op;
+    return op;
+}
+
+// record an edit, called by the row operations before they change anything
+void
+editor_journal(int type, int row, int col, const char *s, size_t len)
+{
+    struct journal *j = config.buf->journal;
+    editor_swap_log(type, row, col, s, len);
+    if (j->replay) {
+        return;
+    }
+    editor_journal_cut();
+    if ((type == JOP_INS_TEXT || type == JOP_DEL_TEXT)
+        && editor_journal_extend(type, row, col, s, len) == 0) {
+        return;
+    }
+    jop_t *op = editor_journal_push(type, row, col, len);
+    if (op != NULL && len > 0) {
+        memcpy(op->text, s, len);
+    }
+}
+
+// record the put of the lines of block at row
+void
+editor_journal_rows(int row, struct shared *block)
+{
+    struct journal *j = config.buf->journal;
+    editor_swap_log_rows(row, block);
+    if (j->replay) {
+        return;
+    }
+    editor_journal_cut();
+    jop_t *op = editor_journal_push(JOP_INS_ROWS, row, block->nrows, 0);
+    if (op != NULL) {
+        op->block = block;
+        block->refs++;
+    }
+}
+
+// apply op, or its inverse when undo is set
+void
+editor_journal_apply(jop_t *op, int undo)
+{
+    int type = op->type;
+    if (undo) {
+        type ^= 1;  // every op and its inverse differ in the lowest bit
+    }
+    switch (type) {
+        case JOP_INS_ROW:
+            editor_insert_row(op->row, op->text, op->len);
+            break;
+        case JOP_DEL_ROW:
+            editor_del_row(op->row);
+            break;
+        case JOP_INS_TEXT:
+            editor_row_insert_string(op->row, op->col, op->text, op->len);
+            break;
+        case JOP_DEL_TEXT:
+            editor_row_del_string(op->row, op->col, op->len);
+            break;
+        case JOP_INS_ROWS:
+            if (op->block != NULL) {
+                editor_insert_rows(op->row, op->block);
+            } else {
+                editor_insert_text_rows(op->row, op->text, op->len);
+            }
+            break;
+        case JOP_DEL_ROWS:
+            editor_del_rows(op->row, op->col);
+            break;
+    }
+    config.win->cy = op->row < config.buf->numrows ? op->row : config.buf->numrows - 1;
+    if (config.win->cy < 0) {
+        config.win->cy = 0;
+    }
+    config.win->cx = type >= JOP_INS_ROWS ? 0 : op->col;
+}
+
+void
+editor_undo()
+{
+    struct journal *j = config.buf->journal;
+    if (j->cur == NULL) {
+        editor_set_status_message("Already at oldest change");
+        return;
+    }
+    unsigned int group = j->cur->group;
+    j->replay = 1;
+    while (j->cur != NULL && j->cur->group == group) {
+        editor_journal_apply(j->cur, 1);
+        j->cur = j->cur->prev;
+    }
+    j->replay = 0;
+    j->brk = 1;
+}
+
+void
+editor_redo()
+{
+    struct journal *j = config.buf->journal;
+    jop_t *op = j->cur != NULL ? j->cur->next : j->first;
+    if (op == NULL) {
+        editor_set_status_message("Already at newest change");
+        return;
+    }
+    unsigned int group = op->group;
+    j->replay = 1;
+    while (op != NULL && op->group == group) {
+        editor_journal_apply(op, 0);
+        j->cur = op;
+        op = op->next;
+    }
+    j->replay = 0;
+    j->brk = 1;
+}
+
+/*** row operations ***/
+
+erow_t*
+editor_row(int at)
+{
+    if (pager.on) {
+        return editor_pager_row(at);
+    }
+    return rope_get(&config.buf->rows, at);
+}
+
+// text of rows read from a pipe or a decompressor, packed back to back
+// instead of a malloc each, rows copy theirs out before changing it and
+// once most of it is garbage what is left is copied to a fresh slab
+struct slab {
+    arena_t arena;
+    size_t used;   // bytes handed out
+    size_t dead;   // of those, what no row refers to any more
+    arena_t from;  // the slab being compacted into arena
+    int compacting;
+    int next;      // row compaction has got to
+    int gen;       // flips with every compaction, text of rows with another
+                   // slab_gen is still in from
+};
+
+// keep a copy of s as the text of row, -1 when out of memory
+int
+editor_slab_copy(erow_t *row, const char *s, size_t len)
+{
+    struct slab *slab = config.buf->slab;
+    if (slab == NULL && (slab = config.buf->slab = calloc(1, sizeof(struct slab))) == NULL) {
+        return -1;
+    }
+    char *p = arena_alloc_packed(&slab->arena, len + 1);
+    if (p == NULL) {
+        return -1;
+    }
+    memcpy(p, s, len);
+    p[len] = '\0';
+    slab->used += len + 1;
+    row->chars = p;
+    row->store = ROW_SLAB;
+    row->slab_gen = slab->gen;
+    return 0;
+}
+
+// rows went in or out at row at, what compaction has done moves with them
+void
+editor_slab_shift(int at, int delta)
+{
+    struct slab *slab = config.buf->slab;
+    if (slab != NULL && slab->compacting && at < slab->next) {
+        slab->next = delta < 0 && slab->next - at < -delta ? at : slab->next + delta;
+    }
+}
+
+// rows from at on were reordered, compaction goes over them again, the
+// ones it copied already are skipped by their slab_gen
+void
+editor_slab_rewind(int at)
+{
+    struct slab *slab = config.buf->slab;
+    if (slab != NULL && slab->compacting && at < slab->next) {
+        slab->next = at;
+    }
+}
+
+int
+editor_slab_pending()
+{
+    struct slab *slab = config.buf->slab;
+    return !pager.on && slab != NULL
+        && (slab->compacting || (slab->dead > SLAB_COMPACT && slab->dead * 2 > slab->used));
+}
+
+// move the text of some more rows to the fresh slab, the old one goes once
+// every row has been through
+void
+editor_slab_step()
+{
+    struct slab *slab = config.buf->slab;
+    if (!slab->compacting) {
+        slab->from = slab->arena;
+        slab->arena.top = NULL;
+        slab->used = 0;
+        slab->dead = 0;
+        slab->next = 0;
+        slab->gen ^= 1;
+        slab->compacting = 1;
+    }
+    int end = slab->next + SLAB_STEP;
+    for (; slab->next < end && slab->next < config.buf->numrows; slab->next++) {
+        erow_t *row = rope_get(&config.buf->rows, slab->next);
+        // rows made while compacting are in the fresh slab already
+        if (row->store != ROW_SLAB || row->slab_gen == slab->gen) {
+            continue;
+        }
+        if (editor_slab_copy(row, row->chars, row->size) == -1) {
+            return;  // try again later
+        }
+    }
+    if (slab->next >= config.buf->numrows) {
+        arena_pop(&slab->from, NULL);
+        slab->compacting = 0;
+    }
+}
+
+// room a line of len bytes takes, headers only need pointer alignment
+#define SHARED_LINE(len) ((offsetof(struct shared_line, text) + (len) + 1 + 7) & ~(size_t)7)
+
+// a block for nrows lines of bytes bytes in all, with one reference
+struct shared *
+editor_shared_new(size_t bytes, int nrows)
+{
+    size_t size = sizeof(struct shared) + bytes + (size_t)nrows * (SHARED_LINE(0) + 7);
+    struct shared *block = malloc(size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->refs = 1;
+    block->nrows = 0;
+    block->used = 0;
+    return block;
+}
+
+void
+editor_shared_add(struct shared *block, const char *s, int len)
+{
+    struct shared_line *l = (struct shared_line *)&block->data[block->used];
+    l->block = block;
+    l->len = len;
+    memcpy(l->text, s, len);
+    l->text[len] = '\0';
+    block->used += SHARED_LINE(len);
+    block->nrows++;
+}
+
+struct shared_line *
+editor_shared_first(struct shared *block)
+{
+    return (struct shared_line *)block->data;
+}
+
+struct shared_line *
+editor_shared_next(struct shared_line *l)
+{
+    return (struct shared_line *)((char *)l + SHARED_LINE(l->len));
+}
+
+void
+editor_shared_unref(struct shared *block, int n)
+{
+    if (block != NULL && (block->refs -= n) == 0) {
+        free(block);
+    }
+}
+
+// the block a shared row's text is in
+struct shared *
+editor_shared_of(erow_t *row)
+{
+    return ((struct shared_line *)(row->chars - offsetof(struct shared_line, text)))->block;
+}
+
+// a block holding the lines of s, which are separated by newlines
+struct shared *
+editor_shared_from_text(const char *s, size_t len)
+{
+    int nrows = 1;
+    for (const char *p = s; (p = memchr(p, '\n', s + len - p)) != NULL; p++) {
+        nrows++;
+    }
+    struct shared *block = editor_shared_new(len, nrows);
+    if (block == NULL) {
+        return NULL;
+    }
+    const char *end = s + len;
+    while (1) {
+        const char *nl = memchr(s, '\n', end - s);
+        editor_shared_add(block, s, (nl ? nl : end) - s);
+        if (nl == NULL) {
+            break;
+        }
+        s = nl + 1;
+    }
+    return block;
+}
+
+// a block holding a copy of rows [at, at + n)
+struct shared *
+editor_shared_from_rows(int at, int n)
+{
+    size_t bytes = 0;
+    for (int i = 0; i < n; i++) {
+        bytes += editor_row(at + i)->size;
+    }
+    struct shared *block = editor_shared_new(bytes, n);
+    if (block == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+        erow_t *row = editor_row(at + i);
+        editor_shared_add(block, row->chars, row->size);
+    }
+    return block;
+}
+
+// rows [at, at + n) joined by newlines, what bulk ops journal
+struct abuf rows_text = ABUF_INIT;
+
+void
+editor_rows_text(int at, int n)
+{
+    rows_text.len = 0;
+    for (int i = 0; i < n; i++) {
+        erow_t *row = editor_row(at + i);
+        if (i > 0) {
+            ab_append(&rows_text, "\n", 1);
+        }
+        ab_append(&rows_text, row->chars, row->size);
+    }
+}
+
+// storage for need bytes of the row's text, what was there before is the
+// caller's business
+int
+editor_row_alloc(erow_t *row, size_t need)
+{
+    char *n_chars = malloc(need);
+    if (n_chars == NULL) {
+        return -1;
+    }
+    row->chars = n_chars;
+    row->cap = need;
+    row->store = ROW_HEAP;
+    return 0;
+}
+
+// the row no longer uses its text
+void
+editor_row_release(erow_t *row)
+{
+    struct slab *slab = config.buf->slab;
+    if (row->store == ROW_HEAP) {
+        free(row->chars);
+    } else if (row->store == ROW_SLAB && row->slab_gen == slab->gen) {
+        // text still in the slab being compacted is freed with it as a whole
+        slab->dead += row->size + 1;
+    } else if (row->store == ROW_SHARED) {
+        editor_shared_unref(editor_shared_of(row), 1);
+    }
+}
+
+void
+editor_insert_row(int at, char *s, size_t len)
+{
+    if (at < 0 || at > config.buf->numrows) {
+        return;
+    }
+
+    erow_t r;
+    r.size = len;
+    r.gen = ++config.gen;
+    r.r = NULL;
+    r.hl_known = 0;
+    r.vrows = 0;
+    if (editor_row_alloc(&r, len + 1) == -1) {
+        return;
+    }
+
+    memcpy(r.chars, s, len);
+
+    r.chars[len] = '\0';
+
+    if (rope_insert(&config.buf->rows, at, &r) == -1) {
+        editor_row_release(&r);
+        return;
+    }
+    editor_slab_shift(at, 1);
+    editor_search_shift(at, 1);
+    editor_hl_shift(at, 1);
+    editor_damage_rows(at);
+    editor_row_invalidate(at);
+    editor_journal(JOP_INS_ROW, at, 0, s, len);
+
+    config.buf->numrows++;
+    config.buf->dirty++;
+}
+
+// append a row that borrows its text from the mapped file, or a copy of
+// it kept in the slab when it comes from somewhere that goes away
+void
+editor_insert_mapped_row(char *s, size_t len, int store)
+{
+    erow_t r;
+    r.size = len;
+    r.cap = 0;
+    r.chars = s;
+    r.store = store;
+    r.gen = --config.load_gen;
+    r.r = NULL;
+    r.hl_known = 0;
+    r.vrows = 0;
+    if (store == ROW_SLAB && editor_slab_copy(&r, s, len) == -1) {
+        return;
+    }
+
+    if (rope_insert(&config.buf->rows, config.buf->numrows, &r) == -1) {
+        return;
+    }
+    editor_damage_rows(config.buf->numrows);
+    editor_hl_changed(config.buf->numrows, 1);
+    config.buf->numrows++;
+}
+
+// give the row a private, writable copy of its text before changing it,
+// every in-place change goes through here, so it also marks the row edited
+int
+editor_row_own(erow_t *row)
+{
+    row->gen = ++config.gen;
+    if (row->store == ROW_HEAP) {
+        return 0;
+    }
+    erow_t old = *row;
+    if (editor_row_alloc(row, row->size + 1) == -1) {
+        return -1;
+    }
+    memcpy(row->chars, old.chars, row->size);
+    row->chars[row->size] = '\0';
+    editor_row_release(&old);
+    return 0;
+}
+
+// make chars hold at least need bytes, growing geometrically so typing
+// doesn't realloc on every keystroke
+int
+editor_row_reserve(erow_t *row, size_t need)
+{
+    if (editor_row_own(row) == -1) {
+        return -1;
+    }
+    if (need <= (size_t)row->cap) {
+        return 0;
+    }
+    size_t n_cap = row->cap < 16 ? 16 : (size_t)row->cap * 2;
+    if (n_cap < need) {
+        n_cap = need;
+    }
+    char *n_chars = realloc(row->chars, n_cap);
+    perf.reallocs++;
+    if (n_chars == NULL) {
+        return -1;
+    }
+    row->chars = n_chars;
+    row->cap = n_cap;
+    return 0;
+}
+
+// put the lines of block in at at, the rows share its text until they
+// change, go into the rope in one go and are journaled as one op
+void
+editor_insert_rows(int at, struct shared *block)
+{
+    int n = block->nrows;
+    if (at < 0 || at > config.buf->numrows || n == 0) {
+        return;
+    }
+    erow_t *rows = malloc(sizeof(erow_t) * n);
+    if (rows == NULL) {
+        return;
+    }
+    struct shared_line *l = editor_shared_first(block);
+    for (int i = 0; i < n; i++, l = editor_shared_next(l)) {
+        rows[i].size = l->len;
+        rows[i].cap = 0;
+        rows[i].chars = l->text;
+        rows[i].r = NULL;
+        rows[i].gen = ++config.gen;
+        rows[i].store = ROW_SHARED;
+        rows[i].hl_known = 0;
+        rows[i].vrows = 0;
+    }
+    int failed = rope_insert_rows(&config.buf->rows, at, rows, n);
+    free(rows);
+    if (failed) {
+        return;
+    }
+    block->refs += n;
+    editor_slab_shift(at, n);
+    editor_search_shift(at, n);
+    editor_search_changed(at, n);
+    editor_hl_shift(at, n);
+    editor_hl_changed(at, n);
+    editor_damage_rows(at);
+    editor_row_invalidate(at);
+    editor_journal_rows(at, block);
+
+    config.buf->numrows += n;
+    config.buf->dirty++;
+}
+
+// put the newline separated lines of s in at at
+void
+editor_insert_text_rows(int at, const char *s, size_t len)
+{
+    struct shared *block = editor_shared_from_text(s, len);
+    if (block != NULL) {
+        editor_insert_rows(at, block);
+        editor_shared_unref(block, 1);
+    }
+}
+
+// delete n rows from at on in one go, journaled as one op
+void
+editor_del_rows(int at, int n)
+{
+    editor_index_rows(at + n);
+    if (at < 0 || at >= config.buf->numrows || n <= 0) {
+        return;
+    }
+    if (n > config.buf->numrows - at) {
+        n = config.buf->numrows - at;
+    }
+    if (n == 1) {
+        erow_t *row = editor_row(at);
+        editor_journal(JOP_DEL_ROW, at, 0, row->chars, row->size);
+    } else {
+        editor_rows_text(at, n);
+        editor_journal(JOP_DEL_ROWS, at, n, rows_text.b, rows_text.len);
+    }
+    editor_row_invalidate(at);
+    for (int i = 0; i < n; i++) {
+        erow_t *row = editor_row(at + i);
+        editor_render_free(row->r);
+        editor_row_release(row);
+    }
+    rope_delete(&config.buf->rows, at, n);
+    editor_slab_shift(at, -n);
+    editor_search_shift(at, -n);
+    editor_hl_shift(at, -n);
+    editor_damage_rows(at);
+    config.gen++;
+    config.buf->numrows -= n;
+    config.buf->dirty++;
+}
+
+void
+editor_del_row(int at)
+{
+    editor_del_rows(at, 1);
+}
+
+// move n rows from from on so the first ends up at to, counted once they
+// are out, the rows keep their text and the journal sees a delete and an
+// insert
+void
+editor_move_rows(int from, int n, int to)
+{
+    editor_index_rows(from + n > to + n ? from + n : to + n);
+    int numrows = config.buf->numrows;
+    if (from < 0 || n <= 0 || from + n > numrows || to < 0 || to > numrows - n || to == from) {
+        return;
+    }
+    if (rope_move(&config.buf->rows, from, n, to) == -1) {
+        return;
+    }
+    // the journal wants the text as it was, which now sits at to
+    int type = n == 1 ? JOP_DEL_ROW : JOP_DEL_ROWS;
+    editor_rows_text(to, n);
+    editor_journal(type, from, n == 1 ? 0 : n, rows_text.b, rows_text.len);
+    editor_journal(type - 1, to, n == 1 ? 0 : n, rows_text.b, rows_text.len);
+
+    int first = from < to ? from : to;
+    editor_slab_rewind(first);
+    editor_search_shift(from, -n);
+    editor_search_shift(to, n);
+    editor_search_changed(to, n);
+    editor_hl_changed(first, (from < to ? to - from : from - to) + n);
+    editor_damage_rows(first);
+    editor_row_invalidate(first);
+    for (int i = 0; i < n; i++) {
+        editor_row(to + i)->gen = ++config.gen;
+    }
+    config.buf->dirty++;
+}
+
+void
+editor_row_insert_char(int y, int at, int c)
+{
+    erow_t *row = editor_row(y);
+    if (at < 0 || at > row->size) {
+        at = row->size;
+    }
+    if (editor_row_reserve(row, row->size + 2) == -1) {  // 2 = new char and \0
+        return;
+    }
+
+    char ch = c;
+    editor_journal(JOP_INS_TEXT, y, at, &ch, 1);
+    editor_row_changed(y, at);
+    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    row->size++;
+    row->chars[at] = c;
+    config.buf->dirty++;
+}
+
+void
+editor_row_append_string(int y, char *s, size_t len)
+{
+    erow_t *row = editor_row(y);
+    if (editor_row_reserve(row, row->size + len + 1) == -1) {
+        return;
+    }
+
+    editor_journal(JOP_INS_TEXT, y, row->size, s, len);
+    editor_row_changed(y, row->size);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+}
+
+void
+editor_row_insert_string(int y, int at, const char *s, size_t len)
+{
+    erow_t *row = editor_row(y);
+    if (at < 0 || at > row->size) {
+        at = row->size;
+    }
+    if (editor_row_reserve(row, row->size + len + 1) == -1) {
+        return;
+    }
+
+    editor_journal(JOP_INS_TEXT, y, at, s, len);
+    editor_row_changed(y, at);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+    memcpy(&row->chars[at], s, len);
+    row->size += len;
+    config.buf->dirty++;
+}
+
+void
+editor_row_del_string(int y, int at, size_t len)
+{
+    erow_t *row = editor_row(y);
+    if (at < 0 || at >= row->size) {
+        return;
+    }
+    if (len > (size_t)(row->size - at)) {
+        len = row->size - at;
+    }
+    if (editor_row_own(row) == -1) {
+        return;
+    }
+    editor_journal(JOP_DEL_TEXT, y, at, &row->chars[at], len);
+    editor_row_changed(y, at);
+    memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+    row->size -= len;
+    config.buf->dirty++;
+}
+
+void
+editor_row_del_char(int y, int at)
+{
+    erow_t *row = editor_row(y);
+    // the cursor may sit just past the end, that deletes the last char
+    if (at == row->size) {
+        at--;
+    }
+    editor_row_del_string(y, at, 1);
+}
+
+// row y changed from byte at on, drop how it looked from there and how
+// many screen lines it wraps to, and its highlighting and that of
+// everything after it needs checking again
+void
+editor_row_changed(int y, int at)
+{
+    erow_t *row = editor_row(y);
+    if (row != NULL) {
+        editor_render_cut(row->r, at);
+        row->hl_known = 0;
+        if (row->vrows != 0 && !pager.on) {
+            rope_set_lines(&config.buf->rows, y, 0);
+        }
+    }
+    editor_hl_changed(y, 1);
+    editor_search_changed(y, 1);
+}
+
+// row y changed all over
+void
+editor_row_invalidate(int y)
+{
+    editor_row_changed(y, 0);
+}
+
+/*** render ***/
+
+// a character start of a row and the screen column it is drawn on
+struct rcheck {
+    int at;
+    int col;
+};
+
+// how a row looks on screen, made the first time it is drawn. The columns
+// of character starts are kept every RENDER_CHECK bytes or so, as far as
+// the row was looked at, so mapping the cursor or the left edge walks at
+// most that many bytes and an edit only drops what comes after it
+struct render {
+    struct rcheck *ck;  // in order, ck[0] is the start of the row
+    int nck;
+    int capck;
+    int done;   // the last checkpoint is the end of the row
+    unsigned char *hl;  // highlight class per byte
+    int caphl;
+    int lexed;  // hl is filled in
+    struct rcheck first[4];
+};
+
+// length of the utf-8 sequence at s and its code point, 0 when malformed
+int
+editor_utf8_decode(const char *s, int len, int *cp)
+{
+    unsigned char c = s[0];
+    int n;
+    int min;
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    } else if ((c & 0xe0) == 0xc0) {
+        n = 2;
+        min = 0x80;
+        *cp = c & 0x1f;
+    } else if ((c & 0xf0) == 0xe0) {
+        n = 3;
+        min = 0x800;
+        *cp = c & 0x0f;
+    } else if ((c & 0xf8) == 0xf0) {
+        n = 4;
+        min = 0x10000;
+        *cp = c & 0x07;
+    } else {
+        return 0;
+    }
+    if (n > len) {
+        return 0;
+    }
+    for (int i = 1; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        *cp = *cp << 6 | (s[i] & 0x3f);
+    }
+    if (*cp < min || *cp > 0x10ffff || (*cp >= 0xd800 && *cp <= 0xdfff)) {
+        return 0;
+    }
+    return n;
+}
+
+// columns taken by a code point, combining marks take none and east asian
+// wide characters and emoji two
+int
+editor_cp_width(int cp)
+{
+    static const int zero[][2] = {
+        {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x0610, 0x061a},
+        {0x064b, 0x065f}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x1ab0, 0x1aff},
+        {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x20d0, 0x20ff}, {0xfe00, 0xfe0f},
+        {0xfe20, 0xfe2f},
+    };
+    static const int wide[][2] = {
+        {0x1100, 0x115f}, {0x2e80, 0x303e}, {0x3041, 0x33ff}, {0x3400, 0x4dbf},
+        {0x4e00, 0x9fff}, {0xa000, 0xa4cf}, {0xac00, 0xd7a3}, {0xf900, 0xfaff},
+        {0xfe30, 0xfe4f}, {0xff00, 0xff60}, {0xffe0, 0xffe6}, {0x1f300, 0x1f64f},
+        {0x1f900, 0x1f9ff}, {0x20000, 0x3fffd},
+    };
+    for (size_t i = 0; i < sizeof(zero) / sizeof(zero[0]); i++) {
+        if (cp >= zero[i][0] && cp <= zero[i][1]) {
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < sizeof(wide) / sizeof(wide[0]); i++) {
+        if (cp >= wide[i][0] && cp <= wide[i][1]) {
+            return 2;
+        }
+    }
+    return 1;
+}
+
+// how the character at byte at of row is shown starting on column col:
+// its length in bytes, its width and what it turns into, NULL meaning
+// the bytes themselves
+int
+editor_render_char(erow_t *row, int at, int col, int *width, const char **shown, int *shown_len)
+{
+    static const char spaces[TAB_STOP] = "        ";
+    static char ctrl[2] = "^";
+    unsigned char c = row->chars[at];
+    int cp;
+    int n;
+    if (c == '\t') {
+        *width = TAB_STOP - col % TAB_STOP;
+        *shown = spaces;
+        *shown_len = *width;
+        return 1;
+    }
+    if (c < 0x20 || c == 0x7f) {
+        ctrl[1] = c == 0x7f ? '?' : c + '@';
+        *width = 2;
+        *shown = ctrl;
+        *shown_len = 2;
+        return 1;
+    }
+    if ((n = editor_utf8_decode(&row->chars[at], row->size - at, &cp)) == 0) {
+        *width = 1;
+        *shown = "?";
+        *shown_len = 1;
+        return 1;
+    }
+    *width = editor_cp_width(cp);
+    *shown = NULL;
+    *shown_len = n;
+    return n;
+}
+
+// the render cache of row, made if needed, NULL when out of memory
+struct render *
+editor_row_render(erow_t *row)
+{
+    if (row->r != NULL) {
+        return row->r;
+    }
+    struct render *r = malloc(sizeof(struct render));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->ck = r->first;
+    r->ck[0].at = 0;
+    r->ck[0].col = 0;
+    r->nck = 1;
+    r->capck = sizeof(r->first) / sizeof(r->first[0]);
+    r->done = 0;
+    r->hl = NULL;
+    r->caphl = 0;
+    r->lexed = 0;
+    row->r = r;
+    return r;
+}
+
+void
+editor_render_free(struct render *r)
+{
+    if (r != NULL) {
+        if (r->ck != r->first) {
+            free(r->ck);
+        }
+        free(r->hl);
+        free(r);
+    }
+}
+
+// the text changed from byte at on, the checkpoints before it still hold,
+// a character is at most 4 bytes, so those that start 4 before it do too
+void
+editor_render_cut(struct render *r, int at)
+{
+    if (r == NULL) {
+        return;
+    }
+    while (r->nck > 1 && r->ck[r->nck - 1].at + 4 > at) {
+        r->nck--;
+    }
+    r->done = 0;
+    r->lexed = 0;
+}
+
+// room in hl for a row of size bytes, -1 when out of memory
+int
+editor_render_hl(struct render *r, int size)
+{
+    if (size < r->caphl) {
+        return 0;
+    }
+    int n_cap = size + 1 > r->caphl * 2 ? size + 1 : r->caphl * 2;
+    unsigned char *n_hl = realloc(r->hl, n_cap);
+    if (n_hl == NULL) {
+        return -1;
+    }
+    r->hl = n_hl;
+    r->caphl = n_cap;
+    return 0;
+}
+
+// walk on from the last checkpoint and add the next one, -1 when the end
+// of the row was reached already or there is no memory for it
+int
+editor_render_extend(erow_t *row, struct render *r)
+{
+    if (r->done) {
+        return -1;
+    }
+    if (r->nck == r->capck) {
+        int n_cap = r->capck * 2;
+        struct rcheck *n_ck = malloc(n_cap * sizeof(struct rcheck));
+        if (n_ck == NULL) {
+            return -1;
+        }
+        memcpy(n_ck, r->ck, r->nck * sizeof(struct rcheck));
+        if (r->ck != r->first) {
+            free(r->ck);
+        }
+        r->ck = n_ck;
+        r->capck = n_cap;
+    }
+    struct rcheck c = r->ck[r->nck - 1];
+    int stop = c.at + RENDER_CHECK;
+    const char *shown;
+    int width;
+    int shown_len;
+    while (c.at < row->size && c.at < stop) {
+        c.at += editor_render_char(row, c.at, c.col, &width, &shown, &shown_len);
+        c.col += width;
+    }
+    r->ck[r->nck++] = c;
+    r->done = c.at >= row->size;
+    return 0;
+}
+
+// the last checkpoint at or before byte at
+struct rcheck
+editor_render_check_at(erow_t *row, struct render *r, int at)
+{
+    while (r->ck[r->nck - 1].at + RENDER_CHECK <= at && editor_render_extend(row, r) == 0) {
+    }
+    int lo = 0;
+    int hi = r->nck - 1;
+    while (lo < hi) {
+        int mid = hi - (hi - lo) / 2;
+        if (r->ck[mid].at <= at) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return r->ck[lo];
+}
+
+// the last checkpoint before screen column col, or the start of the row
+struct rcheck
+editor_render_check_col(erow_t *row, struct render *r, int col)
+{
+    while (r->ck[r->nck - 1].col < col && editor_render_extend(row, r) == 0) {
+    }
+    int lo = 0;
+    int hi = r->nck - 1;
+    while (lo < hi) {
+        int mid = hi - (hi - lo) / 2;
+        if (r->ck[mid].col < col) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return r->ck[lo];
+}
+
+// screen column of byte at, every byte of a character is on the column
+// it starts on, past the end every byte counts as one column
+int
+editor_row_col(erow_t *row, int at)
+{
+    if (row == NULL) {
+        return at;
+    }
+    struct render *r = editor_row_render(row);
+    if (r == NULL) {
+        return at;
+    }
+    int past = 0;
+    if (at > row->size) {
+        past = at - row->size;
+        at = row->size;
+    }
+    struct rcheck c = editor_render_check_at(row, r, at);
+    const char *shown;
+    int width;
+    int shown_len;
+    while (c.at < at) {
+        int k = editor_render_char(row, c.at, c.col, &width, &shown, &shown_len);
+        if (c.at + k > at) {
+            break;
+        }
+        c.at += k;
+        c.col += width;
+    }
+    return c.col + past;
+}
+
+int
+editor_is_continuation(erow_t *row, int at)
+{
+    return at > 0 && at < row->size && (row->chars[at] & 0xc0) == 0x80;
+}
+
+// start of the character after the one at at
+int
+editor_next_char(erow_t *row, int at)
+{
+    at++;
+    while (editor_is_continuation(row, at)) {
+        at++;
+    }
+    return at;
+}
+
+// start of the character before the one at at
+int
+editor_prev_char(erow_t *row, int at)
+{
+    if (at > row->size) {
+        return row->size > 0 ? editor_prev_char(row, row->size) : 0;
+    }
+    at--;
+    while (at > 0 && editor_is_continuation(row, at)) {
+        at--;
+    }
+    return at < 0 ? 0 : at;
+}
+
+/*** editor operations ***/
+
+void
+editor_insert_new_line()
+{
+    if (config.win->cx == 0) {
+        editor_insert_row(config.win->cy, "", 0);
+    } else {
+        erow_t *row = editor_row(config.win->cy);
+        editor_insert_row(config.win->cy + 1, &row->chars[config.win->cx],
+                          row->size - config.win->cx);
+        editor_row_del_string(config.win->cy, config.win->cx, INT_MAX);
+    }
+    config.win->cy++;
+    config.win->cx = 0;
+}
+
+void
+editor_insert_char(int c)
+{
+    if (config.win->cy == config.buf->numrows) {
+        editor_insert_row(config.buf->numrows, "", 0);
+    }
+
+    editor_row_insert_char(config.win->cy, config.win->cx, c);
+    config.win->cx++;
+}
+
+// insert a whole block of text at the cursor, one row operation per line
+// instead of one per character
+void
+editor_insert_text(const char *s, size_t len)
+{
+    if (config.win->cy == config.buf->numrows) {
+        editor_insert_row(config.buf->numrows, "", 0);
+    }
+    erow_t *row = editor_row(config.win->cy);
+    if (config.win->cx > row->size) {
+        config.win->cx = row->size;
+    }
+
+    const char *end = s + len;
+    const char *brk = s;
+    while (brk < end && *brk != '\r' && *brk != '\n') {
+        brk++;
+    }
+    if (brk == end) {
+        editor_row_insert_string(config.win->cy, config.win->cx, s, len);
+        config.win->cx += len;
+        return;
+    }
+
+    // the rest of the cursor row ends up after the last pasted line
+    int at = config.win->cy;
+    editor_insert_row(at + 1, &row->chars[config.win->cx], row->size - config.win->cx);
+    editor_row_del_string(at, config.win->cx, INT_MAX);
+    editor_row_append_string(at, (char *)s, brk - s);
+
+    while (brk < end) {
+        // \r\n counts as a single break
+        if (*brk == '\r' && brk + 1 < end && brk[1] == '\n') {
+            brk++;
+        }
+        s = brk + 1;
+        brk = s;
+        while (brk < end && *brk != '\r' && *brk != '\n') {
+            brk++;
+        }
+        at++;
+        if (brk == end) {
+            editor_row_insert_string(at, 0, s, brk - s);
+        } else {
+            editor_insert_row(at, (char *)s, brk - s);
+        }
+    }
+    config.win->cy = at;
+    config.win->cx = end - s;
+}
+
+// collect a bracketed paste up to its end marker and insert it at once
+void
+editor_paste()
+{
+    static struct abuf paste = ABUF_INIT;
+    paste.len = 0;
+
+    while (1) {
+        char c = editor_read_key();
+        if (c == '\x1b' && editor_match_input("[201~")) {
+            break;
+        }
+        ab_append(&paste, &c, 1);
+    }
+    editor_insert_text(paste.b, paste.len);
+}
+
+void
+editor_del_char(int char_off, int cx_off)
+{
+    if ((config.win->cy == config.buf->numrows)
+        || (config.win->cx == 0 && config.win->cy == 0)) {
+        return;
+    }
+
+    erow_t *row = editor_row(config.win->cy);
+    if (config.win->cx > 0) {
+        // the whole character before the cursor, not just its last byte
+        int at = config.win->cx + char_off;
+        if (char_off == -1) {
+            at = editor_prev_char(row, config.win->cx);
+        }
+        int end = config.win->cx < row->size ? config.win->cx : row->size;
+        editor_row_del_string(config.win->cy, at, end - at);
+        config.win->cx = cx_off == -1 ? at : config.win->cx + cx_off;
+    } else {
+        erow_t *prev = editor_row(config.win->cy - 1);
+        config.win->cx = prev->size;
+        editor_row_append_string(config.win->cy - 1, row->chars, row->size);
+        editor_del_row(config.win->cy);
+        config.win->cy--;
+    }
+}
+
+// :m row, the cursor row and the rest of those a count took go below
+// row, 0 puts them on top and $ at the end
+void
+editor_move_to(const char *arg)
+{
+    struct window *w = config.win;
+    long below;
+    char *end;
+    if (strcmp(arg, "$") == 0) {
+        below = INT_MAX;
+    } else if ((below = strtol(arg, &end, 10)) < 0 || *end != '\0') {
+        editor_set_status_message("Usage: m row");
+        return;
+    }
+    below = below < INT_MAX ? below : INT_MAX;
+    editor_index_rows(below);
+    editor_index_rows(w->cy + config.cmd.count);
+    int numrows = config.buf->numrows;
+    int n = config.cmd.count < numrows - w->cy ? config.cmd.count : numrows - w->cy;
+    below = below < numrows ? below : numrows;
+    if (below > w->cy && below < w->cy + n) {
+        editor_set_status_message("Can't move rows into themselves");
+        return;
+    }
+    int to = below >= w->cy + n ? below - n : below;
+    editor_move_rows(w->cy, n, to);
+    w->cy = to + n - 1 >= 0 ? to + n - 1 : 0;
+    editor_move_cursor('\0');
+}
+
+/*** registers ***/
+
+// what y and d took and p puts back, the unnamed one, then a to z, the
+// text is shared with the rows put from it
+#define REGISTERS 27
+
+struct reg {
+    struct shared *text;  // NULL while empty
+    int linewise;         // whole rows, else text from within one
+} regs[REGISTERS];
+
+void
+editor_reg_keep(int r, struct shared *text, int linewise)
+{
+    text->refs++;
+    editor_shared_unref(regs[r].text, 1);
+    regs[r].text = text;
+    regs[r].linewise = linewise;
+}
+
+// text goes to the register picked for the command and the unnamed one,
+// whose reference is handed over
+void
+editor_reg_set(struct shared *text, int linewise)
+{
+    if (text == NULL) {
+        return;
+    }
+    editor_reg_keep(0, text, linewise);
+    if (config.cmd.reg != 0) {
+        editor_reg_keep(config.cmd.reg, text, linewise);
+    }
+    editor_shared_unref(text, 1);
+}
+
+void
+editor_yank_rows(int at, int n)
+{
+    editor_index_rows(at + n);
+    if (n > config.buf->numrows - at) {
+        n = config.buf->numrows - at;
+    }
+    if (at >= 0 && n > 0) {
+        editor_reg_set(editor_shared_from_rows(at, n), 1);
+    }
+}
+
+void
+editor_yank_text(int y, int from, int to)
+{
+    erow_t *row = editor_row(y);
+    struct shared *text = editor_shared_new(to - from, 1);
+    if (row != NULL && text != NULL) {
+        editor_shared_add(text, &row->chars[from], to - from);
+    }
+    editor_reg_set(text, 0);
+}
+
+// put the register count times after the cursor, or before it, rows go
+// in below or above the cursor row
+void
+editor_put(int after, int count)
+{
+    struct reg *reg = &regs[config.cmd.reg];
+    if (reg->text == NULL) {
+        editor_set_status_message("Nothing in register");
+        return;
+    }
+    struct window *w = config.win;
+    editor_index_rows(w->cy + 1);
+    if (reg->linewise) {
+        int at = config.buf->numrows == 0 ? 0 : w->cy + after;
+        for (int i = 0; i < count; i++) {
+            editor_insert_rows(at, reg->text);
+        }
+        w->cy = at;
+        w->cx = 0;
+        return;
+    }
+
+    if (config.buf->numrows == 0) {
+        editor_insert_row(0, "", 0);
+    }
+    struct shared_line *l = editor_shared_first(reg->text);
+    erow_t *row = editor_row(w->cy);
+    int at = after && row->size > 0 ? editor_next_char(row, w->cx) : w->cx;
+    for (int i = 0; i < count; i++) {
+        editor_row_insert_string(w->cy, at, l->text, l->len);
+    }
+    // on the last character put
+    w->cx = at + count * l->len - 1;
+    editor_move_cursor('\0');
+}
+
+/*** line index ***/
+
+// every scanner stores the offsets of the '\n' bytes found in buf[from, len)
+// into nl, starting at nl[n], and returns the new count, scanning stops as
+// soon as max offsets are stored
+
+size_t
+lidx_scan_bytes(const char *buf, size_t from, size_t len, size_t *nl, size_t n, size_t max)
+{
+    const char *p = buf + from;
+    const char *end = buf + len;
+    while (n < max && (p = memchr(p, '\n', end - p)) != NULL) {
+        nl[n++] = p - buf;
+        p++;
+    }
+    return n;
+}
+
+#ifdef LIDX_X86
+size_t
+lidx_scan_sse2(const char *buf, size_t from, size_t len, size_t *nl, size_t n, size_t max)
+{
+    __m128i needle = _mm_set1_epi8('\n');
+    size_t i = from;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        while (mask) {
+            if (n == max) {
+                return n;
+            }
+            nl[n++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return lidx_scan_bytes(buf, i, len, nl, n, max);
+}
+
+__attribute__((target("avx2")))
+size_t
+lidx_scan_avx2(const char *buf, size_t from, size_t len, size_t *nl, size_t n, size_t max)
+{
+    __m256i needle = _mm256_set1_epi8('\n');
+    size_t i = from;
+    for (; i + 64 <= len; i += 64) {
+        // two vectors per round, most 64 byte blocks hold at most one line end
+        __m256i lo = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+        unsigned long long mask =
+            (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle))
+            | (unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle)) << 32;
+        while (mask) {
+            if (n == max) {
+                return n;
+            }
+            nl[n++] = i + __builtin_ctzll(mask);
+            mask &= mask - 1;
+        }
+    }
+    return lidx_scan_sse2(buf, i, len, nl, n, max);
+}
+#endif
+
+#ifdef LIDX_NEON
+size_t
+lidx_scan_neon(const char *buf, size_t from, size_t len, size_t *nl, size_t n, size_t max)
+{
+    uint8x16_t needle = vdupq_n_u8('\n');
+    size_t i = from;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)(buf + i)), needle);
+        // narrow every byte to a nibble, there is no movemask on arm
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        while (mask) {
+            if (n == max) {
+                return n;
+            }
+            nl[n++] = i + (__builtin_ctzll(mask) >> 2);
+            mask &= ~(0xfull << (__builtin_ctzll(mask) & ~3));
+        }
+    }
+    return lidx_scan_bytes(buf, i, len, nl, n, max);
+}
+#endif
+
+size_t
+lidx_scan(const char *buf, size_t len, size_t *nl, size_t max)
+{
+    static size_t (*scan)(const char *, size_t, size_t, size_t *, size_t, size_t) = NULL;
+
+    if (scan == NULL) {
+#if defined(LIDX_X86)
+        __builtin_cpu_init();
+        scan = __builtin_cpu_supports("avx2") ? lidx_scan_avx2 : lidx_scan_sse2;
+#elif defined(LIDX_NEON)
+        scan = lidx_scan_neon;
+#else
+        scan = lidx_scan_bytes;
+#endif
+    }
+    return scan(buf, 0, len, nl, 0, max);
+}
+
+// turn the complete lines at the start of buf into rows until there are
+// want of them, returns the bytes consumed, which always end on a '\n'
+size_t
+editor_split_rows(char *buf, size_t len, int want, int mapped)
+{
+    size_t nl[LIDX_BATCH];
+    size_t done = 0;
+
+    while (config.buf->numrows < want && done < len) {
+        size_t max = (size_t)(want - config.buf->numrows);
+        max = max < LIDX_BATCH ? max : LIDX_BATCH;
+
+        size_t n = lidx_scan(buf + done, len - done, nl, max);
+        if (n == 0) {
+            break;
+        }
+
+        char *line = buf + done;
+        size_t prev = 0;
+        for (size_t i = 0; i < n; i++) {
+            size_t linelen = nl[i] - prev;
+            while (linelen > 0 && line[prev + linelen - 1] == '\r') {
+                linelen--;
+            }
+            editor_insert_mapped_row(line + prev, linelen, mapped ? ROW_MAPPED : ROW_SLAB);
+            prev = nl[i] + 1;
+        }
+        done += prev;
+    }
+    return done;
+}
+
+/*** compression ***/
+
+// compressed files are recognized by their magic bytes and streamed
+// through the command line tool of their format, which runs alongside the
+// editor splitting its output into rows
+struct codec {
+    char *ext;
+    char *magic;
+    int magic_len;
+    char **decompress;
+    char **compress;
+};
+
+char *gzip_decompress[] = {"gzip", "-dc", NULL};
+char *gzip_compress[] = {"gzip", "-c", NULL};
+char *zstd_decompress[] = {"zstd", "-dcq", NULL};
+char *zstd_compress[] = {"zstd", "-cq", NULL};
+
+struct codec codecs[] = {
+    {".gz", "\x1f\x8b", 2, gzip_decompress, gzip_compress},
+    {".zst", "\x28\xb5\x2f\xfd", 4, zstd_decompress, zstd_compress},
+};
+
+#define CODEC_ENTRIES (sizeof(codecs) / sizeof(codecs[0]))
+
+// codec of the data in fd, NULL for plain text
+struct codec *
+editor_detect_codec(int fd)
+{
+    char magic[8];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    for (size_t i = 0; i < CODEC_ENTRIES; i++) {
+        if (n >= codecs[i].magic_len
+            && memcmp(magic, codecs[i].magic, codecs[i].magic_len) == 0) {
+            return &codecs[i];
+        }
+    }
+    return NULL;
+}
+
+// codec a file gets written with going by its name
+struct codec *
+editor_codec_for(const char *filename)
+{
+    size_t len = strlen(filename);
+    for (size_t i = 0; i < CODEC_ENTRIES; i++) {
+        size_t elen = strlen(codecs[i].ext);
+        if (len > elen && strcmp(&filename[len - elen], codecs[i].ext) == 0) {
+            return &codecs[i];
+        }
+    }
+    return NULL;
+}
+
+// run argv reading from in and writing to out, its complaints would end up
+// all over the screen so they go nowhere, pipes handed to it must be close
+// on exec or it never sees the end of its input
+pid_t
+editor_spawn(char **argv, int in, int out)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        if (null != -1) {
+            dup2(null, STDERR_FILENO);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+// wait for a spawned tool, -1 when it didn't finish cleanly
+int
+editor_reap(pid_t pid)
+{
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/*** file i/o ***/
+
+// more rows are to come from the file
+int
+editor_rows_pending()
+{
+    return config.buf->map_off < config.buf->map_size || editor_pager_pending();
+}
+
+// split the mapped file into rows until there are at least want of them
+void
+editor_index_rows(int want)
+{
+    if (pager.on) {
+        editor_pager_index(want);
+        return;
+    }
+    if (config.buf->numrows >= want || config.buf->map_off == config.buf->map_size) {
+        return;
+    }
+    int before = config.buf->numrows;
+    config.buf->map_off += editor_split_rows(config.buf->map + config.buf->map_off,
+                                        config.buf->map_size - config.buf->map_off, want, 1);
+
+    if (config.buf->numrows < want && config.buf->map_off < config.buf->map_size) {
+        // last line without a trailing newline
+        size_t len = config.buf->map_size - config.buf->map_off;
+        char *start = config.buf->map + config.buf->map_off;
+        while (len > 0 && start[len - 1] == '\r') {
+            len--;
+        }
+        editor_insert_mapped_row(start, len, ROW_MAPPED);
+        config.buf->map_off = config.buf->map_size;
+    }
+    editor_index_checks(before);
+}
+
+// remember off as the start of the next checkpoint line
+void
+editor_add_check(size_t **check, int *n, int *cap, size_t off)
+{
+    if (*n == *cap) {
+        int n_cap = *cap ? *cap * 2 : 1024;
+        size_t *n_check = realloc(*check, sizeof(size_t) * n_cap);
+        if (n_check == NULL) {
+            die("realloc");
+        }
+        *check = n_check;
+        *cap = n_cap;
+    }
+    (*check)[(*n)++] = off;
+}
+
+// rows from before on were just made from the map, note where the lines
+// among them that fall on a checkpoint start, rows edited before them
+// don't count
+void
+editor_index_checks(int before)
+{
+    struct buffer *b = config.buf;
+    int made = b->numrows - before;
+    int l = (b->lines + PAGER_CHECKPOINT - 1) / PAGER_CHECKPOINT * PAGER_CHECKPOINT;
+    for (; l < b->lines + made; l += PAGER_CHECKPOINT) {
+        erow_t *row = editor_row(before + l - b->lines);
+        editor_add_check(&b->check, &b->ncheck, &b->capcheck, row->chars - b->map);
+    }
+    b->lines += made;
+}
+
+// map regular files and only split the rows needed for the first screen,
+// the rest is indexed on demand or while waiting for input
+int
+editor_open_mapped(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return -1;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    config.buf->map = map;
+    config.buf->map_size = st.st_size;
+    config.buf->map_off = 0;
+    config.buf->mapped = st;
+    editor_index_rows(config.win->screen_rows + 1);
+    return 0;
+}
+
+/*** background loading ***/
+
+void
+editor_load_queue(struct load *l, struct lchunk *c)
+{
+    c->next = NULL;
+    pthread_mutex_lock(&l->lock);
+    if (l->tail != NULL) {
+        l->tail->next = c;
+    } else {
+        l->head = c;
+    }
+    l->tail = c;
+    pthread_mutex_unlock(&l->lock);
+    write(loads.wake[1], "", 1);
+}
+
+// the loading thread, reads until the end and hands over the whole lines
+// of what came in, right away while the editor keeps up and in chunks of
+// LOAD_CHUNK while it doesn't, a line longer than that grows the chunk
+void *
+editor_loader(void *arg)
+{
+    struct load *l = arg;
+    size_t cap = LOAD_CHUNK;
+    size_t len = 0;
+    struct lchunk *c = malloc(sizeof(struct lchunk) + cap);
+    int failed = c == NULL;
+    while (!failed) {
+        if (len == cap) {
+            struct lchunk *n_c = realloc(c, sizeof(struct lchunk) + cap * 2);
+            if (n_c == NULL) {
+                failed = 1;
+                break;
+            }
+            c = n_c;
+            cap *= 2;
+        }
+        ssize_t n = read(l->fd, c->text + len, cap - len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            failed = n == -1;
+            break;
+        }
+        len += n;
+
+        pthread_mutex_lock(&l->lock);
+        int waiting = l->head == NULL;
+        pthread_mutex_unlock(&l->lock);
+        char *nl = memrchr(c->text, '\n', len);
+        if (nl == NULL || (len < cap && !waiting)) {
+            continue;
+        }
+
+        // the unfinished line goes on in the next chunk
+        size_t cut = nl - c->text + 1;
+        size_t n_cap = LOAD_CHUNK;
+        while (n_cap <= len - cut) {
+            n_cap *= 2;
+        }
+        struct lchunk *next = malloc(sizeof(struct lchunk) + n_cap);
+        if (next == NULL) {
+            failed = 1;
+            break;
+        }
+        memcpy(next->text, c->text + cut, len - cut);
+        c->len = cut;
+        editor_load_queue(l, c);
+        c = next;
+        cap = n_cap;
+        len -= cut;
+    }
+    if (c != NULL) {
+        c->len = len;
+        editor_load_queue(l, c);
+    }
+
+    pthread_mutex_lock(&l->lock);
+    l->done = 1;
+    l->failed = failed;
+    pthread_mutex_unlock(&l->lock);
+    write(loads.wake[1], "", 1);
+    return NULL;
+}
+
+// everything is in, collect the thread and the decompressor, -1 when
+// the file couldn't be read to the end
+int
+editor_load_finish(struct load *l)
+{
+    pthread_join(l->thread, NULL);
+    int failed = l->failed;
+    if (l->pid > 0 && editor_reap(l->pid) == -1) {
+        failed = 1;
+    }
+    close(l->fd);
+    if (l->src != -1) {
+        close(l->src);
+    }
+    pthread_mutex_destroy(&l->lock);
+    if (failed) {
+        l->buf->partial = 1;
+        editor_set_status_message("Couldn't read all of %s, %d lines are in",
+                                  l->buf->filename, l->buf->numrows);
+    }
+    struct load **p = &loads.list;
+    while (*p != l) {
+        p = &(*p)->next;
+    }
+    *p = l->next;
+    free(l);
+    return failed ? -1 : 0;
+}
+
+// make what the thread queued into rows, at most LOAD_STEP bytes of it so
+// input gets looked at in between, returns -1 when the load ended badly
+int
+editor_load_take(struct load *l)
+{
+    pthread_mutex_lock(&l->lock);
+    struct lchunk *c = l->head;
+    struct lchunk *last = NULL;
+    size_t took = 0;
+    while (l->head != NULL && took < LOAD_STEP) {
+        took += l->head->len;
+        last = l->head;
+        l->head = l->head->next;
+    }
+    if (l->head == NULL) {
+        l->tail = NULL;
+    } else {
+        last->next = NULL;
+        write(loads.wake[1], "", 1);  // come back for the rest
+    }
+    // all is in once the thread is done and nothing is left queued
+    int done = l->done && l->head == NULL;
+    pthread_mutex_unlock(&l->lock);
+
+    struct buffer *cur = config.buf;
+    config.buf = l->buf;
+    while (c != NULL) {
+        struct lchunk *next = c->next;
+        size_t used = editor_split_rows(c->text, c->len, INT_MAX, 0);
+        if (used < c->len) {
+            // the last line of the file without a newline
+            size_t len = c->len - used;
+            while (len > 0 && c->text[used + len - 1] == '\r') {
+                len--;
+            }
+            editor_insert_mapped_row(c->text + used, len, ROW_SLAB);
+        }
+        free(c);
+        c = next;
+    }
+    config.buf = cur;
+    return done ? editor_load_finish(l) : 0;
+}
+
+// take some of what every thread queued
+void
+editor_load_take_all()
+{
+    char buf[64];
+    while (read(loads.wake[0], buf, sizeof(buf)) > 0) {
+        ;
+    }
+    struct load *l = loads.list;
+    while (l != NULL) {
+        struct load *next = l->next;
+        editor_load_take(l);
+        l = next;
+    }
+}
+
+// rows came in, show them
+void
+editor_load_event()
+{
+    editor_load_take_all();
+    editor_refresh_screen();
+}
+
+// the load filling b, NULL when it isn't loading
+struct load *
+editor_load_of(struct buffer *b)
+{
+    struct load *l = loads.list;
+    while (l != NULL && l->buf != b) {
+        l = l->next;
+    }
+    return l;
+}
+
+// block until the current buffer is all in, the others go on loading
+void
+editor_load_wait()
+{
+    while (editor_load_of(config.buf) != NULL) {
+        struct pollfd pfd = {loads.wake[0], POLLIN, 0};
+        if (poll(&pfd, 1, -1) > 0) {
+            editor_load_take_all();
+        }
+    }
+}
+
+// read fd into the current buffer in the background, pid is the
+// decompressor writing to it from src, they are closed and reaped when it
+// is done. Returns right away, the rows are drawn as they come in, -1 when
+// reading can't be started
+int
+editor_load_start(int fd, int src, pid_t pid)
+{
+    struct load *l = NULL;
+    if (loads.wake[0] == -1) {
+        if (pipe(loads.wake) == -1) {
+            goto fail;
+        }
+        for (int i = 0; i < 2; i++) {
+            fcntl(loads.wake[i], F_SETFL, O_NONBLOCK);
+            fcntl(loads.wake[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+    if ((l = malloc(sizeof(struct load))) == NULL) {
+        goto fail;
+    }
+    struct stat st;
+    l->buf = config.buf;
+    l->fd = fd;
+    l->src = src;
+    l->size = src != -1 && fstat(src, &st) == 0 ? st.st_size : 0;
+    l->pid = pid;
+    l->head = NULL;
+    l->tail = NULL;
+    l->done = 0;
+    l->failed = 0;
+    pthread_mutex_init(&l->lock, NULL);
+    if (pthread_create(&l->thread, NULL, editor_loader, l) != 0) {
+        pthread_mutex_destroy(&l->lock);
+        goto fail;
+    }
+    l->next = loads.list;
+    loads.list = l;
+    return 0;
+
+fail:;
+    int saved = errno;
+    free(l);
+    close(fd);
+    if (src != -1) {
+        close(src);
+    }
+    if (pid > 0) {
+        editor_reap(pid);
+    }
+    errno = saved;
+    return -1;
+}
+
+// rows of a compressed file, the tool decompresses it into a pipe the
+// loading thread reads, fd is closed when it is done, -1 when it fails
+int
+editor_load_compressed(int fd, struct codec *codec)
+{
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) == -1) {
+        close(fd);
+        return -1;
+    }
+    pid_t pid = editor_spawn(codec->decompress, fd, p[1]);
+    close(p[1]);
+    if (pid == -1) {
+        close(p[0]);
+        close(fd);
+        return -1;
+    }
+    return editor_load_start(p[0], fd, pid);
+}
+
+// the rows of the current buffer aren't all in yet
+int
+editor_loading()
+{
+    return editor_load_of(config.buf) != NULL;
+}
+
+// how much of the file is in while rows are still to come, for the
+// status bar, empty when that isn't known
+const char *
+editor_progress()
+{
+    static char buf[16];
+    off_t done = -1;
+    off_t total = 0;
+    struct load *l = editor_load_of(config.buf);
+    if (l != NULL) {
+        done = l->src != -1 ? lseek(l->src, 0, SEEK_CUR) : -1;
+        total = l->size;
+    } else if (pager.on) {
+        done = pager.scanned;
+        total = pager.size;
+    } else if (editor_rows_pending()) {
+        done = config.buf->map_off;
+        total = config.buf->map_size;
+    }
+    if (done < 0 || total <= 0) {
+        return "";
+    }
+    done = done < total ? done : total;
+    snprintf(buf, sizeof(buf), " %d%%", (int)(done * 100 / total));
+    return buf;
+}
+
+// load filename into the current buffer, returns -1 when it can't be opened
+int
+editor_open(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    config.buf->filename = strdup(filename);
+    config.buf->codec = editor_detect_codec(fd);
+    config.buf->journal->replay = 1;  // loading isn't an edit to undo
+
+    if (config.buf->codec == NULL) {
+        editor_select_syntax(filename);
+        if (editor_open_mapped(fd) == 0) {
+            config.buf->journal->replay = 0;
+            config.buf->dirty = 0;
+            close(fd);
+            editor_lcache_load();
+            return 0;
+        }
+        // a pipe, the loading thread owns fd from here on
+        if (editor_load_start(fd, -1, 0) == -1) {
+            return -1;
+        }
+    } else {
+        // highlight foo.c.gz like foo.c
+        char *name = strdup(filename);
+        if (name != NULL) {
+            if (editor_codec_for(name) == config.buf->codec) {
+                name[strlen(name) - strlen(config.buf->codec->ext)] = '\0';
+            }
+            editor_select_syntax(name);
+            free(name);
+        }
+        // fd is closed once the decompressor is done with it
+        if (editor_load_compressed(fd, config.buf->codec) == -1) {
+            return -1;
+        }
+    }
+    config.buf->journal->replay = 0;
+    config.buf->dirty = 0;
+    editor_lcache_load();
+    return 0;
+}
+
+// pieces of row text and newlines gathered for one writev, they point
+// straight at the rows, nothing is copied
+struct wbatch {
+    int fd;
+    int progress_fd;
+    int count;
+    int failed;
+    size_t pending;  // bytes in iov
+    long long written;
+    long long reported;
+    struct iovec iov[SAVE_IOV];
+};
+
+int
+editor_flush_batch(struct wbatch *wb)
+{
+    struct iovec *iov = wb->iov;
+    int cnt = wb->count;
+    wb->count = 0;
+    wb->pending = 0;
+
+    while (cnt > 0) {
+        ssize_t n = writev(wb->fd, iov, cnt);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        wb->written += n;
+        // skip what went out, a short write can stop inside an iovec
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    if (wb->progress_fd != -1 && wb->written - wb->reported >= SAVE_REPORT) {
+        write(wb->progress_fd, &wb->written, sizeof(wb->written));
+        wb->reported = wb->written;
+    }
+    return 0;
+}
+
+void
+editor_batch_row(erow_t *row, void *arg)
+{
+    struct wbatch *wb = arg;
+    if (wb->failed) {
+        return;
+    }
+
+    // unedited rows still point into the mapped file with their newline
+    // right behind them, so text and separator go out as one piece and
+    // runs of such rows merge into one iovec (kept small enough to report
+    // progress in between)
+    char *end = row->chars + row->size;
+    if (row->store == ROW_MAPPED && end < config.buf->map + config.buf->map_size && *end == '\n') {
+        struct iovec *last = wb->count ? &wb->iov[wb->count - 1] : NULL;
+        if (last && (char *)last->iov_base + last->iov_len == row->chars
+            && last->iov_len + row->size + 1 <= SAVE_REPORT) {
+            last->iov_len += row->size + 1;
+        } else {
+            wb->iov[wb->count].iov_base = row->chars;
+            wb->iov[wb->count].iov_len = row->size + 1;
+            wb->count++;
+        }
+    } else {
+        if (row->size > 0) {
+            wb->iov[wb->count].iov_base = row->chars;
+            wb->iov[wb->count].iov_len = row->size;
+            wb->count++;
+        }
+        wb->iov[wb->count].iov_base = "\n";
+        wb->iov[wb->count].iov_len = 1;
+        wb->count++;
+    }
+    wb->pending += row->size + 1;
+
+    if ((wb->count >= SAVE_IOV - 1 || wb->pending >= SAVE_REPORT)
+        && editor_flush_batch(wb) == -1) {
+        wb->failed = 1;
+    }
+}
+
+void
+editor_count_bytes(erow_t *row, void *total)
+{
+    *(long long *)total += row->size + 1;
+}
+
+// write the rows to a temporary file next to filename, sync it and rename
+// it over the original, so a crash never leaves a half written file behind,
+// returns the bytes written or -1
+long long
+editor_save_file(const char *filename, int progress_fd)
+{
+    // write through symlinks instead of replacing them
+    char *path = realpath(filename, NULL);
+    if (path == NULL) {
+        if (errno != ENOENT || (path = strdup(filename)) == NULL) {
+            return -1;
+        }
+    }
+
+    char *slash = strrchr(path, '/');
+    int dirlen = slash ? slash - path + 1 : 0;
+    char *tmp = malloc(strlen(path) + 16);
+    if (tmp == NULL) {
+        free(path);
+        return -1;
+    }
+    sprintf(tmp, "%.*s.%s.XXXXXX", dirlen, path, slash ? slash + 1 : path);
+
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        free(path);
+        return -1;
+    }
+
+    // keep the permissions of the file being replaced
+    struct stat st;
+    mode_t mode;
+    if (stat(path, &st) == 0) {
+        mode = st.st_mode & 07777;
+    } else {
+        mode = umask(0);
+        umask(mode);
+        mode = 0666 & ~mode;
+    }
+    fchmod(fd, mode);
+
+    // compressed files are written by the tool, the rows go to it through
+    // a pipe as they would go to the file
+    struct codec *codec = editor_codec_for(filename);
+    if (codec == NULL && config.buf->filename != NULL
+        && strcmp(filename, config.buf->filename) == 0) {
+        codec = config.buf->codec;
+    }
+    int out = fd;
+    pid_t pid = -1;
+    if (codec != NULL) {
+        int p[2];
+        if (pipe2(p, O_CLOEXEC) == 0) {
+            pid = editor_spawn(codec->compress, p[0], fd);
+            close(p[0]);
+            out = p[1];
+        }
+    }
+
+    struct wbatch *wb = malloc(sizeof(struct wbatch));
+    long long written = -1;
+    if (wb != NULL && (codec == NULL || pid != -1)) {
+        wb->fd = out;
+        wb->progress_fd = progress_fd;
+        wb->count = 0;
+        wb->failed = 0;
+        wb->pending = 0;
+        wb->written = 0;
+        wb->reported = 0;
+        rope_walk(config.buf->rows.root, editor_batch_row, wb);
+        if (!wb->failed && editor_flush_batch(wb) == 0) {
+            written = wb->written;
+        }
+    }
+    free(wb);
+    if (codec != NULL) {
+        close(out);
+        if (pid == -1 || editor_reap(pid) == -1) {
+            written = -1;
+            errno = EIO;
+        }
+    }
+
+    if (written == -1 || fsync(fd) == -1 || close(fd) == -1 || rename(tmp, path) == -1) {
+        int saved = errno;
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        free(path);
+        errno = saved;
+        return -1;
+    }
+
+    // make the rename itself durable
+    char *dir = dirlen ? strndup(path, dirlen) : strdup(".");
+    int dfd = dir ? open(dir, O_RDONLY) : -1;
+    if (dfd != -1) {
+        fsync(dfd);
+        close(dfd);
+    }
+    free(dir);
+    free(tmp);
+    free(path);
+    return written;
+}
+
+// filename was written with the text b had when its dirty count was dirty
+// and swap_off bytes were logged, by the worker or in the foreground
+void
+editor_saved(struct buffer *b, const char *filename, long long bytes, int dirty,
+             long long swap_off)
+{
+    editor_set_status_message("Save file: %s, %lld bytes written to disk", filename, bytes);
+    b->dirty -= dirty;  // edits made while saving still count
+    if (b->filename != NULL && strcmp(filename, b->filename) == 0) {
+        editor_swap_saved(b, swap_off);
+        editor_diff_saved(b);
+    }
+}
+
+// read the progress the worker reported, and collect it once it is done
+void
+editor_save_progress()
+{
+    long long msg[64];
+    ssize_t n = read(save.fd, msg, sizeof(msg));
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n > 0) {
+        // the first report is the size of the whole file
+        for (int i = 0; i < (int)(n / sizeof(long long)); i++) {
+            if (save.total == -1) {
+                save.total = msg[i];
+            } else {
+                save.done = msg[i];
+            }
+        }
+        editor_set_status_message("Saving %s: %d%%", save.filename,
+                                  save.total > 0 ? (int)(save.done * 100 / save.total) : 0);
+        editor_refresh_screen();
+        return;
+    }
+
+    int status;
+    waitpid(save.pid, &status, 0);
+    close(save.fd);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        editor_saved(save.buf, save.filename, save.total, save.dirty, save.swap_off);
+    } else {
+        editor_set_status_message("Can't save!");
+    }
+    free(save.filename);
+    save.filename = NULL;
+    save.fd = -1;
+    save.pid = 0;
+    editor_refresh_screen();
+}
+
+// block until a running background save has finished
+void
+editor_save_wait()
+{
+    while (save.pid) {
+        struct pollfd pfd = {save.fd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) > 0) {
+            editor_save_progress();
+        }
+    }
+}
+
+void
+editor_save(char *new_filename)
+{
+    char *filename;
+
+    if (new_filename == NULL) {
+        if (config.buf->filename == NULL) {
+            editor_set_status_message("provide filename");
+            return;
+        } else {
+            filename = config.buf->filename;
+        }
+    } else {
+        filename = new_filename;
+    }
+
+    if (save.pid) {
+        editor_set_status_message("Still saving %s", save.filename);
+        return;
+    }
+    if (editor_loading()) {
+        editor_set_status_message("Still loading %s", config.buf->filename);
+        return;
+    }
+    if (config.buf->partial && strcmp(filename, config.buf->filename) == 0) {
+        editor_set_status_message("Not all of %s was read, save it under another name",
+                                  filename);
+        return;
+    }
+
+    editor_index_rows(INT_MAX);
+
+    int p[2];
+    pid_t pid = -1;
+    long long swap_off = editor_swap_logged(config.buf);
+    if (pipe(p) == 0) {
+        pid = fork();
+        if (pid == -1) {
+            close(p[0]);
+            close(p[1]);
+        }
+    }
+
+    if (pid == 0) {
+        // worker, owns a frozen copy of the rows until it exits
+        signal(SIGWINCH, SIG_DFL);
+        close(p[0]);
+        long long total = 0;
+        rope_walk(config.buf->rows.root, editor_count_bytes, &total);
+        write(p[1], &total, sizeof(total));
+        _exit(editor_save_file(filename, p[1]) == -1);
+    }
+
+    if (pid == -1) {
+        // no worker, save in the foreground
+        long long len = editor_save_file(filename, -1);
+        if (len == -1) {
+            editor_set_status_message("Can't save!");
+            return;
+        }
+        editor_saved(config.buf, filename, len, config.buf->dirty, swap_off);
+        return;
+    }
+
+    close(p[1]);
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    fcntl(p[0], F_SETFD, FD_CLOEXEC);
+    save.pid = pid;
+    save.fd = p[0];
+    save.total = -1;
+    save.done = 0;
+    save.buf = config.buf;
+    save.dirty = config.buf->dirty;
+    save.swap_off = swap_off;
+    save.filename = strdup(filename);
+    editor_set_status_message("Saving %s", filename);
+}
+
+/*** pager ***/
+
+// candy -R file shows a file too big to split into rows up front, rows
+// are made on demand a block at a time from the mapped file, and only the
+// start of every PAGER_CHECKPOINT-th row is remembered
+
+// scan up to bytes more of the file for rows
+void
+editor_pager_scan(size_t bytes)
+{
+    size_t nl[LIDX_BATCH];
+    size_t end = pager.size - pager.scanned < bytes ? pager.size : pager.scanned + bytes;
+    while (pager.scanned < end) {
+        if (pager.lines == PAGER_MAX_ROWS) {
+            pager.cut = 1;
+            pager.size = pager.scanned;
+            editor_set_status_message("%s has more than %d lines, only those are shown",
+                                      config.buf->filename, PAGER_MAX_ROWS);
+            break;
+        }
+        size_t need = PAGER_CHECKPOINT - pager.lines % PAGER_CHECKPOINT;
+        size_t n = lidx_scan(pager.map + pager.scanned, end - pager.scanned, nl, need);
+        if (n == 0) {
+            pager.scanned = end;
+            break;
+        }
+        pager.lines += n;
+        pager.scanned += nl[n - 1] + 1;
+        if (n == need && pager.scanned < pager.size && pager.lines < PAGER_MAX_ROWS) {
+            editor_add_check(&pager.check, &pager.ncheck, &pager.capcheck, pager.scanned);
+        }
+    }
+
+    // what was scanned isn't needed until a block is made from it, don't
+    // let it pile up in memory
+    size_t drop = pager.scanned & ~(size_t)(pager.pagesize - 1);
+    if (drop > pager.dropped) {
+        madvise(pager.map + pager.dropped, drop - pager.dropped, MADV_DONTNEED);
+        pager.dropped = drop;
+    }
+
+    int tail = pager.scanned == pager.size && pager.size > 0
+        && pager.map[pager.size - 1] != '\n';
+    config.buf->numrows = pager.lines + tail;
+}
+
+// scan until there are want rows or the file ends, a long scan shows how
+// far it got and stops early when a key is pressed
+void
+editor_pager_index(int want)
+{
+    size_t reported = pager.scanned;
+    while (config.buf->numrows < want && pager.scanned < pager.size) {
+        editor_pager_scan(PAGER_STEP);
+        if (want == INT_MAX && pager.scanned - reported >= PAGER_REPORT) {
+            reported = pager.scanned;
+            if (editor_input_pending()) {
+                break;
+            }
+            editor_set_status_message("Indexing %s: %d%%", config.buf->filename,
+                                      (int)(pager.scanned * 100 / pager.size));
+            editor_refresh_screen();
+        }
+    }
+}
+
+int
+editor_pager_pending()
+{
+    return pager.on && pager.scanned < pager.size;
+}
+
+// throw away the rows of a block and let go of its part of the file
+void
+editor_pager_evict(struct pager_block *b)
+{
+    if (b->count == 0) {
+        return;
+    }
+    for (int i = 0; i < b->count; i++) {
+        editor_render_free(b->rows[i].r);
+    }
+    size_t from = (b->rows[0].chars - pager.map) & ~(size_t)(pager.pagesize - 1);
+    erow_t *last = &b->rows[b->count - 1];
+    size_t to = last->chars + last->size - pager.map;
+    madvise(pager.map + from, to - from, MADV_DONTNEED);
+    b->count = 0;
+}
+
+// make the rows of the block starting at row first, the checkpoint before
+// it says where in the file to look
+void
+editor_pager_load(struct pager_block *b, int first)
+{
+    editor_pager_evict(b);
+    size_t nl[LIDX_BATCH];
+    size_t off = pager.check[first / PAGER_CHECKPOINT];
+    int want = config.buf->numrows - first;
+    want = want < PAGER_CHECKPOINT ? want : PAGER_CHECKPOINT;
+
+    b->first = first;
+    size_t n = lidx_scan(pager.map + off, pager.size - off, nl, want);
+    size_t prev = 0;
+    for (int i = 0; i < want; i++) {
+        // only the last row of the file can be without a newline
+        size_t end = (size_t)i < n ? nl[i] : pager.size - off;
+        size_t len = end - prev;
+        while (len > 0 && pager.map[off + prev + len - 1] == '\r') {
+            len--;
+        }
+        erow_t *row = &b->rows[i];
+        row->size = len;
+        row->cap = 0;
+        row->chars = pager.map + off + prev;
+        row->r = NULL;
+        row->gen = 0;
+        row->store = ROW_MAPPED;
+        row->hl_known = 0;
+        row->vrows = 0;
+        prev = end + 1;
+    }
+    b->count = want;
+}
+
+// row at, a pointer into a block which stays good until a few other
+// blocks have been used
+erow_t *
+editor_pager_row(int at)
+{
+    if (at < 0 || at >= config.buf->numrows) {
+        return NULL;
+    }
+    int first = at - at % PAGER_CHECKPOINT;
+    struct pager_block *b = NULL;
+    struct pager_block *lru = &pager.blocks[0];
+    for (int i = 0; i < PAGER_BLOCKS; i++) {
+        struct pager_block *c = &pager.blocks[i];
+        if (c->count > 0 && c->first == first) {
+            b = c;
+            break;
+        }
+        if (c->used < lru->used) {
+            lru = c;
+        }
+    }
+    // a block at the end of the scan may have grown since it was made
+    if (b == NULL || at >= b->first + b->count) {
+        b = b != NULL ? b : lru;
+        editor_pager_load(b, first);
+    }
+    b->used = ++pager.clock;
+    return &b->rows[at - first];
+}
+
+// what the pager refuses to do, the file is shown straight from the map
+int
+editor_pager_refuse()
+{
+    int refuse = pager.on || config.buf->ondisk;
+    if (refuse) {
+        editor_set_status_message("Read only");
+    }
+    return refuse;
+}
+
+// candy -R file, -1 when the file can't be mapped
+int
+editor_pager_open(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0
+        || editor_detect_codec(fd) != NULL) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    config.buf->mapped = st;
+    pager.on = 1;
+    pager.map = map;
+    pager.size = st.st_size;
+    pager.pagesize = sysconf(_SC_PAGESIZE);
+    pager.capcheck = 1024;
+    if ((pager.check = malloc(sizeof(size_t) * pager.capcheck)) == NULL) {
+        die("malloc");
+    }
+    pager.check[0] = 0;
+    pager.ncheck = 1;
+    config.buf->filename = strdup(filename);
+    editor_select_syntax(filename);
+    editor_lcache_load();
+    editor_index_rows(config.win->rowoff + config.win->screen_rows + 1);
+    return 0;
+}
+
+/*** index cache ***/
+
+// where the lines of a file start, every PAGER_CHECKPOINT-th of them, and
+// where the cursor was are kept in .name.idx next to it when the editor
+// quits, the next open of the same file takes them instead of scanning.
+// Files under LCACHE_MIN bytes go without
+#define LCACHE_MAGIC "candyidx"
+
+struct lcache_head {
+    char magic[8];
+    // the file the checkpoints are for, they are only used on a match
+    long long size;
+    long long mtime;  // in ns
+    long long ino;
+    long long dev;
+    int every;   // PAGER_CHECKPOINT when written
+    int lines;   // '\n's in the file
+    int ncheck;  // 0 when only the cursor is kept
+    int cx;
+    int cy;
+    int rowoff;
+};
+
+char *
+editor_lcache_path(const char *filename)
+{
+    const char *slash = strrchr(filename, '/');
+    int dirlen = slash ? slash - filename + 1 : 0;
+    char *path = malloc(strlen(filename) + 6);
+    if (path != NULL) {
+        sprintf(path, "%.*s.%s.idx", dirlen, filename, filename + dirlen);
+    }
+    return path;
+}
+
+int
+editor_lcache_matches(struct lcache_head *head, struct stat *st)
+{
+    return head->size == st->st_size
+        && head->mtime == st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec
+        && head->ino == (long long)st->st_ino && head->dev == (long long)st->st_dev;
+}
+
+// the checkpoints of a file of size bytes with rows rows, as a scan
+// would find them
+int
+editor_lcache_valid(size_t *check, int n, int rows, size_t size)
+{
+    if (n != (rows + PAGER_CHECKPOINT - 1) / PAGER_CHECKPOINT || (n > 0 && check[0] != 0)) {
+        return 0;
+    }
+    for (int i = 1; i < n; i++) {
+        if (check[i] <= check[i - 1] || check[i] >= size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// read the cache of filename, the checkpoints only when they are of the
+// file st is of, -1 when there is no cache
+int
+editor_lcache_read(const char *filename, struct stat *st, struct lcache_head *head, size_t **check)
+{
+    char *path = editor_lcache_path(filename);
+    int fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    free(path);
+    *check = NULL;
+    if (fd == -1) {
+        return -1;
+    }
+    if (read(fd, head, sizeof(*head)) != sizeof(*head)
+        || memcmp(head->magic, LCACHE_MAGIC, sizeof(head->magic)) != 0) {
+        close(fd);
+        return -1;
+    }
+    size_t bytes = sizeof(size_t) * head->ncheck;
+    if (head->every == PAGER_CHECKPOINT && head->ncheck > 0 && head->lines >= 0
+        && editor_lcache_matches(head, st) && (*check = malloc(bytes)) != NULL
+        && read(fd, *check, bytes) != (ssize_t)bytes) {
+        free(*check);
+        *check = NULL;
+    }
+    close(fd);
+    return 0;
+}
+
+// put the cursor back where it was, the pager also takes the checkpoints,
+// and then needn't scan the file at all. Other buffers get the cursor
+// once the rows up to it are split while idle, so opening still only
+// splits a screen of them
+void
+editor_lcache_load()
+{
+    struct buffer *b = config.buf;
+    struct lcache_head head;
+    size_t *check;
+    if (editor_lcache_read(b->filename, &b->mapped, &head, &check) == -1) {
+        return;
+    }
+    // the last row may end without a '\n'
+    int rows = pager.on ? head.lines + (pager.map[pager.size - 1] != '\n') : 0;
+    if (pager.on && check != NULL && editor_lcache_valid(check, head.ncheck, rows, pager.size)) {
+        free(pager.check);
+        pager.check = check;
+        pager.ncheck = pager.capcheck = head.ncheck;
+        pager.lines = head.lines;
+        pager.scanned = pager.size;
+        b->numrows = rows;
+    } else {
+        free(check);
+    }
+
+    if (pager.on) {
+        editor_index_rows(head.cy + 1);
+    }
+    b->restore = 1;
+    b->restore_cx = head.cx;
+    b->restore_cy = head.cy;
+    b->restore_rowoff = head.rowoff;
+    editor_lcache_restore();
+}
+
+// move the cursor of the current buffer where the index cache had it
+// when the rows up to there are in, 1 when it moved
+int
+editor_lcache_restore()
+{
+    struct buffer *b = config.buf;
+    struct window *w = config.win;
+    int cy = b->restore_cy;
+    if (!b->restore || w->buf != b || (cy >= b->numrows && editor_rows_pending())) {
+        return 0;
+    }
+    b->restore = 0;
+    if (w->cx != 0 || w->cy != 0 || w->rowoff != 0) {
+        return 0;  // it was moved meanwhile and stays there
+    }
+    int fits = cy >= 0 && cy < b->numrows;
+    w->cy = fits ? cy : 0;
+    w->cx = fits ? b->restore_cx : 0;
+    w->rowoff = b->restore_rowoff >= 0 && b->restore_rowoff <= w->cy ? b->restore_rowoff : w->cy;
+    editor_clamp_cursor();
+    return 1;
+}
+
+// write the cache of b, with the checkpoints taken while indexing when
+// they cover the file as it is on disk, or those already in the cache
+// when it is still of that file, else with just the cursor
+void
+editor_lcache_write(struct buffer *b, int cx, int cy, int rowoff)
+{
+    struct stat st;
+    if (b->filename == NULL || stat(b->filename, &st) == -1 || st.st_size < LCACHE_MIN) {
+        return;
+    }
+    struct lcache_head head;
+    size_t *old = NULL;
+    size_t *check = NULL;
+    int lines = 0;
+    int ncheck = 0;
+    int same = b->mapped.st_ino == st.st_ino && b->mapped.st_dev == st.st_dev
+        && b->mapped.st_size == st.st_size
+        && b->mapped.st_mtim.tv_sec == st.st_mtim.tv_sec
+        && b->mapped.st_mtim.tv_nsec == st.st_mtim.tv_nsec;
+    if (same && pager.on && pager.scanned == pager.size && !pager.cut) {
+        check = pager.check;
+        ncheck = pager.ncheck;
+        lines = pager.lines;
+    } else if (same && !pager.on && b->map != NULL && b->map_off == b->map_size) {
+        check = b->check;
+        ncheck = b->ncheck;
+        lines = b->lines - (b->map[b->map_size - 1] != '\n');
+    } else if (editor_lcache_read(b->filename, &st, &head, &old) == 0 && old != NULL) {
+        check = old;
+        ncheck = head.ncheck;
+        lines = head.lines;
+    }
+
+    memcpy(head.magic, LCACHE_MAGIC, sizeof(head.magic));
+    head.size = st.st_size;
+    head.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    head.ino = st.st_ino;
+    head.dev = st.st_dev;
+    head.every = PAGER_CHECKPOINT;
+    head.lines = lines;
+    head.ncheck = ncheck;
+    head.cx = cx;
+    head.cy = cy;
+    head.rowoff = rowoff;
+
+    // written aside and renamed over, a reader never sees half of it
+    char *path = editor_lcache_path(b->filename);
+    char *tmp = path ? malloc(strlen(path) + 5) : NULL;
+    int fd = -1;
+    if (tmp != NULL) {
+        sprintf(tmp, "%s.new", path);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    }
+    if (fd != -1) {
+        struct iovec iov[2] = {{&head, sizeof(head)}, {check, sizeof(size_t) * ncheck}};
+        ssize_t want = iov[0].iov_len + iov[1].iov_len;
+        int ok = writev(fd, iov, 2) == want;
+        close(fd);
+        if (!ok || rename(tmp, path) == -1) {
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+    free(path);
+    free(old);
+}
+
+// on quit every buffer keeps where its cursor is, in the window showing
+// it when there is one
+void
+editor_lcache_save()
+{
+    for (struct buffer *b = config.buffers; b != NULL; b = b->next) {
+        if (b->ondisk) {
+            continue;  // the cursor of its file is the one of the buffer
+        }
+        struct window *w = config.windows;
+        while (w != NULL && w->buf != b) {
+            w = w->next;
+        }
+        int moved = w != NULL ? w->cx || w->cy || w->rowoff : b->cx || b->cy || b->rowoff;
+        if (b->restore && !moved) {
+            // the cursor from the cache wasn't put back yet
+            editor_lcache_write(b, b->restore_cx, b->restore_cy, b->restore_rowoff);
+        } else if (w != NULL) {
+            editor_lcache_write(b, w->cx, w->cy, w->rowoff);
+        } else {
+            editor_lcache_write(b, b->cx, b->cy, b->rowoff);
+        }
+    }
+}
+
+/*** buffers and windows ***/
+
+// an empty buffer, added at the end of the buffer list
+struct buffer *
+editor_new_buffer()
+{
+    struct buffer *b = calloc(1, sizeof(struct buffer));
+    if (b == NULL) {
+        return NULL;
+    }
+    if ((b->journal = calloc(1, sizeof(struct journal))) == NULL) {
+        free(b);
+        return NULL;
+    }
+    b->journal->brk = 1;
+    b->hl_done = INT_MAX;
+
+    struct buffer **p = &config.buffers;
+    while (*p != NULL) {
+        p = &(*p)->next;
+    }
+    *p = b;
+    return b;
+}
+
+void
+editor_free_row(erow_t *row, void *arg)
+{
+    (void)arg;
+    if (row->store == ROW_HEAP) {
+        free(row->chars);
+    } else if (row->store == ROW_SHARED) {
+        editor_shared_unref(editor_shared_of(row), 1);
+    }
+    editor_render_free(row->r);
+}
+
+// drop a buffer no window shows, one whose file couldn't be opened
+void
+editor_free_buffer(struct buffer *b)
+{
+    struct buffer **p = &config.buffers;
+    while (*p != b) {
+        p = &(*p)->next;
+    }
+    *p = b->next;
+    rope_walk(b->rows.root, editor_free_row, NULL);
+    rope_free(b->rows.root);
+    if (b->map != NULL) {
+        munmap(b->map, b->map_size);
+    }
+    free(b->check);
+    editor_journal_unref(b->journal->first);
+    arena_pop(&b->journal->arena, NULL);
+    free(b->journal);
+    if (b->slab != NULL) {
+        arena_pop(&b->slab->arena, NULL);
+        arena_pop(&b->slab->from, NULL);
+        free(b->slab);
+    }
+    free(b->filename);
+    free(b);
+}
+
+struct buffer *
+editor_find_buffer(const char *filename)
+{
+    for (struct buffer *b = config.buffers; b != NULL; b = b->next) {
+        if (b->filename != NULL && !b->ondisk && strcmp(b->filename, filename) == 0) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// the buffer holding filename, it is loaded when it isn't open yet
+struct buffer *
+editor_get_buffer(const char *filename)
+{
+    struct buffer *b = editor_find_buffer(filename);
+    if (b != NULL) {
+        return b;
+    }
+    if ((b = editor_new_buffer()) == NULL) {
+        return NULL;
+    }
+    struct buffer *cur = config.buf;
+    config.buf = b;
+    int ret = editor_open(filename);
+    if (ret != -1) {
+        editor_swap_open();
+    }
+    config.buf = cur;
+    if (ret == -1) {
+        editor_set_status_message("Can't open %s: %s", filename, strerror(errno));
+        editor_free_buffer(b);
+        return NULL;
+    }
+    return b;
+}
+
+// a window on b, its cursor starts where b was left
+struct window *
+editor_new_window(struct buffer *b)
+{
+    struct window *w = calloc(1, sizeof(struct window));
+    if (w == NULL) {
+        return NULL;
+    }
+    w->buf = b;
+    w->cx = b->cx;
+    w->cy = b->cy;
+    w->rowoff = b->rowoff;
+    return w;
+}
+
+int
+editor_count_windows()
+{
+    int n = 0;
+    for (struct window *w = config.windows; w != NULL; w = w->next) {
+        n++;
+    }
+    return n;
+}
+
+// stack the windows top to bottom, sharing the lines above the message bar
+// evenly, the last line of each window is its status bar
+void
+editor_layout()
+{
+    int n = editor_count_windows();
+    int avail = config.term_rows - 1;
+    int top = 0;
+    int i = 0;
+    for (struct window *w = config.windows; w != NULL; w = w->next, i++) {
+        int lines = avail / n + (i < avail % n);
+        w->top = top;
+        w->screen_rows = lines - 1;
+        w->screen_cols = config.term_cols;
+        top += lines;
+    }
+    editor_invalidate_screen();
+}
+
+// the cursor may point past rows deleted from another window on the buffer
+void
+editor_clamp_cursor()
+{
+    struct window *w = config.win;
+    editor_index_rows(w->cy + 1);
+    int numrows = config.buf->numrows;
+    if (w->cy >= numrows) {
+        w->cy = numrows > 0 ? numrows - 1 : 0;
+    }
+    erow_t *row = editor_row(w->cy);
+    if (row == NULL) {
+        w->cx = 0;
+    } else if (w->cx > row->size) {
+        w->cx = row->size;
+    } else if (editor_is_continuation(row, w->cx)) {
+        w->cx = editor_prev_char(row, w->cx + 1);
+    }
+}
+
+// give w the cursor
+void
+editor_enter_window(struct window *w)
+{
+    if (w->buf != config.buf) {
+        editor_search_reset();  // the matches found are rows of the old buffer
+    }
+    config.win = w;
+    config.buf = w->buf;
+    editor_clamp_cursor();
+}
+
+// rows deleted from another window on the buffer may have been the ones
+// this one shows, keep the view on rows that are still there
+void
+editor_clamp_window()
+{
+    struct window *w = config.win;
+    editor_clamp_cursor();
+    if (w->rowoff > w->cy) {
+        w->rowoff = w->cy;
+        w->vskip = 0;
+    }
+}
+
+// show b in the current window, the buffer it showed stays loaded and
+// remembers where the cursor was
+void
+editor_show_buffer(struct buffer *b)
+{
+    struct window *w = config.win;
+    if (b == w->buf) {
+        return;
+    }
+    w->buf->cx = w->cx;
+    w->buf->cy = w->cy;
+    w->buf->rowoff = w->rowoff;
+    w->buf = b;
+    w->cx = b->cx;
+    w->cy = b->cy;
+    w->rowoff = b->rowoff;
+    w->coloff = 0;
+    w->vskip = 0;
+    editor_enter_window(w);
+    editor_lcache_restore();
+
+    // rows of different buffers can have the same number and generation,
+    // so what the window shows now can't be compared against the shadow
+    for (int y = w->top; y < w->top + w->screen_rows; y++) {
+        screen.lines[y].filerow = -1;
+    }
+}
+
+// :e file
+void
+editor_edit(const char *filename)
+{
+    struct buffer *b = editor_get_buffer(filename);
+    if (b != NULL) {
+        editor_show_buffer(b);
+    }
+}
+
+// :bn and :bp
+void
+editor_next_buffer(int dir)
+{
+    struct buffer *b = config.buf;
+    if (dir > 0) {
+        b = b->next != NULL ? b->next : config.buffers;
+    } else {
+        struct buffer *prev = config.buffers;
+        while (prev->next != NULL && prev->next != b) {
+            prev = prev->next;
+        }
+        b = prev;
+    }
+    editor_show_buffer(b);
+}
+
+// :ls, the current buffer in brackets, + for unsaved changes
+void
+editor_list_buffers()
+{
+    char msg[sizeof(config.status_msg)];
+    int len = 0;
+    int i = 1;
+    msg[0] = '\0';
+    for (struct buffer *b = config.buffers; b != NULL; b = b->next, i++) {
+        int cur = b == config.buf;
+        len += snprintf(&msg[len], sizeof(msg) - len, "%s%d %s%s%s%s ",
+                        cur ? "[" : "", i, b->filename ? b->filename : "No name",
+                        b->ondisk ? " on disk" : "", b->dirty ? "+" : "", cur ? "]" : "");
+        if (len >= (int)sizeof(msg)) {
+            break;
+        }
+    }
+    editor_set_status_message("%s", msg);
+}
+
+// :sp [file], the new window goes above the current one and gets the
+// cursor, without a file both show the same buffer
+void
+editor_split(const char *filename)
+{
+    if ((config.term_rows - 1) / (editor_count_windows() + 1) < 2) {
+        editor_set_status_message("No room for another window");
+        return;
+    }
+    struct buffer *b = config.buf;
+    if (filename != NULL && (b = editor_get_buffer(filename)) == NULL) {
+        return;
+    }
+    struct window *w = editor_new_window(b);
+    if (w == NULL) {
+        return;
+    }
+    if (b == config.buf) {
+        w->cx = config.win->cx;
+        w->cy = config.win->cy;
+        w->rowoff = config.win->rowoff;
+        w->coloff = config.win->coloff;
+        w->vskip = config.win->vskip;
+    }
+
+    struct window **p = &config.windows;
+    while (*p != config.win) {
+        p = &(*p)->next;
+    }
+    w->next = config.win;
+    *p = w;
+    editor_layout();
+    editor_enter_window(w);
+}
+
+// Ctrl-w w
+void
+editor_next_window()
+{
+    struct window *w = config.win->next;
+    editor_enter_window(w != NULL ? w : config.windows);
+}
+
+// :q with more than one window, the buffer stays loaded
+void
+editor_close_window()
+{
+    struct window *w = config.win;
+    struct window **p = &config.windows;
+    while (*p != w) {
+        p = &(*p)->next;
+    }
+    *p = w->next;
+    w->buf->cx = w->cx;
+    w->buf->cy = w->cy;
+    w->buf->rowoff = w->rowoff;
+    editor_layout();
+    editor_enter_window(w->next != NULL ? w->next : config.windows);
+    free(w);
+}
+
+// a buffer with unsaved changes, the current one first
+struct buffer *
+editor_dirty_buffer()
+{
+    if (config.buf->dirty) {
+        return config.buf;
+    }
+    for (struct buffer *b = config.buffers; b != NULL; b = b->next) {
+        if (b->dirty) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/*** diff ***/
+
+// hash of the text of a row, rows hashing the same are taken to be equal
+unsigned long long
+diff_hash(const char *s, size_t len)
+{
+    unsigned long long h = 0x9e3779b97f4a7c15ULL ^ len;
+    unsigned long long w;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&w, s + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, s + i, len - i);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 29);
+}
+
+// what one Myers run works with, the hashes of both sides, a row marked
+// in ca or cb is not in the other side
+struct diff_run {
+    const unsigned long long *a;
+    const unsigned long long *b;
+    char *ca;
+    char *cb;
+    int *kvdf;  // furthest x on each diagonal, forward and backward
+    int *kvdb;
+    int limit;
+    long long budget;  // diagonals left to go through
+    int over;          // ran out of them
+    int coarse;        // then mark what is left changed instead of failing
+};
+
+// the cost limit for rows rows, about their square root
+int
+diff_limit(long long rows)
+{
+    int limit = DIFF_COST_MIN;
+    while ((long long)limit * limit < rows) {
+        limit *= 2;
+    }
+    return limit;
+}
+
+// the middle of an edit script for a[off1, lim1) and b[off2, lim2) by
+// Myers' linear space refinement, searching both ways at once until the
+// paths meet, after limit edits it settles for the furthest a path got,
+// -1 once the budget is gone
+int
+diff_split(struct diff_run *d, int off1, int lim1, int off2, int lim2, int *mx, int *my)
+{
+    const unsigned long long *a = d->a;
+    const unsigned long long *b = d->b;
+    int *kvdf = d->kvdf;
+    int *kvdb = d->kvdb;
+    int dmin = off1 - lim2;
+    int dmax = lim1 - off2;
+    int fmid = off1 - off2;
+    int bmid = lim1 - lim2;
+    int odd = (fmid - bmid) & 1;
+    int fmin = fmid, fmax = fmid;
+    int bmin = bmid, bmax = bmid;
+    kvdf[fmid] = off1;
+    kvdb[bmid] = lim1;
+
+    for (int ec = 1; ; ec++) {
+        if (fmin > dmin) {
+            kvdf[--fmin - 1] = -1;
+        } else {
+            ++fmin;
+        }
+        if (fmax < dmax) {
+            kvdf[++fmax + 1] = -1;
+        } else {
+            --fmax;
+        }
+        for (int k = fmax; k >= fmin; k -= 2) {
+            int x = kvdf[k - 1] >= kvdf[k + 1] ? kvdf[k - 1] + 1 : kvdf[k + 1];
+            int y = x - k;
+            while (x < lim1 && y < lim2 && a[x] == b[y]) {
+                x++;
+                y++;
+            }
+            kvdf[k] = x;
+            if (odd && bmin <= k && k <= bmax && kvdb[k] <= x) {
+                *mx = x;
+                *my = y;
+                return 0;
+            }
+        }
+
+        if (bmin > dmin) {
+            kvdb[--bmin - 1] = INT_MAX;
+        } else {
+            ++bmin;
+        }
+        if (bmax < dmax) {
+            kvdb[++bmax + 1] = INT_MAX;
+        } else {
+            --bmax;
+        }
+        for (int k = bmax; k >= bmin; k -= 2) {
+            int x = kvdb[k - 1] < kvdb[k + 1] ? kvdb[k - 1] : kvdb[k + 1] - 1;
+            int y = x - k;
+            while (x > off1 && y > off2 && a[x - 1] == b[y - 1]) {
+                x--;
+                y--;
+            }
+            kvdb[k] = x;
+            if (!odd && fmin <= k && k <= fmax && x <= kvdf[k]) {
+                *mx = x;
+                *my = y;
+                return 0;
+            }
+        }
+
+        d->budget -= fmax - fmin + bmax - bmin + 2;
+        if (d->budget < 0) {
+            d->over = 1;
+            return -1;
+        }
+        if (ec < d->limit) {
+            continue;
+        }
+        // too costly, split where a forward or backward path got furthest
+        long long fbest = -1;
+        int fx = off1;
+        for (int k = fmax; k >= fmin; k -= 2) {
+            int x = kvdf[k] < lim1 ? kvdf[k] : lim1;
+            int y = x - k;
+            if (y > lim2) {
+                x = lim2 + k;
+                y = lim2;
+            }
+            if ((long long)x + y > fbest) {
+                fbest = (long long)x + y;
+                fx = x;
+            }
+        }
+        long long bbest = LLONG_MAX;
+        int bx = lim1;
+        for (int k = bmax; k >= bmin; k -= 2) {
+            int x = kvdb[k] > off1 ? kvdb[k] : off1;
+            int y = x - k;
+            if (y < off2) {
+                x = off2 + k;
+                y = off2;
+            }
+            if ((long long)x + y < bbest) {
+                bbest = (long long)x + y;
+                bx = x;
+            }
+        }
+        if ((long long)lim1 + lim2 - bbest < fbest - off1 - off2) {
+            *mx = fx;
+            *my = fbest - fx;
+        } else {
+            *mx = bx;
+            *my = bbest - bx;
+        }
+        return 0;
+    }
+}
+
+// mark what isn't common to a[off1, lim1) and b[off2, lim2), -1 when the
+// run was cancelled or went over a budget it can't do without
+int
+diff_compare(struct diff_run *d, int off1, int lim1, int off2, int lim2)
+{
+    if (__atomic_load_n(&diff.cancel, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    while (off1 < lim1 && off2 < lim2 && d->a[off1] == d->b[off2]) {
+        off1++;
+        off2++;
+    }
+    while (off1 < lim1 && off2 < lim2 && d->a[lim1 - 1] == d->b[lim2 - 1]) {
+        lim1--;
+        lim2--;
+    }
+    if (off1 == lim1) {
+        memset(d->cb + off2, 1, lim2 - off2);
+        return 0;
+    }
+    if (off2 == lim2) {
+        memset(d->ca + off1, 1, lim1 - off1);
+        return 0;
+    }
+    int mx, my;
+    if (diff_split(d, off1, lim1, off2, lim2, &mx, &my) == -1) {
+        if (!d->coarse) {
+            return -1;
+        }
+        memset(d->ca + off1, 1, lim1 - off1);
+        memset(d->cb + off2, 1, lim2 - off2);
+        return 0;
+    }
+    if (diff_compare(d, off1, mx, off2, my) == -1) {
+        return -1;
+    }
+    return diff_compare(d, mx, lim1, my, lim2);
+}
+
+// whether row i, which the other side has many of, is among rows the other
+// side mostly doesn't have, in dis 0 for those, 2 for the ones it has many
+// of and 1 for the rest, the way xdiff tells
+int
+diff_among_dropped(const char *dis, int i, int n)
+{
+    int none = 0;
+    int many = 1;
+    for (int r = i - 1; r >= 0 && r >= i - DIFF_SCAN && dis[r] != 1; r--) {
+        if (dis[r] == 0) {
+            none++;
+        } else {
+            many++;
+        }
+    }
+    if (none == 0) {
+        return 0;
+    }
+    int none_after = 0;
+    int many_after = 1;
+    for (int r = i + 1; r < n && r <= i + DIFF_SCAN && dis[r] != 1; r++) {
+        if (dis[r] == 0) {
+            none_after++;
+        } else {
+            many_after++;
+        }
+    }
+    if (none_after == 0) {
+        return 0;
+    }
+    none += none_after;
+    many += many_after;
+    return many * 4 < many + none;
+}
+
+// rows whose hash the other side doesn't have can't be common, they are
+// marked right away, and so are rows it has more than about the square
+// root of its rows of when they are among such rows. The rest is copied
+// to fa and fb for Myers, with their rows in ia and ib, -1 without the
+// memory for it
+int
+diff_filter(const unsigned long long *a, int n, const unsigned long long *b, int m,
+            char *ca, char *cb, unsigned long long *fa, int *ia, int *na,
+            unsigned long long *fb, int *ib, int *nb)
+{
+    size_t size = 1024;
+    while (size < ((size_t)n + m) * 3 / 2) {
+        size *= 2;
+    }
+    unsigned long long *slot = malloc(sizeof(unsigned long long) * size);
+    int *count = calloc(size * 2, sizeof(int));  // rows of a and b, 0 and 0 for a free slot
+    char *dis = malloc((n > m ? n : m) + 1);
+    if (slot == NULL || count == NULL || dis == NULL) {
+        free(slot);
+        free(count);
+        free(dis);
+        return -1;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        const unsigned long long *h = pass ? b : a;
+        for (int i = 0; i < (pass ? m : n); i++) {
+            size_t at = h[i] & (size - 1);
+            while ((count[at * 2] || count[at * 2 + 1]) && slot[at] != h[i]) {
+                at = (at + 1) & (size - 1);
+            }
+            slot[at] = h[i];
+            count[at * 2 + pass]++;
+        }
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        const unsigned long long *h = pass ? b : a;
+        int rows = pass ? m : n;
+        int many = diff_limit(pass ? n : m);
+        char *marks = pass ? cb : ca;
+        unsigned long long *f = pass ? fb : fa;
+        int *idx = pass ? ib : ia;
+        for (int i = 0; i < rows; i++) {
+            size_t at = h[i] & (size - 1);
+            while (slot[at] != h[i]) {
+                at = (at + 1) & (size - 1);
+            }
+            int other = count[at * 2 + !pass];
+            dis[i] = other == 0 ? 0 : other > many ? 2 : 1;
+        }
+        int kept = 0;
+        for (int i = 0; i < rows; i++) {
+            if (dis[i] == 1 || (dis[i] == 2 && !diff_among_dropped(dis, i, rows))) {
+                f[kept] = h[i];
+                idx[kept++] = i;
+            } else {
+                marks[i] = 1;
+            }
+        }
+        *(pass ? nb : na) = kept;
+    }
+    free(slot);
+    free(count);
+    free(dis);
+    return 0;
+}
+
+// mark in ca and cb the rows of a and b that aren't common to both, the
+// same start and end are left out, -1 when it fails or is cancelled
+int
+diff_rows(const unsigned long long *a, int n, const unsigned long long *b, int m,
+          char *ca, char *cb)
+{
+    while (n > 0 && m > 0 && a[0] == b[0]) {
+        a++, b++, ca++, cb++;
+        n--, m--;
+    }
+    while (n > 0 && m > 0 && a[n - 1] == b[m - 1]) {
+        n--, m--;
+    }
+
+    int *kvdf = malloc(sizeof(int) * (n + m + 3));
+    int *kvdb = malloc(sizeof(int) * (n + m + 3));
+    unsigned long long *fa = NULL;
+    unsigned long long *fb = NULL;
+    int *ia = NULL;
+    int *ib = NULL;
+    char *fca = NULL;
+    char *fcb = NULL;
+    int ret = -1;
+    if (kvdf == NULL || kvdb == NULL) {
+        goto out;
+    }
+
+    // most changes touch few rows, Myers gets through those sooner than the
+    // rows can be filtered, a run costing more starts over on what is left
+    // of them, diagonals go from -m - 1 to n + 1
+    struct diff_run d = {a, b, ca, cb, kvdf + m + 1, kvdb + m + 1, diff_limit(n + m),
+                         DIFF_BUDGET, 0, 0};
+    ret = diff_compare(&d, 0, n, 0, m);
+    if (ret == 0 || !d.over) {
+        goto out;
+    }
+    memset(ca, 0, n);
+    memset(cb, 0, m);
+    ret = -1;
+
+    int fn, fm;
+    fa = malloc(sizeof(unsigned long long) * (n + 1));
+    fb = malloc(sizeof(unsigned long long) * (m + 1));
+    ia = malloc(sizeof(int) * (n + 1));
+    ib = malloc(sizeof(int) * (m + 1));
+    if (fa == NULL || fb == NULL || ia == NULL || ib == NULL
+        || diff_filter(a, n, b, m, ca, cb, fa, ia, &fn, fb, ib, &fm) == -1
+        || (fca = calloc(fn + 1, 1)) == NULL || (fcb = calloc(fm + 1, 1)) == NULL) {
+        goto out;
+    }
+    d = (struct diff_run){fa, fb, fca, fcb, kvdf + fm + 1, kvdb + fm + 1, diff_limit(fn + fm),
+                          DIFF_BUDGET_LEFT, 0, 1};
+    ret = diff_compare(&d, 0, fn, 0, fm);
+    for (int i = 0; ret == 0 && i < fn; i++) {
+        ca[ia[i]] = fca[i];
+    }
+    for (int i = 0; ret == 0 && i < fm; i++) {
+        cb[ib[i]] = fcb[i];
+    }
+out:
+    free(kvdf);
+    free(kvdb);
+    free(fa);
+    free(fb);
+    free(ia);
+    free(ib);
+    free(fca);
+    free(fcb);
+    return ret;
+}
+
+// the thread, hashes the file the first time, then compares and leaves
+// the hunks in diff.out
+void *
+editor_diff_worker(void *arg)
+{
+    struct buffer *disk = arg;
+    if (diff.hb == NULL) {
+        int cap = 1024;
+        diff.hb = malloc(sizeof(unsigned long long) * cap);
+        diff.nb = 0;
+        char *p = disk->map;
+        char *end = disk->map + disk->map_size;
+        while (diff.hb != NULL && p < end) {
+            char *nl = memchr(p, '\n', end - p);
+            size_t len = (nl != NULL ? nl : end) - p;
+            while (len > 0 && p[len - 1] == '\r') {
+                len--;
+            }
+            if (diff.nb == cap) {
+                unsigned long long *n_hb = realloc(diff.hb, sizeof(unsigned long long) * cap * 2);
+                if (n_hb == NULL) {
+                    free(diff.hb);
+                    diff.hb = NULL;
+                    break;
+                }
+                diff.hb = n_hb;
+                cap *= 2;
+            }
+            diff.hb[diff.nb++] = diff_hash(p, len);
+            p = nl != NULL ? nl + 1 : end;
+        }
+    }
+
+    int n = diff.na;
+    int m = diff.nb;
+    char *ca = calloc(n + 1, 1);
+    char *cb = calloc(m + 1, 1);
+    diff.out = NULL;
+    diff.nout = 0;
+    diff.failed = diff.hb == NULL || ca == NULL || cb == NULL
+        || diff_rows(diff.ha, n, diff.hb, m, ca, cb) == -1;
+
+    // runs of marked rows on either side, with the common rows in step
+    int cap = 0;
+    int i = 0, j = 0;
+    while (!diff.failed && (i < n || j < m)) {
+        if (i < n && j < m && !ca[i] && !cb[j]) {
+            i++;
+            j++;
+            continue;
+        }
+        struct hunk h = {i, 0, j, 0};
+        while (i < n && ca[i]) {
+            i++;
+        }
+        while (j < m && cb[j]) {
+            j++;
+        }
+        h.alen = i - h.a;
+        h.blen = j - h.b;
+        if (diff.nout == cap) {
+            cap = cap ? cap * 2 : 64;
+            struct hunk *n_out = realloc(diff.out, sizeof(struct hunk) * cap);
+            if (n_out == NULL) {
+                diff.failed = 1;
+                break;
+            }
+            diff.out = n_out;
+        }
+        diff.out[diff.nout++] = h;
+    }
+    free(ca);
+    free(cb);
+    write(diff.wake[1], "", 1);
+    return NULL;
+}
+
+void
+editor_diff_hash_row(erow_t *row, void *arg)
+{
+    unsigned long long **h = arg;
+    *(*h)++ = diff_hash(row->chars, row->size);
+}
+
+// hashes of every row of b, NULL when there is no memory for them
+unsigned long long *
+editor_diff_hash_rows(struct buffer *b)
+{
+    struct buffer *cur = config.buf;
+    config.buf = b;
+    editor_load_wait();
+    editor_index_rows(INT_MAX);
+    config.buf = cur;
+    unsigned long long *h = malloc(sizeof(unsigned long long) * (b->numrows + 1));
+    unsigned long long *at = h;
+    if (h != NULL) {
+        rope_walk(b->rows.root, editor_diff_hash_row, &at);
+    }
+    return h;
+}
+
+// the rows of the diffed buffer against those of the last run, which are
+// in the same order less the ones that went, a row of a gen handed out
+// before that run was there then
+struct diff_walk {
+    unsigned long long *h;
+    unsigned int *gen;
+    int i;
+    int j;  // into the last run's, -1 once a row wasn't where it should be
+};
+
+void
+editor_diff_rehash_row(erow_t *row, void *arg)
+{
+    struct diff_walk *w = arg;
+    unsigned int g = row->gen;
+    int known = g <= diff.ha_since || (diff.ha_load_since != 0 && g >= diff.ha_load_since);
+    if (w->j != -1 && known) {
+        while (w->j < diff.na && diff.ha_gen[w->j] != g) {
+            w->j++;
+        }
+        if (w->j == diff.na) {
+            w->j = -1;
+        }
+    }
+    if (w->j != -1 && known) {
+        w->h[w->i] = diff.ha[w->j++];
+    } else {
+        w->h[w->i] = diff_hash(row->chars, row->size);
+    }
+    w->gen[w->i++] = g;
+}
+
+// hash the rows of the diffed buffer into diff.ha, -1 without the memory
+int
+editor_diff_hash_buffer()
+{
+    struct buffer *b = diff.buf;
+    struct buffer *cur = config.buf;
+    config.buf = b;
+    editor_load_wait();
+    editor_index_rows(INT_MAX);
+    config.buf = cur;
+    struct diff_walk w = {malloc(sizeof(unsigned long long) * (b->numrows + 1)),
+                          malloc(sizeof(unsigned int) * (b->numrows + 1)), 0, diff.ha != NULL ? 0 : -1};
+    if (w.h == NULL || w.gen == NULL) {
+        free(w.h);
+        free(w.gen);
+        return -1;
+    }
+    rope_walk(b->rows.root, editor_diff_rehash_row, &w);
+    free(diff.ha);
+    free(diff.ha_gen);
+    diff.ha = w.h;
+    diff.ha_gen = w.gen;
+    diff.na = b->numrows;
+    diff.ha_since = config.gen;
+    diff.ha_load_since = config.load_gen;
+    return 0;
+}
+
+// compare the rows the buffer has now on the thread
+void
+editor_diff_start()
+{
+    if (diff.running) {
+        return;
+    }
+    diff.run_gen = config.gen;
+    diff.gen = config.gen;  // tried, whatever comes of it
+    if (editor_diff_hash_buffer() == -1) {
+        editor_set_status_message("No memory to diff %s", diff.buf->filename);
+        return;
+    }
+    // the file is hashed by the thread straight from the map, the rows of a
+    // file that isn't mapped are already in
+    if (diff.hb == NULL && diff.disk->map == NULL) {
+        diff.hb = editor_diff_hash_rows(diff.disk);
+        diff.nb = diff.disk->numrows;
+    }
+    diff.cancel = 0;
+    if (pipe2(diff.wake, O_CLOEXEC) == -1) {
+        return;
+    }
+    if (pthread_create(&diff.thread, NULL, editor_diff_worker, diff.disk) != 0) {
+        close(diff.wake[0]);
+        close(diff.wake[1]);
+        return;
+    }
+    diff.running = 1;
+}
+
+// collect the thread, returns its hunks
+void
+editor_diff_join()
+{
+    pthread_join(diff.thread, NULL);
+    close(diff.wake[0]);
+    close(diff.wake[1]);
+    diff.running = 0;
+}
+
+// the thread is done, show what it found
+void
+editor_diff_event()
+{
+    editor_diff_join();
+    if (diff.failed) {
+        free(diff.out);
+        if (!diff.cancel) {
+            editor_set_status_message("No memory to diff %s", diff.buf->filename);
+        }
+        return;
+    }
+    free(diff.hunks);
+    diff.hunks = diff.out;
+    diff.nhunks = diff.nout;
+    if (diff.announce) {
+        diff.announce = 0;
+        if (diff.nhunks == 0) {
+            editor_set_status_message("No differences from %s on disk", diff.buf->filename);
+        } else {
+            editor_set_status_message("%d hunk%s changed from %s on disk, ]c and [c go through them",
+                                      diff.nhunks, diff.nhunks == 1 ? "" : "s", diff.buf->filename);
+        }
+    }
+    editor_damage_rows(0);
+    editor_refresh_screen();
+}
+
+// stop a run going on, its result is no use any more
+void
+editor_diff_cancel()
+{
+    if (diff.running) {
+        __atomic_store_n(&diff.cancel, 1, __ATOMIC_RELAXED);
+        editor_diff_join();
+        free(diff.out);
+    }
+}
+
+// the diff is on and the buffer changed since it last ran, a run still
+// going on the rows as they were is no use and is stopped
+int
+editor_diff_pending()
+{
+    if (diff.running && diff.run_gen != config.gen) {
+        editor_diff_cancel();
+    }
+    return diff.buf != NULL && !diff.running && diff.gen != config.gen;
+}
+
+// the file as saved in a buffer of its own, NULL when it can't be read
+struct buffer *
+editor_diff_open(struct buffer *b)
+{
+    struct buffer *disk = editor_new_buffer();
+    if (disk == NULL) {
+        return NULL;
+    }
+    struct buffer *cur = config.buf;
+    config.buf = disk;
+    int ret = editor_open(b->filename);
+    if (ret != -1) {
+        editor_load_wait();
+    }
+    config.buf = cur;
+    if (ret == -1) {
+        editor_set_status_message("Can't open %s: %s", b->filename, strerror(errno));
+        editor_free_buffer(disk);
+        return NULL;
+    }
+    disk->ondisk = 1;
+    return disk;
+}
+
+// put disk in the windows showing the old file, and drop that
+void
+editor_diff_replace(struct buffer *disk)
+{
+    struct window *cur = config.win;
+    for (struct window *w = config.windows; w != NULL; w = w->next) {
+        if (w->buf == diff.disk) {
+            config.win = w;
+            config.buf = w->buf;
+            editor_show_buffer(disk);
+        }
+    }
+    config.win = cur;
+    config.buf = cur->buf;
+    if (diff.disk != NULL) {
+        editor_free_buffer(diff.disk);
+    }
+    diff.disk = disk;
+}
+
+// :diff off, the window with the file goes and the buffer stays as it is
+void
+editor_diff_off()
+{
+    editor_diff_cancel();
+    struct window *cur = config.win;
+    struct window *w = config.windows;
+    while (w != NULL) {
+        struct window *next = w->next;
+        if (w->buf == diff.disk) {
+            if (config.windows->next == NULL) {
+                // the last window, it shows the buffer again
+                editor_enter_window(w);
+                editor_show_buffer(diff.buf);
+            } else {
+                editor_enter_window(w);
+                editor_close_window();
+            }
+            if (cur == w) {
+                cur = config.win;
+            }
+        }
+        w = next;
+    }
+    editor_enter_window(cur);
+    editor_free_buffer(diff.disk);
+    free(diff.hunks);
+    free(diff.hb);
+    free(diff.ha);
+    free(diff.ha_gen);
+    diff.hunks = NULL;
+    diff.nhunks = 0;
+    diff.hb = NULL;
+    diff.ha = NULL;
+    diff.ha_gen = NULL;
+    diff.disk = NULL;
+    diff.buf = NULL;
+    editor_damage_rows(0);
+}
+
+// :diff [off], compare the buffer with its file as saved in a window above
+void
+editor_diff(const char *arg)
+{
+    if (arg != NULL && strcmp(arg, "off") != 0) {
+        editor_set_status_message("Usage: diff [off]");
+        return;
+    }
+    if (arg != NULL) {
+        if (diff.buf != NULL) {
+            editor_diff_off();
+        }
+        return;
+    }
+    // the pager's rows are made from the map as they are looked at, there
+    // is no whole buffer to hash
+    if (pager.on) {
+        editor_set_status_message("Read only");
+        return;
+    }
+    struct buffer *b = config.buf->ondisk ? diff.buf : config.buf;
+    if (b->filename == NULL) {
+        editor_set_status_message("No file to compare with");
+        return;
+    }
+    if (editor_loading()) {
+        editor_set_status_message("Still loading %s", b->filename);
+        return;
+    }
+    if (diff.buf != NULL && diff.buf != b) {
+        editor_diff_off();
+    }
+    if (diff.buf == NULL && (config.term_rows - 1) / (editor_count_windows() + 1) < 2) {
+        editor_set_status_message("No room for another window");
+        return;
+    }
+
+    // the file is read again, it may have changed since the last :diff
+    struct buffer *disk = editor_diff_open(b);
+    if (disk == NULL) {
+        return;
+    }
+    editor_diff_cancel();
+    free(diff.hb);
+    diff.hb = NULL;
+    if (diff.buf == NULL) {
+        struct window *cur = config.win;
+        editor_split(NULL);
+        editor_show_buffer(disk);
+        editor_enter_window(cur);
+        diff.disk = disk;
+        diff.buf = b;
+    } else {
+        editor_diff_replace(disk);
+    }
+    diff.announce = 1;
+    editor_diff_start();
+}
+
+// b was saved to its file, compare with what is there now
+void
+editor_diff_saved(struct buffer *b)
+{
+    if (b != diff.buf) {
+        return;
+    }
+    struct buffer *disk = editor_diff_open(b);
+    if (disk == NULL) {
+        return;
+    }
+    editor_diff_cancel();
+    free(diff.hb);
+    diff.hb = NULL;
+    editor_diff_replace(disk);
+    // the hunks are rows of the old file, until the next run there are none
+    free(diff.hunks);
+    diff.hunks = NULL;
+    diff.nhunks = 0;
+    editor_damage_rows(0);
+    diff.gen = config.gen - 1;  // run again when idle
+}
+
+// background of a row the diff found changed, 0 for none
+int
+editor_diff_color(int filerow)
+{
+    int side = config.buf == diff.buf ? 0 : config.buf == diff.disk ? 1 : -1;
+    if (side == -1 || diff.nhunks == 0) {
+        return 0;
+    }
+    // the last hunk starting at filerow or before
+    int lo = 0, hi = diff.nhunks;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if ((side ? diff.hunks[mid].b : diff.hunks[mid].a) <= filerow) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (int i = lo - 1; i >= 0; i--) {
+        struct hunk *h = &diff.hunks[i];
+        int start = side ? h->b : h->a;
+        int len = side ? h->blen : h->alen;
+        if (len > 0) {
+            if (filerow < start + len) {
+                return side ? 41 : 42;
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
+// move to the count-th hunk after or before the cursor, the other window
+// of the diff goes to the same hunk
+void
+editor_diff_jump(int dir, int count)
+{
+    int side = config.buf == diff.buf ? 0 : config.buf == diff.disk ? 1 : -1;
+    if (side == -1) {
+        editor_set_status_message("No diff, :diff compares with the file");
+        return;
+    }
+    int y = config.win->cy;
+    int found = -1;
+    for (int n = editor_count(count); n > 0; n--) {
+        int i = found != -1 ? found + dir : dir > 0 ? 0 : diff.nhunks - 1;
+        if (found == -1 && dir > 0) {
+            while (i < diff.nhunks && (side ? diff.hunks[i].b : diff.hunks[i].a) <= y) {
+                i++;
+            }
+        } else if (found == -1) {
+            while (i >= 0 && (side ? diff.hunks[i].b : diff.hunks[i].a) >= y) {
+                i--;
+            }
+        }
+        if (i < 0 || i >= diff.nhunks) {
+            break;
+        }
+        found = i;
+    }
+    if (found == -1) {
+        editor_set_status_message(dir > 0 ? "No hunk below" : "No hunk above");
+        return;
+    }
+
+    // both windows show the hunk a third down
+    struct hunk *h = &diff.hunks[found];
+    struct window *cur = config.win;
+    for (struct window *w = config.windows; w != NULL; w = w->next) {
+        if (w != cur && w->buf != diff.buf && w->buf != diff.disk) {
+            continue;
+        }
+        if (w != cur && w->buf == cur->buf) {
+            continue;
+        }
+        int row = w->buf == diff.buf ? h->a : h->b;
+        row = row < w->buf->numrows ? row : (w->buf->numrows > 0 ? w->buf->numrows - 1 : 0);
+        w->cy = row;
+        w->cx = 0;
+        w->rowoff = row > w->screen_rows / 3 ? row - w->screen_rows / 3 : 0;
+        w->vskip = 0;
+    }
+    editor_set_status_message("Hunk %d of %d, -%d +%d rows", found + 1, diff.nhunks, h->blen, h->alen);
+}
+
+// ]c
+void
+editor_cmd_next_hunk(int count)
+{
+    editor_diff_jump(1, count);
+}
+
+// [c
+void
+editor_cmd_prev_hunk(int count)
+{
+    editor_diff_jump(-1, count);
+}
+
+/*** swap file ***/
+
+// every change made to a buffer is appended to .name.swp next to its file
+// by a thread of its own, which syncs in batches, a crash leaves behind the
+// changes made since the last save and the next start makes them again
+#define SWAP_MAGIC "candysw2"
+
+// file the changes apply to, so a swap that no longer fits it is left alone
+struct swap_head {
+    char magic[8];
+    long long pid;
+    long long size;
+    long long mtime;  // in ns, a rewrite within the same second counts
+    long long dropped;  // rows at the top :follow let go of before the changes
+};
+
+// one change, as passed to editor_journal, followed by its text
+struct swap_rec {
+    int type;
+    int row;
+    int col;
+    unsigned int len;
+};
+
+struct swap {
+    int fd;
+    char *path;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  // there is something to write
+    pthread_cond_t done;  // the writer finished a batch
+    struct abuf pending;  // records written by nobody yet
+    long long logged;     // bytes handed over so far, the header included
+    int busy;             // the writer is writing a batch
+    long long dropped;    // rows :follow let go of since the file was saved
+};
+
+char *
+editor_swap_path(const char *filename)
+{
+    const char *slash = strrchr(filename, '/');
+    int dirlen = slash ? slash - filename + 1 : 0;
+    char *path = malloc(strlen(filename) + 6);
+    if (path != NULL) {
+        sprintf(path, "%.*s.%s.swp", dirlen, filename, filename + dirlen);
+    }
+    return path;
+}
+
+void *
+editor_swap_writer(void *arg)
+{
+    struct swap *sw = arg;
+    struct abuf out = ABUF_INIT;
+    pthread_mutex_lock(&sw->lock);
+    while (1) {
+        while (sw->pending.len == 0) {
+            pthread_cond_wait(&sw->wake, &sw->lock);
+        }
+        // take the batch, the editor goes on appending to the other buffer
+        struct abuf t = out;
+        out = sw->pending;
+        sw->pending = t;
+        sw->pending.len = 0;
+        sw->busy = 1;
+        pthread_mutex_unlock(&sw->lock);
+
+        for (int done = 0; done < out.len; ) {
+            ssize_t n = write(sw->fd, out.b + done, out.len - done);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        fdatasync(sw->fd);
+        out.len = 0;
+
+        pthread_mutex_lock(&sw->lock);
+        sw->busy = 0;
+        pthread_cond_broadcast(&sw->done);
+        pthread_mutex_unlock(&sw->lock);
+
+        // let changes pile up, one sync per keystroke would be a lot
+        struct timespec ts = {0, SWAP_DELAY_MS * 1000000L};
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&sw->lock);
+    }
+    return NULL;
+}
+
+// hand a change to the writer, called for every change including those
+// of undo and redo
+void
+editor_swap_log(int type, int row, int col, const char *s, size_t len)
+{
+    struct swap *sw = config.buf->swap;
+    if (sw == NULL) {
+        return;
+    }
+    struct swap_rec rec = {type, row, col, len};
+    pthread_mutex_lock(&sw->lock);
+    ab_append(&sw->pending, (char *)&rec, sizeof(rec));
+    ab_append(&sw->pending, s, len);
+    sw->logged += sizeof(rec) + len;
+    pthread_cond_signal(&sw->wake);
+    pthread_mutex_unlock(&sw->lock);
+}
+
+// log the put of the lines of block at row, joined by newlines like the
+// text of any other JOP_INS_ROWS
+void
+editor_swap_log_rows(int row, struct shared *block)
+{
+    struct swap *sw = config.buf->swap;
+    if (sw == NULL) {
+        return;
+    }
+    struct shared_line *l = editor_shared_first(block);
+    size_t len = block->nrows - 1;
+    for (int i = 0; i < block->nrows; i++, l = editor_shared_next(l)) {
+        len += l->len;
+    }
+    struct swap_rec rec = {JOP_INS_ROWS, row, block->nrows, len};
+    pthread_mutex_lock(&sw->lock);
+    ab_append(&sw->pending, (char *)&rec, sizeof(rec));
+    l = editor_shared_first(block);
+    for (int i = 0; i < block->nrows; i++, l = editor_shared_next(l)) {
+        ab_append(&sw->pending, "\n", i > 0);
+        ab_append(&sw->pending, l->text, l->len);
+    }
+    sw->logged += sizeof(rec) + len;
+    pthread_cond_signal(&sw->wake);
+    pthread_mutex_unlock(&sw->lock);
+}
+
+// start the swap over for the file as it is on disk now, keeping what was
+// logged after offset keep, returns with the lock held
+void
+editor_swap_restart(struct swap *sw, const char *filename, long long keep)
+{
+    pthread_mutex_lock(&sw->lock);
+    while (sw->busy) {
+        pthread_cond_wait(&sw->done, &sw->lock);
+    }
+    // what the writer hasn't got to yet comes after what is on disk
+    long long ondisk = sw->logged - sw->pending.len;
+    char *tail = NULL;
+    size_t tlen = 0;
+    if (keep < sw->logged && (tail = malloc(sw->logged - keep)) != NULL) {
+        tlen = sw->logged - keep;
+        size_t from_disk = keep < ondisk ? ondisk - keep : 0;
+        if (from_disk > 0 && pread(sw->fd, tail, from_disk, keep) != (ssize_t)from_disk) {
+            from_disk = 0;
+            tlen = 0;
+        }
+        if (tlen > 0) {
+            size_t skip = keep > ondisk ? keep - ondisk : 0;
+            memcpy(tail + from_disk, sw->pending.b + skip, sw->pending.len - skip);
+        }
+    }
+
+    struct stat st;
+    struct swap_head head = {SWAP_MAGIC, getpid(), -1, 0, sw->dropped};
+    if (stat(filename, &st) == 0) {
+        head.size = st.st_size;
+        head.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    }
+    ftruncate(sw->fd, 0);
+    sw->pending.len = 0;
+    ab_append(&sw->pending, (char *)&head, sizeof(head));
+    ab_append(&sw->pending, tail, tlen);
+    sw->logged = sw->pending.len;
+    pthread_cond_signal(&sw->wake);
+    free(tail);
+}
+
+// the buffer was saved to its file, changes made up to offset keep are in
+// it and don't need replaying any more
+void
+editor_swap_saved(struct buffer *b, long long keep)
+{
+    if (b->swap != NULL) {
+        b->swap->dropped = 0;  // the file is what the buffer has now
+        editor_swap_restart(b->swap, b->filename, keep);
+        pthread_mutex_unlock(&b->swap->lock);
+    }
+}
+
+long long
+editor_swap_logged(struct buffer *b)
+{
+    if (b->swap == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&b->swap->lock);
+    long long logged = b->swap->logged;
+    pthread_mutex_unlock(&b->swap->lock);
+    return logged;
+}
+
+// whether a change read from a swap file fits the buffer
+int
+editor_swap_fits(struct swap_rec *rec)
+{
+    editor_index_rows(rec->row + (rec->type == JOP_DEL_ROWS ? rec->col : 1));
+    int numrows = config.buf->numrows;
+    if (rec->type == JOP_INS_ROW || rec->type == JOP_INS_ROWS) {
+        return rec->row >= 0 && rec->row <= numrows;
+    }
+    if (rec->type == JOP_DEL_ROWS) {
+        return rec->row >= 0 && rec->col > 0 && rec->col <= numrows - rec->row;
+    }
+    if (rec->row < 0 || rec->row >= numrows) {
+        return 0;
+    }
+    erow_t *row = editor_row(rec->row);
+    if (rec->type == JOP_INS_TEXT) {
+        return rec->col >= 0 && rec->col <= row->size;
+    }
+    if (rec->type == JOP_DEL_TEXT) {
+        return rec->col >= 0 && (size_t)rec->col + rec->len <= (size_t)row->size;
+    }
+    return rec->type == JOP_DEL_ROW;
+}
+
+// make the changes of a swap file left behind once more, they are undone
+// together, returns how many there were
+int
+editor_swap_replay(const char *p, size_t len, long long dropped)
+{
+    int n = 0;
+    int last = 0;
+    editor_journal_break();
+    editor_index_rows(dropped + 1);
+    if (dropped > 0 && dropped <= config.buf->numrows) {
+        editor_del_rows(0, dropped);
+    }
+    struct swap_rec rec;
+    while (len >= sizeof(rec)) {
+        memcpy(&rec, p, sizeof(rec));
+        // the last one may have been cut short by the crash
+        if (len - sizeof(rec) < rec.len || !editor_swap_fits(&rec)) {
+            break;
+        }
+        char *text = (char *)p + sizeof(rec);
+        switch (rec.type) {
+            case JOP_INS_ROW:
+                editor_insert_row(rec.row, text, rec.len);
+                break;
+            case JOP_DEL_ROW:
+                editor_del_row(rec.row);
+                break;
+            case JOP_INS_TEXT:
+                editor_row_insert_string(rec.row, rec.col, text, rec.len);
+                break;
+            case JOP_DEL_TEXT:
+                editor_row_del_string(rec.row, rec.col, rec.len);
+                break;
+            case JOP_INS_ROWS:
+                editor_insert_text_rows(rec.row, text, rec.len);
+                break;
+            case JOP_DEL_ROWS:
+                editor_del_rows(rec.row, rec.col);
+                break;
+        }
+        last = rec.row;
+        p += sizeof(rec) + rec.len;
+        len -= sizeof(rec) + rec.len;
+        n++;
+    }
+    editor_journal_break();
+
+    // the cursor goes where the last change was
+    config.buf->cy = last < config.buf->numrows ? last : 0;
+    if (config.win->buf == config.buf) {
+        config.win->cy = config.buf->cy;
+    }
+    return n;
+}
+
+// start the swap file of the freshly loaded current buffer, after making
+// the changes of one a crash left behind
+void
+editor_swap_open()
+{
+    struct buffer *b = config.buf;
+    struct stat st;
+    if (b->filename == NULL || pager.on || stat(b->filename, &st) == -1) {
+        return;
+    }
+    char *path = editor_swap_path(b->filename);
+    int fd = path ? open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600) : -1;
+    if (fd == -1) {
+        free(path);
+        return;
+    }
+
+    // read what the last session left, the changes are only replayed onto
+    // the file they were made to
+    char *old = NULL;
+    size_t oldlen = 0;
+    struct swap_head head;
+    struct stat sst;
+    if (pread(fd, &head, sizeof(head), 0) == sizeof(head)
+        && memcmp(head.magic, SWAP_MAGIC, sizeof(head.magic)) == 0 && fstat(fd, &sst) == 0) {
+        if (head.pid != getpid() && (kill(head.pid, 0) == 0 || errno == EPERM)) {
+            editor_set_status_message("%s is being edited by process %lld", b->filename, head.pid);
+            close(fd);
+            free(path);
+            return;
+        }
+        if (head.size != st.st_size
+            || head.mtime != st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec) {
+            editor_set_status_message("Ignoring %s, %s changed since", path, b->filename);
+        } else if (sst.st_size > (off_t)sizeof(head)
+                   && (old = malloc(sst.st_size - sizeof(head))) != NULL) {
+            oldlen = pread(fd, old, sst.st_size - sizeof(head), sizeof(head));
+            oldlen = oldlen == (size_t)-1 ? 0 : oldlen;
+        }
+    }
+
+    struct swap *sw = calloc(1, sizeof(struct swap));
+    if (sw == NULL) {
+        free(old);
+        close(fd);
+        free(path);
+        return;
+    }
+    sw->fd = fd;
+    sw->path = path;
+    pthread_mutex_init(&sw->lock, NULL);
+    pthread_cond_init(&sw->wake, NULL);
+    pthread_cond_init(&sw->done, NULL);
+    editor_swap_restart(sw, b->filename, 0);
+    pthread_mutex_unlock(&sw->lock);
+    if (pthread_create(&sw->thread, NULL, editor_swap_writer, sw) != 0) {
+        close(fd);
+        unlink(path);
+        free(path);
+        free(sw);
+        free(old);
+        return;
+    }
+    b->swap = sw;
+
+    if (oldlen > 0) {
+        editor_load_wait();  // the changes were made against the whole file
+        int n = editor_swap_replay(old, oldlen, head.dropped);
+        editor_set_status_message("Recovered %d changes from %s, u takes them back", n, path);
+    }
+    free(old);
+}
+
+// leaving for good, what is in the buffers either got saved or is thrown
+// away on purpose
+void
+editor_swap_remove()
+{
+    for (struct buffer *b = config.buffers; b != NULL; b = b->next) {
+        if (b->swap != NULL) {
+            unlink(b->swap->path);
+        }
+    }
+}
+
+/*** follow ***/
+
+// something to wait on that becomes readable whenever fd is written to
+int
+editor_follow_watch(int fd, const char *filename)
+{
+#if defined(FOLLOW_INOTIFY)
+    (void)fd;
+    int wfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (wfd != -1 && inotify_add_watch(wfd, filename, IN_MODIFY) == -1) {
+        close(wfd);
+        return -1;
+    }
+    return wfd;
+#elif defined(FOLLOW_KQUEUE)
+    (void)filename;
+    int wfd = kqueue();
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE | NOTE_EXTEND, 0, NULL);
+    if (wfd != -1 && kevent(wfd, &ev, 1, NULL, 0, NULL) == -1) {
+        close(wfd);
+        return -1;
+    }
+    return wfd;
+#else
+    (void)fd;
+    (void)filename;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void
+editor_follow_stop()
+{
+    close(follow.fd);
+    close(follow.wfd);
+    follow.fd = -1;
+    follow.wfd = -1;
+    follow.buf = NULL;
+}
+
+// append what was written to the followed file since the last look, only
+// the new bytes are read and split
+void
+editor_follow_read()
+{
+    struct stat st;
+    if (fstat(follow.fd, &st) == -1 || st.st_size == follow.off) {
+        return;
+    }
+    if (st.st_size < follow.off) {
+        editor_set_status_message("%s was truncated, stopped following", follow.buf->filename);
+        editor_follow_stop();
+        editor_refresh_screen();
+        return;
+    }
+
+    struct buffer *cur = config.buf;
+    config.buf = follow.buf;
+    editor_index_rows(INT_MAX);  // new rows go after everything in the map
+    int old = config.buf->numrows;
+    int dirty = config.buf->dirty;
+    struct journal *j = config.buf->journal;
+    j->replay = 1;  // what the file got isn't an edit
+    struct swap *sw = config.buf->swap;
+    config.buf->swap = NULL;
+
+    // an unfinished last row is taken back and split again with the bytes
+    // that continue it
+    char *buf = NULL;
+    size_t cap = 0;
+    size_t len = 0;
+    if (follow.partial && old > 0) {
+        erow_t *row = editor_row(old - 1);
+        cap = row->size + FOLLOW_CHUNK;
+        if ((buf = malloc(cap)) != NULL) {
+            memcpy(buf, row->chars, row->size);
+            len = row->size;
+            editor_del_row(old - 1);
+        }
+    }
+    while (follow.off < st.st_size) {
+        size_t want = st.st_size - follow.off;
+        want = want < FOLLOW_CHUNK ? want : FOLLOW_CHUNK;
+        if (len + want > cap) {
+            char *n_buf = realloc(buf, len + want);
+            if (n_buf == NULL) {
+                break;
+            }
+            buf = n_buf;
+            cap = len + want;
+        }
+        ssize_t n = pread(follow.fd, buf + len, want, follow.off);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        follow.off += n;
+        len += n;
+
+        size_t done = editor_split_rows(buf, len, INT_MAX, 0);
+        memmove(buf, buf + done, len - done);
+        len -= done;
+    }
+    follow.partial = len > 0;
+    if (len > 0) {
+        while (len > 0 && buf[len - 1] == '\r') {
+            len--;
+        }
+        editor_insert_row(config.buf->numrows, buf, len);
+    }
+    free(buf);
+
+    // keep at most limit rows, the journal refers to rows by number and
+    // can't be replayed once the ones at the top are gone, so unsaved
+    // changes keep them all
+    int dropped = 0;
+    if (follow.limit > 0 && config.buf->numrows > follow.limit && dirty) {
+        editor_set_status_message("%s has unsaved changes, keeping all %d rows",
+                                  config.buf->filename, config.buf->numrows);
+    } else if (follow.limit > 0 && config.buf->numrows > follow.limit) {
+        dropped = config.buf->numrows - follow.limit;
+        editor_del_rows(0, dropped);
+        editor_journal_unref(j->first);
+        arena_pop(&j->arena, NULL);
+        j->first = NULL;
+        j->last = NULL;
+        j->cur = NULL;
+    }
+    j->replay = 0;
+    config.buf->dirty = dirty;
+    // the swap goes with the file as it is now, the edits logged stay good
+    // while the rows only got appended after them, those made from now on
+    // are to rows counted after the dropped ones
+    config.buf->swap = sw;
+    if (sw != NULL) {
+        sw->dropped += dropped;
+        editor_swap_restart(sw, config.buf->filename,
+                            dropped ? LLONG_MAX : (long long)sizeof(struct swap_head));
+        pthread_mutex_unlock(&sw->lock);
+    }
+
+    // a cursor on the last row stays at the end, the others keep their row
+    for (struct window *w = config.windows; w != NULL; w = w->next) {
+        if (w->buf != config.buf) {
+            continue;
+        }
+        if (w->cy >= old - 1) {
+            w->cy = config.buf->numrows - 1;
+            w->cx = 0;
+        } else {
+            w->cy = w->cy > dropped ? w->cy - dropped : 0;
+        }
+        w->rowoff = w->rowoff > dropped ? w->rowoff - dropped : 0;
+    }
+    config.buf = cur;
+    editor_clamp_cursor();
+    editor_refresh_screen();
+}
+
+void
+editor_follow_copy_row(erow_t *row, void *arg)
+{
+    int *failed = arg;
+    if (row->store != ROW_MAPPED || *failed) {
+        return;
+    }
+    if (editor_slab_copy(row, row->chars, row->size) == -1) {
+        *failed = 1;
+    }
+}
+
+// a followed file goes on being written to and is likely to be truncated
+// when it is rotated, which would fault on the rows still in the map, so
+// the buffer takes a copy of them and lets go of it, -1 when out of memory
+int
+editor_follow_unmap()
+{
+    struct buffer *b = config.buf;
+    if (b->map == NULL) {
+        return 0;
+    }
+    editor_index_rows(INT_MAX);
+    int failed = 0;
+    rope_walk(b->rows.root, editor_follow_copy_row, &failed);
+    if (failed) {
+        return -1;
+    }
+    munmap(b->map, b->map_size);
+    b->map = NULL;
+    b->map_size = 0;
+    b->map_off = 0;
+    return 0;
+}
+
+// the watch fired, forget the events themselves and look at the file
+void
+editor_follow_event()
+{
+#if defined(FOLLOW_KQUEUE)
+    struct kevent ev[8];
+    struct timespec zero = {0, 0};
+    while (kevent(follow.wfd, NULL, 0, ev, 8, &zero) > 0) {
+        ;
+    }
+#else
+    char buf[4096];
+    while (read(follow.wfd, buf, sizeof(buf)) > 0) {
+        ;
+    }
+#endif
+    editor_follow_read();
+}
+
+// :follow [rows] watches the file of the current buffer, keeping at most
+// rows rows when given, :follow off stops
+void
+editor_follow(const char *arg)
+{
+    if (arg != NULL && strcmp(arg, "off") == 0) {
+        if (follow.buf != NULL) {
+            editor_follow_stop();
+        }
+        editor_set_status_message("Stopped following");
+        return;
+    }
+    int limit = 0;
+    if (arg != NULL && (limit = atoi(arg)) <= 0) {
+        editor_set_status_message("Usage: follow [rows|off]");
+        return;
+    }
+    char *filename = config.buf->filename;
+    if (filename == NULL) {
+        editor_set_status_message("No file to follow");
+        return;
+    }
+    if (config.buf->codec != NULL) {
+        editor_set_status_message("Can't follow a compressed file");
+        return;
+    }
+    if (follow.buf != NULL) {
+        editor_follow_stop();
+    }
+
+    struct stat st;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        editor_set_status_message("Can't follow %s", filename);
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    int wfd = editor_follow_watch(fd, filename);
+    if (wfd == -1) {
+        editor_set_status_message("Can't watch %s: %s", filename, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    follow.buf = config.buf;
+    follow.fd = fd;
+    follow.wfd = wfd;
+    follow.limit = limit;
+    // the mapped file ends where the map does, whatever came after it is new
+    follow.off = config.buf->map != NULL ? (off_t)config.buf->map_size : st.st_size;
+    char last = '\n';
+    if (follow.off > 0) {
+        pread(fd, &last, 1, follow.off - 1);
+    }
+    follow.partial = last != '\n';
+    editor_set_status_message("Following %s", filename);
+    editor_follow_read();
+    if (follow.buf == config.buf && editor_follow_unmap() == -1) {
+        editor_set_status_message("Out of memory, stopped following");
+        editor_follow_stop();
+    }
+}
+
+/*** regex ***/
+
+// patterns are compiled into a small Thompson NFA program which is run as
+// a DFA built lazily, one state per new set of NFA states, so matching is
+// linear in the text for any pattern and never backtracks. The states are
+// kept between calls and dropped all at once when there are too many
+
+enum Rxop { RX_SET, RX_SPLIT, RX_JMP, RX_BEGIN, RX_END, RX_MATCH };
+
+struct rx_inst {
+    int op;
+    int x;    // next instruction
+    int y;    // other branch of RX_SPLIT
+    int set;  // bytes RX_SET accepts
+};
+
+enum Rxnode {
+    RXN_SET, RXN_CAT, RXN_ALT, RXN_STAR, RXN_PLUS, RXN_QUEST,
+    RXN_BEGIN, RXN_END, RXN_EMPTY
+};
+
+struct rx_node {
+    int type;
+    int a;  // operand, or the set of RXN_SET
+    int b;
+};
+
+struct rx_state {
+    struct rx_state *chain;  // next state in the same hash bucket
+    struct rx_state **next;  // successor per byte class, NULL until needed
+    int match;      // a match ends before the next byte
+    int match_end;  // a match ends here if the text does too
+    int n;
+    int insts[];
+};
+
+// the program for one direction of the pattern, run as a DFA
+struct rx_dfa {
+    struct rx_inst *prog;
+    int nprog;
+    int unanchored;          // matches may start at any byte, not just the first
+    struct rx_state *begin;  // start state at the edge of the text
+    struct rx_state *mid;    // start state anywhere else
+    struct rx_state *table[RX_HASH];
+    int nstates;
+    arena_t arena;
+    int *sparse;  // sparse set of instructions being collected
+    int *dense;
+    int ndense;
+    int *stack;
+    int *tmp;
+};
+
+typedef struct rx {
+    char *src;
+    int literal;  // no special characters, matched with memmem
+    size_t len;
+    unsigned char (*sets)[32];
+    int nsets;
+    unsigned char cls[256];  // byte class, the program never tells apart bytes of one class
+    unsigned char rep[256];  // a byte of every class
+    int ncls;
+    struct rx_dfa fwd;  // anchored, finds where a match ends
+    struct rx_dfa rev;  // reversed and unanchored, finds where matches start
+    unsigned char *mark;
+    int markcap;
+} rx_t;
+
+struct rx_parser {
+    const char *p;
+    rx_t *rx;
+    struct rx_node *nodes;
+    int nnodes;
+    int cap;
+    int err;
+};
+
+int rx_parse_alt(struct rx_parser *ps);
+
+int
+rx_node(struct rx_parser *ps, int type, int a, int b)
+{
+    if (ps->nnodes == ps->cap) {
+        int n_cap = ps->cap ? ps->cap * 2 : 32;
+        struct rx_node *n_nodes = realloc(ps->nodes, n_cap * sizeof(*n_nodes));
+        if (n_nodes == NULL) {
+            ps->err = 1;
+            return 0;
+        }
+        ps->nodes = n_nodes;
+        ps->cap = n_cap;
+    }
+    ps->nodes[ps->nnodes].type = type;
+    ps->nodes[ps->nnodes].a = a;
+    ps->nodes[ps->nnodes].b = b;
+    return ps->nnodes++;
+}
+
+unsigned char *
+rx_new_set(struct rx_parser *ps, int *idx)
+{
+    rx_t *rx = ps->rx;
+    unsigned char (*n_sets)[32] = realloc(rx->sets, (rx->nsets + 1) * sizeof(*n_sets));
+    if (n_sets == NULL) {
+        ps->err = 1;
+        return NULL;
+    }
+    rx->sets = n_sets;
+    memset(rx->sets[rx->nsets], 0, 32);
+    *idx = rx->nsets++;
+    return rx->sets[*idx];
+}
+
+void
+rx_set_range(unsigned char *set, int lo, int hi)
+{
+    for (int c = lo; c <= hi; c++) {
+        set[c >> 3] |= 1 << (c & 7);
+    }
+}
+
+int
+rx_hex(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// the escape after a backslash, either a class added to set, returning -1,
+// or a single byte which is returned, -2 when it is malformed
+int
+rx_escape(struct rx_parser *ps, unsigned char *set)
+{
+    unsigned char tmp[32] = {0};
+    char c = *ps->p++;
+    int neg = 0;
+    switch (c) {
+        case '\0':
+            ps->p--;
+            return -2;
+        case 'n':
+            return '\n';
+        case 't':
+            return '\t';
+        case 'x': {
+            int hi = rx_hex(ps->p[0]);
+            int lo = hi == -1 ? -1 : rx_hex(ps->p[1]);
+            if (lo == -1) {
+                return -2;
+            }
+            ps->p += 2;
+            return hi << 4 | lo;
+        }
+        case 'D':
+            neg = 1;
+            // fallthrough
+        case 'd':
+            rx_set_range(tmp, '0', '9');
+            break;
+        case 'W':
+            neg = 1;
+            // fallthrough
+        case 'w':
+            rx_set_range(tmp, '0', '9');
+            rx_set_range(tmp, 'A', 'Z');
+            rx_set_range(tmp, 'a', 'z');
+            rx_set_range(tmp, '_', '_');
+            break;
+        case 'S':
+            neg = 1;
+            // fallthrough
+        case 's':
+            rx_set_range(tmp, '\t', '\r');
+            rx_set_range(tmp, ' ', ' ');
+            break;
+        default:
+            return (unsigned char)c;
+    }
+    for (int i = 0; i < 32; i++) {
+        set[i] |= neg ? ~tmp[i] : tmp[i];
+    }
+    return -1;
+}
+
+// [...] after the opening bracket
+int
+rx_parse_class(struct rx_parser *ps)
+{
+    int idx;
+    unsigned char *set = rx_new_set(ps, &idx);
+    if (set == NULL) {
+        return 0;
+    }
+    int neg = *ps->p == '^';
+    ps->p += neg;
+    int first = 1;
+    while (*ps->p != ']' || first) {
+        first = 0;
+        if (*ps->p == '\0') {
+            ps->err = 1;
+            return 0;
+        }
+        int lo = (unsigned char)*ps->p++;
+        if (lo == '\\' && (lo = rx_escape(ps, set)) < 0) {
+            if (lo == -2) {
+                ps->err = 1;
+                return 0;
+            }
+            continue;
+        }
+        int hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] != ']' && ps->p[1] != '\0') {
+            ps->p++;
+            hi = (unsigned char)*ps->p++;
+            if (hi == '\\' && (hi = rx_escape(ps, set)) < 0) {
+                ps->err = 1;
+                return 0;
+            }
+            if (hi < lo) {
+                ps->err = 1;
+                return 0;
+            }
+        }
+        rx_set_range(set, lo, hi);
+    }
+    ps->p++;
+    if (neg) {
+        for (int i = 0; i < 32; i++) {
+            set[i] = ~set[i];
+        }
+    }
+    return rx_node(ps, RXN_SET, idx, 0);
+}
+
+int
+rx_parse_atom(struct rx_parser *ps)
+{
+    int idx;
+    unsigned char *set;
+    char c = *ps->p++;
+    switch (c) {
+        case '(': {
+            int n = rx_parse_alt(ps);
+            if (*ps->p != ')') {
+                ps->err = 1;
+                return 0;
+            }
+            ps->p++;
+            return n;
+        }
+        case '[':
+            return rx_parse_class(ps);
+        case '^':
+            return rx_node(ps, RXN_BEGIN, 0, 0);
+        case '$':
+            return rx_node(ps, RXN_END, 0, 0);
+        case '.':
+            if ((set = rx_new_set(ps, &idx)) == NULL) {
+                return 0;
+            }
+            rx_set_range(set, 0, 255);
+            return rx_node(ps, RXN_SET, idx, 0);
+        case '*':
+        case '+':
+        case '?':
+            ps->err = 1;  // nothing to repeat
+            return 0;
+        default:
+            if ((set = rx_new_set(ps, &idx)) == NULL) {
+                return 0;
+            }
+            int b = (unsigned char)c;
+            if (c == '\\' && (b = rx_escape(ps, set)) == -2) {
+                ps->err = 1;
+                return 0;
+            }
+            if (b >= 0) {
+                rx_set_range(set, b, b);
+            }
+            return rx_node(ps, RXN_SET, idx, 0);
+    }
+}
+
+int
+rx_parse_rep(struct rx_parser *ps)
+{
+    int n = rx_parse_atom(ps);
+    while (!ps->err && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')) {
+        char c = *ps->p++;
+        n = rx_node(ps, c == '*' ? RXN_STAR : c == '+' ? RXN_PLUS : RXN_QUEST, n, 0);
+    }
+    return n;
+}
+
+int
+rx_parse_cat(struct rx_parser *ps)
+{
+    int n = -1;
+    while (!ps->err && *ps->p != '\0' && *ps->p != '|' && *ps->p != ')') {
+        int m = rx_parse_rep(ps);
+        n = n == -1 ? m : rx_node(ps, RXN_CAT, n, m);
+    }
+    return n == -1 ? rx_node(ps, RXN_EMPTY, 0, 0) : n;
+}
+
+int
+rx_parse_alt(struct rx_parser *ps)
+{
+    int n = rx_parse_cat(ps);
+    while (!ps->err && *ps->p == '|') {
+        ps->p++;
+        n = rx_node(ps, RXN_ALT, n, rx_parse_cat(ps));
+    }
+    return n;
+}
+
+// lay out node n, mirrored when rev is set so the program reads the text
+// backwards
+void
+rx_emit(struct rx_parser *ps, int n, int rev, struct rx_inst *prog, int *pc)
+{
+    struct rx_node *nd = &ps->nodes[n];
+    int l1;
+    int l2;
+    switch (nd->type) {
+        case RXN_SET:
+            prog[*pc] = (struct rx_inst){RX_SET, *pc + 1, 0, nd->a};
+            (*pc)++;
+            break;
+        case RXN_CAT:
+            rx_emit(ps, rev ? nd->b : nd->a, rev, prog, pc);
+            rx_emit(ps, rev ? nd->a : nd->b, rev, prog, pc);
+            break;
+        case RXN_ALT:
+            l1 = (*pc)++;
+            prog[l1] = (struct rx_inst){RX_SPLIT, *pc, 0, 0};
+            rx_emit(ps, nd->a, rev, prog, pc);
+            l2 = (*pc)++;
+            prog[l1].y = *pc;
+            rx_emit(ps, nd->b, rev, prog, pc);
+            prog[l2] = (struct rx_inst){RX_JMP, *pc, 0, 0};
+            break;
+        case RXN_STAR:
+            l1 = (*pc)++;
+            rx_emit(ps, nd->a, rev, prog, pc);
+            prog[*pc] = (struct rx_inst){RX_JMP, l1, 0, 0};
+            (*pc)++;
+            prog[l1] = (struct rx_inst){RX_SPLIT, l1 + 1, *pc, 0};
+            break;
+        case RXN_PLUS:
+            l1 = *pc;
+            rx_emit(ps, nd->a, rev, prog, pc);
+            prog[*pc] = (struct rx_inst){RX_SPLIT, l1, *pc + 1, 0};
+            (*pc)++;
+            break;
+        case RXN_QUEST:
+            l1 = (*pc)++;
+            rx_emit(ps, nd->a, rev, prog, pc);
+            prog[l1] = (struct rx_inst){RX_SPLIT, l1 + 1, *pc, 0};
+            break;
+        case RXN_BEGIN:
+        case RXN_END:
+            prog[*pc] = (struct rx_inst){(nd->type == RXN_BEGIN) != rev ? RX_BEGIN : RX_END,
+                                         *pc + 1, 0, 0};
+            (*pc)++;
+            break;
+    }
+}
+
+int
+rx_dfa_init(struct rx_dfa *d, struct rx_parser *ps, int root, int rev)
+{
+    memset(d, 0, sizeof(*d));
+    size_t n = ps->nnodes * 2 + 1;  // no node takes more than two instructions
+    d->prog = malloc(n * sizeof(*d->prog));
+    d->sparse = calloc(n, sizeof(int));
+    d->dense = malloc(n * sizeof(int));
+    d->stack = malloc((n * 2 + 1) * sizeof(int));
+    d->tmp = malloc(n * sizeof(int));
+    if (!d->prog || !d->sparse || !d->dense || !d->stack || !d->tmp) {
+        return -1;
+    }
+    int pc = 0;
+    rx_emit(ps, root, rev, d->prog, &pc);
+    d->prog[pc] = (struct rx_inst){RX_MATCH, 0, 0, 0};
+    d->nprog = pc + 1;
+    d->unanchored = rev;
+    return 0;
+}
+
+void
+rx_dfa_free(struct rx_dfa *d)
+{
+    arena_pop(&d->arena, NULL);
+    free(d->prog);
+    free(d->sparse);
+    free(d->dense);
+    free(d->stack);
+    free(d->tmp);
+}
+
+void
+rx_free(rx_t *rx)
+{
+    if (rx == NULL) {
+        return;
+    }
+    rx_dfa_free(&rx->fwd);
+    rx_dfa_free(&rx->rev);
+    free(rx->sets);
+    free(rx->src);
+    free(rx->mark);
+    free(rx);
+}
+
+// compile pat, NULL when it is malformed
+rx_t *
+rx_compile(const char *pat)
+{
+    rx_t *rx = calloc(1, sizeof(*rx));
+    if (rx == NULL || (rx->src = strdup(pat)) == NULL) {
+        free(rx);
+        return NULL;
+    }
+    rx->len = strlen(pat);
+    if (rx->len == 0) {
+        rx_free(rx);
+        return NULL;
+    }
+    rx->literal = strpbrk(pat, "\\.[]()*+?|^$") == NULL;
+    if (rx->literal) {
+        return rx;
+    }
+
+    struct rx_parser ps = {pat, rx, NULL, 0, 0, 0};
+    int root = rx_parse_alt(&ps);
+    if (*ps.p != '\0') {
+        ps.err = 1;  // unbalanced )
+    }
+    if (ps.err || rx_dfa_init(&rx->fwd, &ps, root, 0) == -1
+        || rx_dfa_init(&rx->rev, &ps, root, 1) == -1) {
+        free(ps.nodes);
+        rx_free(rx);
+        return NULL;
+    }
+    free(ps.nodes);
+
+    // bytes no set tells apart share a class, and a DFA state needs one
+    // successor per class instead of one per byte
+    for (int c = 0; c < 256; c++) {
+        int split = c == 0;
+        for (int s = 0; s < rx->nsets && !split; s++) {
+            int in = rx->sets[s][c >> 3] >> (c & 7) & 1;
+            int prev = rx->sets[s][(c - 1) >> 3] >> ((c - 1) & 7) & 1;
+            split = in != prev;
+        }
+        if (split) {
+            rx->rep[rx->ncls++] = c;
+        }
+        rx->cls[c] = rx->ncls - 1;
+    }
+    return rx;
+}
+
+void
+rx_clear(struct rx_dfa *d)
+{
+    d->ndense = 0;
+}
+
+int
+rx_has(struct rx_dfa *d, int pc)
+{
+    int i = d->sparse[pc];
+    return i < d->ndense && d->dense[i] == pc;
+}
+
+// add pc and everything reachable from it without reading a byte, begin
+// and end tell whether ^ and $ hold here
+void
+rx_closure(struct rx_dfa *d, int pc, int begin, int end)
+{
+    int top = 0;
+    d->stack[top++] = pc;
+    while (top > 0) {
+        pc = d->stack[--top];
+        if (rx_has(d, pc)) {
+            continue;
+        }
+        d->sparse[pc] = d->ndense;
+        d->dense[d->ndense++] = pc;
+        struct rx_inst *in = &d->prog[pc];
+        switch (in->op) {
+            case RX_SPLIT:
+                d->stack[top++] = in->y;
+                d->stack[top++] = in->x;
+                break;
+            case RX_JMP:
+                d->stack[top++] = in->x;
+                break;
+            case RX_BEGIN:
+                if (begin) {
+                    d->stack[top++] = in->x;
+                }
+                break;
+            case RX_END:
+                if (end) {
+                    d->stack[top++] = in->x;
+                }
+                break;
+        }
+    }
+}
+
+int
+rx_cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// drop every state once there are too many, returns 1 when it did
+int
+rx_reserve(struct rx_dfa *d)
+{
+    if (d->nstates < RX_STATES) {
+        return 0;
+    }
+    arena_pop(&d->arena, NULL);
+    memset(d->table, 0, sizeof(d->table));
+    d->nstates = 0;
+    d->begin = NULL;
+    d->mid = NULL;
+    return 1;
+}
+
+// the DFA state for the instructions collected in dense, made on first use
+struct rx_state *
+rx_intern(rx_t *rx, struct rx_dfa *d)
+{
+    // only instructions that wait for a byte or the end matter for what
+    // happens next, the rest were followed already
+    int n = 0;
+    int match = 0;
+    for (int i = 0; i < d->ndense; i++) {
+        int op = d->prog[d->dense[i]].op;
+        if (op == RX_SET || op == RX_END || op == RX_MATCH) {
+            d->tmp[n++] = d->dense[i];
+            match |= op == RX_MATCH;
+        }
+    }
+    qsort(d->tmp, n, sizeof(int), rx_cmp_int);
+
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < n; i++) {
+        h = (h ^ d->tmp[i]) * 16777619u;
+    }
+    struct rx_state **bucket = &d->table[h % RX_HASH];
+    for (struct rx_state *s = *bucket; s != NULL; s = s->chain) {
+        if (s->n == n && memcmp(s->insts, d->tmp, n * sizeof(int)) == 0) {
+            return s;
+        }
+    }
+
+    int match_end = match;
+    rx_clear(d);
+    for (int i = 0; i < n && !match_end; i++) {
+        if (d->prog[d->tmp[i]].op == RX_END) {
+            rx_closure(d, d->prog[d->tmp[i]].x, 0, 1);
+            for (int j = 0; j < d->ndense; j++) {
+                match_end |= d->prog[d->dense[j]].op == RX_MATCH;
+            }
+        }
+    }
+
+    struct rx_state *s = arena_alloc(&d->arena, sizeof(*s) + n * sizeof(int));
+    struct rx_state **next = arena_alloc(&d->arena, rx->ncls * sizeof(*next));
+    if (s == NULL || next == NULL) {
+        return NULL;
+    }
+    memset(next, 0, rx->ncls * sizeof(*next));
+    s->next = next;
+    s->match = match;
+    s->match_end = match_end;
+    s->n = n;
+    memcpy(s->insts, d->tmp, n * sizeof(int));
+    s->chain = *bucket;
+    *bucket = s;
+    d->nstates++;
+    return s;
+}
+
+struct rx_state *
+rx_start(rx_t *rx, struct rx_dfa *d, int begin)
+{
+    struct rx_state **st = begin ? &d->begin : &d->mid;
+    if (*st == NULL) {
+        rx_reserve(d);
+        rx_clear(d);
+        rx_closure(d, 0, begin, 0);
+        *st = rx_intern(rx, d);
+    }
+    return *st;
+}
+
+struct rx_state *
+rx_step(rx_t *rx, struct rx_dfa *d, struct rx_state *s, unsigned char c)
+{
+    int k = rx->cls[c];
+    if (s->next[k] != NULL) {
+        return s->next[k];
+    }
+    rx_clear(d);
+    for (int i = 0; i < s->n; i++) {
+        struct rx_inst *in = &d->prog[s->insts[i]];
+        if (in->op == RX_SET && rx->sets[in->set][c >> 3] >> (c & 7) & 1) {
+            rx_closure(d, in->x, 0, 0);
+        }
+    }
+    if (d->unanchored) {
+        rx_closure(d, 0, 0, 0);
+    }
+    if (rx_reserve(d)) {
+        return rx_intern(rx, d);  // s is gone, nowhere to remember the step
+    }
+    return s->next[k] = rx_intern(rx, d);
+}
+
+// mark in rx->mark every offset of s where a match starts, returns how
+// many there are or -1 when out of memory
+int
+rx_starts(rx_t *rx, const char *s, int len)
+{
+    if (len + 1 > rx->markcap) {
+        int n_cap = rx->markcap ? rx->markcap : 256;
+        while (n_cap < len + 1) {
+            n_cap *= 2;
+        }
+        unsigned char *n_mark = realloc(rx->mark, n_cap);
+        if (n_mark == NULL) {
+            return -1;
+        }
+        rx->mark = n_mark;
+        rx->markcap = n_cap;
+    }
+    memset(rx->mark, 0, len + 1);
+
+    int count = 0;
+    if (rx->literal) {
+        const char *m = s;
+        while ((m = memmem(m, s + len - m, rx->src, rx->len)) != NULL) {
+            rx->mark[m - s] = 1;
+            count++;
+            m++;
+        }
+        return count;
+    }
+
+    // run the reversed pattern from the end, it accepts wherever some
+    // match starts
+    struct rx_state *st = rx_start(rx, &rx->rev, 1);
+    for (int i = len; st != NULL; i--) {
+        if (st->match || (i == 0 && st->match_end)) {
+            rx->mark[i] = 1;
+            count++;
+        }
+        if (i == 0) {
+            return count;
+        }
+        st = rx_step(rx, &rx->rev, st, s[i - 1]);
+    }
+    return -1;
+}
+
+// leftmost match start at or after from, -1 when there is none
+int
+rx_first(rx_t *rx, const char *s, int len, int from)
+{
+    if (from > len) {
+        return -1;
+    }
+    if (rx->literal) {
+        char *m = memmem(&s[from], len - from, rx->src, rx->len);
+        return m ? m - s : -1;
+    }
+    int first = -1;
+    struct rx_state *st = rx_start(rx, &rx->rev, 1);
+    for (int i = len; st != NULL; i--) {
+        if (st->match || (i == 0 && st->match_end)) {
+            first = i;
+        }
+        if (i == from) {
+            break;
+        }
+        st = rx_step(rx, &rx->rev, st, s[i - 1]);
+    }
+    return first;
+}
+
+// rightmost match start before to, -1 when there is none
+int
+rx_last(rx_t *rx, const char *s, int len, int to)
+{
+    if (rx->literal) {
+        int last = -1;
+        const char *m = s;
+        while ((m = memmem(m, s + len - m, rx->src, rx->len)) != NULL && m - s < to) {
+            last = m - s;
+            m++;
+        }
+        return last;
+    }
+    struct rx_state *st = rx_start(rx, &rx->rev, 1);
+    for (int i = len; st != NULL; i--) {
+        if (i < to && (st->match || (i == 0 && st->match_end))) {
+            return i;
+        }
+        if (i == 0) {
+            break;
+        }
+        st = rx_step(rx, &rx->rev, st, s[i - 1]);
+    }
+    return -1;
+}
+
+// end of the longest match starting at at, -1 when none starts there
+int
+rx_end(rx_t *rx, const char *s, int len, int at)
+{
+    if (rx->literal) {
+        return at + rx->len <= (size_t)len
+            && memcmp(&s[at], rx->src, rx->len) == 0 ? at + (int)rx->len : -1;
+    }
+    int end = -1;
+    struct rx_state *st = rx_start(rx, &rx->fwd, at == 0);
+    for (int i = at; st != NULL && st->n > 0; i++) {
+        if (st->match || (i == len && st->match_end)) {
+            end = i;
+        }
+        if (i == len) {
+            break;
+        }
+        st = rx_step(rx, &rx->fwd, st, s[i]);
+    }
+    return end;
+}
+
+// compiled patterns are kept around, most recently used first, so running
+// the same search or motion again reuses the DFA states built so far.
+// The pattern returned stays valid until the next call
+rx_t *
+rx_get(const char *pat)
+{
+    static rx_t *cache[RX_CACHE];
+    for (int i = 0; i < RX_CACHE; i++) {
+        if (cache[i] != NULL && strcmp(cache[i]->src, pat) == 0) {
+            rx_t *rx = cache[i];
+            memmove(&cache[1], &cache[0], i * sizeof(rx_t *));
+            cache[0] = rx;
+            return rx;
+        }
+    }
+    rx_t *rx = rx_compile(pat);
+    if (rx == NULL) {
+        return NULL;
+    }
+    rx_free(cache[RX_CACHE - 1]);
+    memmove(&cache[1], &cache[0], (RX_CACHE - 1) * sizeof(rx_t *));
+    cache[0] = rx;
+    return rx;
+}
+
+/*** search ***/
+
+struct smatch {
+    int row;
+    int col;
+    int len;  // only filled in by substitute
+};
+
+// the last pattern and every match of it, the matches are collected in
+// the background, so once that is done n and N just step through them
+struct search {
+    char pat[SEARCH_MAX];
+    size_t len;  // 0 when nothing was searched yet
+    int dir;     // 1 for /, -1 for ?
+    struct smatch *hits;
+    int count;
+    int cap;
+    int scanned;       // rows before this one have their matches in hits
+    // rows edited since, but for those in between rows before scanned have
+    // their matches in hits
+    int dirty_from;
+    int dirty_to;
+    struct buffer *buf;  // buffer the hits are rows of
+    int cur;             // hit under the cursor, -1 when unknown
+} search = {{0}, 0, 1, NULL, 0, 0, 0, 0, 0, NULL, -1};
+
+// walk the rows from the cursor in dir looking for the pattern, wrapping
+// around the ends, returns 0 and the match position when one is found and
+// -1 otherwise, or when cancel is set and more input arrived meanwhile
+int
+editor_search_find(int dir, int row, int col, int *mrow, int *mcol, int cancel)
+{
+    rx_t *rx = rx_get(search.pat);
+    if (rx == NULL) {
+        return -1;
+    }
+    if (dir < 0 && editor_rows_pending()) {
+        editor_index_rows(INT_MAX);  // wrapping backward needs the last row
+    }
+    int y = row;
+    int wrapped = 0;
+    for (int n = 0; ; n++) {
+        if (cancel && (n & 4095) == 4095 && editor_input_pending()) {
+            return -1;
+        }
+        if (y >= config.buf->numrows) {
+            editor_index_rows(config.buf->numrows + INDEX_STEP);
+        }
+        if (y >= config.buf->numrows || y < 0) {
+            if (wrapped || config.buf->numrows == 0) {
+                return -1;
+            }
+            wrapped = 1;
+            y = dir > 0 ? 0 : config.buf->numrows - 1;
+        }
+        if (wrapped && (dir > 0 ? y > row : y < row)) {
+            return -1;
+        }
+
+        erow_t *r = editor_row(y);
+        int at;
+        if (dir > 0) {
+            at = rx_first(rx, r->chars, r->size, y == row && !wrapped ? col : 0);
+        } else {
+            at = rx_last(rx, r->chars, r->size, y == row && !wrapped ? col : INT_MAX);
+        }
+        if (at != -1) {
+            *mrow = y;
+            *mcol = at;
+            return 0;
+        }
+        y += dir;
+    }
+}
+
+// move the cursor onto a match, bringing it to the middle of the screen
+// when it is out of view
+void
+editor_search_jump(int row, int col)
+{
+    config.win->cy = row;
+    config.win->cx = col;
+    if (row < config.win->rowoff || row >= config.win->rowoff + config.win->screen_rows) {
+        config.win->rowoff = row - config.win->screen_rows / 2;
+        config.win->rowoff = config.win->rowoff < 0 ? 0 : config.win->rowoff;
+        config.win->vskip = 0;
+    }
+}
+
+// forget the collected matches, the pattern or the text changed
+void
+editor_search_reset()
+{
+    search.count = 0;
+    search.scanned = 0;
+    search.dirty_from = search.dirty_to = 0;
+    search.cur = -1;
+    search.buf = config.buf;
+}
+
+// first hit on row y or after it
+int
+editor_search_hit_at(int y)
+{
+    int lo = 0;
+    int hi = search.count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (search.hits[mid].row < y) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// drop the hits on rows [from, to)
+void
+editor_search_drop(int from, int to)
+{
+    int lo = editor_search_hit_at(from);
+    int hi = editor_search_hit_at(to);
+    memmove(&search.hits[lo], &search.hits[hi], (search.count - hi) * sizeof(struct smatch));
+    search.count -= hi - lo;
+}
+
+// rows went in or out at row at, the hits after them move along and those
+// on rows that went are dropped
+void
+editor_search_shift(int at, int delta)
+{
+    if (search.buf != config.buf || at >= search.scanned) {
+        return;
+    }
+    if (delta < 0) {
+        editor_search_drop(at, at - delta);
+    }
+    for (int i = editor_search_hit_at(at); i < search.count; i++) {
+        search.hits[i].row += delta;
+    }
+    int *ends[] = {&search.scanned, &search.dirty_from, &search.dirty_to};
+    for (int i = 0; i < 3; i++) {
+        if (*ends[i] > at) {
+            *ends[i] = delta < 0 && *ends[i] - at < -delta ? at : *ends[i] + delta;
+        }
+    }
+    search.cur = -1;
+}
+
+// rows [at, at + n) changed, their hits are looked for again when idle,
+// until then the range edited is one span and its hits are stale
+void
+editor_search_changed(int at, int n)
+{
+    if (search.buf != config.buf || at >= search.scanned) {
+        return;
+    }
+    int from = at;
+    int to = at + n < search.scanned ? at + n : search.scanned;
+    if (search.dirty_from < search.dirty_to) {
+        from = from < search.dirty_from ? from : search.dirty_from;
+        to = to > search.dirty_to ? to : search.dirty_to;
+    }
+    search.dirty_from = from;
+    search.dirty_to = to;
+    search.cur = -1;
+}
+
+int
+editor_search_pending()
+{
+    // collecting every match of a file paged in isn't bounded, n and N
+    // look for the next one instead
+    return search.len > 0 && !pager.on
+        && (search.buf != config.buf || search.dirty_from < search.dirty_to
+            || search.scanned < config.buf->numrows || editor_rows_pending());
+}
+
+// add the matches of row y to the end of hits, -1 when out of memory
+int
+editor_search_row(rx_t *rx, int y)
+{
+    erow_t *row = editor_row(y);
+    if (rx_starts(rx, row->chars, row->size) <= 0) {
+        return 0;
+    }
+    for (int at = 0; at <= row->size; at++) {
+        if (!rx->mark[at]) {
+            continue;
+        }
+        if (search.count == search.cap) {
+            int n_cap = search.cap ? search.cap * 2 : 64;
+            struct smatch *n_hits = realloc(search.hits, n_cap * sizeof(*n_hits));
+            if (n_hits == NULL) {
+                return -1;
+            }
+            search.hits = n_hits;
+            search.cap = n_cap;
+        }
+        search.hits[search.count].row = y;
+        search.hits[search.count].col = at;
+        search.count++;
+    }
+    return 0;
+}
+
+// look at some of the edited rows again, what is found there replaces
+// their stale hits
+void
+editor_search_dirty(rx_t *rx)
+{
+    int from = search.dirty_from;
+    int end = from + SEARCH_STEP;
+    end = end > search.dirty_to ? search.dirty_to : end;
+    editor_search_drop(from, end);
+    int pos = editor_search_hit_at(from);
+    int old = search.count;
+    int y;
+    for (y = from; y < end; y++) {
+        if (editor_search_row(rx, y) == -1) {
+            break;
+        }
+    }
+    int n = search.count - old;
+    struct smatch *found = n > 0 ? malloc(n * sizeof(struct smatch)) : NULL;
+    if (y < end || (n > 0 && found == NULL)) {
+        // out of memory, everything from here on is searched again
+        free(found);
+        search.count = pos;
+        search.scanned = from;
+        search.dirty_from = search.dirty_to = 0;
+        return;
+    }
+    if (n > 0) {
+        memcpy(found, &search.hits[old], n * sizeof(struct smatch));
+        memmove(&search.hits[pos + n], &search.hits[pos], (old - pos) * sizeof(struct smatch));
+        memcpy(&search.hits[pos], found, n * sizeof(struct smatch));
+        free(found);
+    }
+    search.dirty_from = end;
+}
+
+// collect the matches of the next SEARCH_STEP rows, run while idle
+void
+editor_search_step()
+{
+    if (search.buf != config.buf) {
+        editor_search_reset();
+    }
+    rx_t *rx = rx_get(search.pat);
+    if (rx == NULL) {
+        search.dirty_from = search.dirty_to = 0;
+        search.scanned = config.buf->numrows;
+        return;
+    }
+    if (search.dirty_from < search.dirty_to) {
+        editor_search_dirty(rx);
+        return;
+    }
+    int end = search.scanned + SEARCH_STEP;
+    end = end > config.buf->numrows ? config.buf->numrows : end;
+    for (int y = search.scanned; y < end; y++) {
+        if (editor_search_row(rx, y) == -1) {
+            return;
+        }
+        search.scanned = y + 1;
+    }
+}
+
+// first hit after the cursor going forward, or the last one before it going
+// backward, -1 when it is past either end
+int
+editor_search_nearest(int dir)
+{
+    int lo = 0;
+    int hi = search.count;
+    // first hit at or after the cursor
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct smatch *m = &search.hits[mid];
+        if (m->row < config.win->cy || (m->row == config.win->cy && m->col < config.win->cx)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (dir < 0) {
+        return lo - 1;
+    }
+    if (lo < search.count && search.hits[lo].row == config.win->cy
+        && search.hits[lo].col == config.win->cx) {
+        lo++;
+    }
+    return lo < search.count ? lo : -1;
+}
+
+void
+editor_search_report()
+{
+    // rows still coming in may hold more matches
+    if (search.cur >= 0 && !editor_search_pending()) {
+        editor_set_status_message("%c%s [%d/%d%s]", search.dir > 0 ? '/' : '?',
+                                  search.pat, search.cur + 1, search.count,
+                                  editor_loading() ? " so far" : "");
+    } else {
+        editor_set_status_message("%c%s", search.dir > 0 ? '/' : '?', search.pat);
+    }
+}
+
+// no match, or none in the rows loaded so far
+void
+editor_search_missing(const char *pat)
+{
+    if (editor_loading()) {
+        editor_set_status_message("Pattern not found in the %d lines loaded so far: %s",
+                                  config.buf->numrows, pat);
+    } else {
+        editor_set_status_message("Pattern not found: %s", pat);
+    }
+}
+
+// jump to the next match in the search direction, or against it for N
+void
+editor_search_next(int dir)
+{
+    if (search.len == 0) {
+        editor_set_status_message("No previous pattern");
+        return;
+    }
+    dir *= search.dir;
+
+    // with edited rows not looked at again yet the hits have holes
+    if (search.buf == config.buf && search.dirty_from >= search.dirty_to) {
+        int done = !editor_search_pending() && !editor_loading();
+        int i = -1;
+        struct smatch *m = search.cur >= 0 && search.cur < search.count
+            ? &search.hits[search.cur] : NULL;
+        if (m != NULL && m->row == config.win->cy && m->col == config.win->cx) {
+            i = search.cur + dir;
+            i = i >= search.count ? -1 : i;
+        } else {
+            i = editor_search_nearest(dir);
+        }
+        if (i == -1 && done && search.count > 0) {
+            i = dir > 0 ? 0 : search.count - 1;  // wrap around
+        }
+        if (i != -1) {
+            search.cur = i;
+            editor_search_jump(search.hits[i].row, search.hits[i].col);
+            editor_search_report();
+            return;
+        }
+        if (done) {
+            editor_search_missing(search.pat);
+            return;
+        }
+    }
+
+    // the matches in that direction weren't collected yet
+    int row;
+    int col = config.win->cx + (dir > 0);
+    if (editor_search_find(dir, config.win->cy, col, &row, &col, 0) == -1) {
+        editor_search_missing(search.pat);
+        return;
+    }
+    search.cur = -1;
+    editor_search_jump(row, col);
+    editor_search_report();
+}
+
+// read a pattern after / or ?, moving to the first match as it is typed,
+// escape puts the cursor and the previous pattern back
+void
+editor_search_prompt(int dir)
+{
+    int cy = config.win->cy;
+    int cx = config.win->cx;
+    int rowoff = config.win->rowoff;
+    int vskip = config.win->vskip;
+    char prev[SEARCH_MAX];
+    size_t prev_len = search.len;
+    memcpy(prev, search.pat, prev_len + 1);
+
+    char buf[SEARCH_MAX];
+    size_t len = 0;
+    int found = -1;  // whether buf matched, -1 when not looked up yet, -2 when malformed
+
+    while (1) {
+        buf[len] = '\0';
+        editor_set_status_message("%c%s%s", dir > 0 ? '/' : '?', buf,
+                                  found == 0 ? "  (not found)" : found == -2 ? "  (invalid)" : "");
+        if (!editor_input_pending()) {
+            editor_refresh_screen();
+        }
+
+        char c = editor_read_key();
+        if (c == '\r') {
+            break;
+        } else if (c == '\x1b' || c == CTRLKEY('c') || (c == 127 && len == 0)) {
+            config.win->cy = cy;
+            config.win->cx = cx;
+            config.win->rowoff = rowoff;
+            config.win->vskip = vskip;
+            memcpy(search.pat, prev, prev_len + 1);
+            search.len = prev_len;
+            editor_search_reset();
+            editor_set_status_message("");
+            return;
+        } else if (c == 127) {
+            len--;
+        } else if (c >= ' ' && len < SEARCH_MAX - 1) {
+            buf[len++] = c;
+        } else {
+            continue;
+        }
+
+        // a new pattern, drop what was found for the old one and start
+        // over from where the search began
+        memcpy(search.pat, buf, len);
+        search.pat[len] = '\0';
+        search.len = len;
+        editor_search_reset();
+        config.win->cy = cy;
+        config.win->cx = cx;
+        config.win->rowoff = rowoff;
+        config.win->vskip = vskip;
+        found = -1;
+        if (len == 0 || editor_input_pending()) {
+            continue;
+        }
+        if (rx_get(search.pat) == NULL) {
+            found = -2;
+            continue;
+        }
+        int row;
+        int col;
+        if (editor_search_find(dir, cy, cx + (dir > 0), &row, &col, 1) == 0) {
+            editor_search_jump(row, col);
+            found = 1;
+        } else if (!editor_input_pending()) {
+            found = 0;
+        }
+    }
+
+    search.dir = dir;
+    if (len == 0) {
+        memcpy(search.pat, prev, prev_len + 1);
+        search.len = prev_len;
+        editor_search_reset();
+        editor_set_status_message("");
+        return;
+    }
+    if (rx_get(buf) == NULL) {
+        memcpy(search.pat, prev, prev_len + 1);
+        search.len = prev_len;
+        editor_search_reset();
+        editor_set_status_message("Invalid pattern: %s", buf);
+        return;
+    }
+    if (found == -1) {
+        int row;
+        int col;
+        if (editor_search_find(dir, cy, cx + (dir > 0), &row, &col, 0) == 0) {
+            editor_search_jump(row, col);
+            found = 1;
+        } else {
+            found = 0;
+        }
+    }
+    if (found == 0) {
+        editor_search_missing(search.pat);
         return;
     }
-    config.row = n_row;
-    memmove(&config.row[at + 1], &config.row[at], sizeof(erow_t) * (config.numrows - at));
+    editor_search_report();
+}
 
-    erow_t *r = &config.row[at];
-    r->size = len;
+/*** substitute ***/
 
-    char *n_chars = malloc(len + 1);
-    if (n_chars == NULL) {
+// rows handed to one substitute worker, it only reads them and collects
+// where the pattern matches
+struct subst_job {
+    pthread_t tid;
+    int from;
+    int to;
+    rx_t *rx;    // a compiled copy of its own, DFA states are built as it goes
+    int global;  // every match in a row, not just the first
+    struct smatch *hits;
+    int count;
+    int cap;
+    int failed;
+};
+
+void *
+editor_subst_worker(void *arg)
+{
+    struct subst_job *job = arg;
+    for (int y = job->from; y < job->to; y++) {
+        erow_t *row = editor_row(y);
+        int n = rx_starts(job->rx, row->chars, row->size);
+        if (n == -1) {
+            job->failed = 1;
+            return NULL;
+        }
+        // matches are taken left to right and don't overlap, an empty one
+        // right where the last one ended isn't taken
+        int last = -1;
+        for (int at = 0; n > 0 && at <= row->size; ) {
+            if (!job->rx->mark[at]) {
+                at++;
+                continue;
+            }
+            int end = rx_end(job->rx, row->chars, row->size, at);
+            if (end == -1 || (end == at && at == last)) {
+                at++;
+                continue;
+            }
+            if (job->count == job->cap) {
+                int n_cap = job->cap ? job->cap * 2 : 256;
+                struct smatch *n_hits = realloc(job->hits, n_cap * sizeof(*n_hits));
+                if (n_hits == NULL) {
+                    job->failed = 1;
+                    return NULL;
+                }
+                job->hits = n_hits;
+                job->cap = n_cap;
+            }
+            job->hits[job->count].row = y;
+            job->hits[job->count].col = at;
+            job->hits[job->count].len = end - at;
+            job->count++;
+            if (!job->global) {
+                break;
+            }
+            last = end;
+            at = end > at ? end : at + 1;
+        }
+    }
+    return NULL;
+}
+
+// rewrite row y with its n matches replaced, building the new text in one
+// allocation, and journal every replacement
+int
+editor_subst_row(int y, struct smatch *hits, int n, const char *rep, size_t rlen)
+{
+    erow_t *row = editor_row(y);
+    long long size = row->size;
+    for (int i = 0; i < n; i++) {
+        size += (long long)rlen - hits[i].len;
+    }
+    if (size > INT_MAX - 1) {
+        return -1;
+    }
+    char *chars = malloc(size + 1);
+    if (chars == NULL) {
+        return -1;
+    }
+
+    char *d = chars;
+    int src = 0;
+    for (int i = 0; i < n; i++) {
+        int col = hits[i].col;
+        memcpy(d, &row->chars[src], col - src);
+        d += col - src;
+        if (hits[i].len > 0) {
+            editor_journal(JOP_DEL_TEXT, y, d - chars, &row->chars[col], hits[i].len);
+        }
+        if (rlen > 0) {
+            editor_journal(JOP_INS_TEXT, y, d - chars, rep, rlen);
+        }
+        memcpy(d, rep, rlen);
+        d += rlen;
+        src = col + hits[i].len;
+    }
+    memcpy(d, &row->chars[src], row->size - src);
+    chars[size] = '\0';
+
+    editor_row_release(row);
+    row->chars = chars;
+    row->size = size;
+    row->cap = size + 1;
+    row->store = ROW_HEAP;
+    row->gen = ++config.gen;
+    editor_row_invalidate(y);
+    config.buf->dirty++;
+    return 0;
+}
+
+// split the next part of cmd up to an unescaped delim into out, returns
+// where parsing continues or NULL when the delimiter is missing
+const char *
+editor_subst_part(const char *cmd, char delim, char *out, size_t *len, int last)
+{
+    *len = 0;
+    while (*cmd != '\0' && *cmd != delim) {
+        if (*cmd == '\\' && cmd[1] == delim) {
+            cmd++;
+        }
+        out[(*len)++] = *cmd++;
+    }
+    out[*len] = '\0';
+    if (*cmd == delim) {
+        return cmd + 1;
+    }
+    return last ? cmd : NULL;
+}
+
+// :s/pat/rep/[g] on the cursor row, or on every row with :%s. Matching
+// is split across a few threads, the rows are rewritten afterwards in a
+// single pass, and the whole thing is undone in one step
+void
+editor_substitute(const char *cmd, int all)
+{
+    char delim = cmd[1];
+    if (delim == '\0' || delim == ' ' || delim == '\\') {
+        editor_set_status_message("Usage: s/pattern/replacement/[g]");
+        return;
+    }
+    size_t len = strlen(cmd);
+    char *pat = malloc(len + 1);
+    char *rep = malloc(len + 1);
+    if (pat == NULL || rep == NULL) {
+        free(pat);
+        free(rep);
+        return;
+    }
+    size_t plen;
+    size_t rlen;
+    const char *p = editor_subst_part(&cmd[2], delim, pat, &plen, 0);
+    if (p != NULL) {
+        p = editor_subst_part(p, delim, rep, &rlen, 1);
+    }
+    if (p == NULL || plen == 0) {
+        editor_set_status_message("Usage: s/pattern/replacement/[g]");
+        free(pat);
+        free(rep);
+        return;
+    }
+    int global = strchr(p, 'g') != NULL;
+    if (all && editor_loading()) {
+        // the rows still to come would be left as they are
+        editor_set_status_message("Still loading %s", config.buf->filename);
+        free(pat);
+        free(rep);
+        return;
+    }
+    if (rx_get(pat) == NULL) {
+        editor_set_status_message("Invalid pattern: %s", pat);
+        free(pat);
+        free(rep);
+        return;
+    }
+
+    int from = config.win->cy;
+    int to = config.win->cy + 1;
+    if (all) {
+        editor_index_rows(INT_MAX);
+        from = 0;
+    }
+    to = all || to > config.buf->numrows ? config.buf->numrows : to;
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = (to - from) / SUBST_MIN_ROWS;
+    nthreads = nthreads > ncpu ? ncpu : nthreads;
+    nthreads = nthreads > SUBST_THREADS ? SUBST_THREADS : nthreads;
+    nthreads = nthreads < 1 ? 1 : nthreads;
+
+    struct subst_job jobs[SUBST_THREADS];
+    memset(jobs, 0, sizeof(jobs));
+    int step = (to - from + nthreads - 1) / nthreads;
+    for (int i = 0; i < nthreads; i++) {
+        jobs[i].from = from + i * step;
+        jobs[i].to = jobs[i].from + step > to ? to : jobs[i].from + step;
+        jobs[i].rx = rx_compile(pat);
+        jobs[i].global = global;
+        jobs[i].failed = jobs[i].rx == NULL;
+    }
+    // the first chunk is done here, the others by threads meanwhile, a
+    // thread that can't be started leaves its chunk to this one too
+    int started[SUBST_THREADS] = {0};
+    for (int i = 1; i < nthreads; i++) {
+        started[i] = !jobs[i].failed && pthread_create(&jobs[i].tid, NULL, editor_subst_worker, &jobs[i]) == 0;
+    }
+    if (!jobs[0].failed) {
+        editor_subst_worker(&jobs[0]);
+    }
+    for (int i = 1; i < nthreads; i++) {
+        if (started[i]) {
+            pthread_join(jobs[i].tid, NULL);
+        } else if (!jobs[i].failed) {
+            editor_subst_worker(&jobs[i]);
+        }
+    }
+
+    editor_journal_break();
+    int subs = 0;
+    int lines = 0;
+    int failed = 0;
+    for (int i = 0; i < nthreads; i++) {
+        failed |= jobs[i].failed;
+        for (int j = 0; j < jobs[i].count; ) {
+            int y = jobs[i].hits[j].row;
+            int n = 1;
+            while (j + n < jobs[i].count && jobs[i].hits[j + n].row == y) {
+                n++;
+            }
+            if (editor_subst_row(y, &jobs[i].hits[j], n, rep, rlen) == 0) {
+                subs += n;
+                lines++;
+                config.win->cy = y;
+                config.win->cx = 0;
+            } else {
+                failed = 1;
+            }
+            j += n;
+        }
+        free(jobs[i].hits);
+        rx_free(jobs[i].rx);
+    }
+    editor_journal_break();
+
+    if (subs == 0 && !failed) {
+        editor_set_status_message("Pattern not found: %s", pat);
+    } else {
+        editor_set_status_message("%d substitutions on %d lines%s", subs, lines,
+                                  failed ? ", out of memory" : "");
+    }
+    free(pat);
+    free(rep);
+}
+
+/*** input ***/
+
+// start of the word after the cursor, or before it when dir is negative,
+// words are the matches of config.word taken from the left, -1 if none
+int
+editor_word_start(erow_t *row, int dir)
+{
+    rx_t *rx = rx_get(config.word);
+    if (row == NULL || rx == NULL || rx_starts(rx, row->chars, row->size) <= 0) {
+        return -1;
+    }
+    int prev = -1;
+    for (int at = 0; at <= row->size; ) {
+        if (!rx->mark[at]) {
+            at++;
+            continue;
+        }
+        if (dir > 0 && at > config.win->cx) {
+            return at;
+        }
+        if (dir < 0 && at >= config.win->cx) {
+            return prev;
+        }
+        prev = at;
+        int end = rx_end(rx, row->chars, row->size, at);
+        at = end > at ? end : at + 1;
+    }
+    return dir > 0 ? -1 : prev;
+}
+
+void
+editor_move_cursor(char key)
+{
+    editor_index_rows(config.win->cy + 11);  // j and Ctrl-d look ahead that far
+    erow_t *row = editor_row(config.win->cy);
+
+    switch (key) {
+        case 'j':
+            if (config.win->cy < config.buf->numrows - 1) {
+                config.win->cy++;
+            }
+            break;
+        case 'k':
+            config.win->cy = (config.win->cy != 0 ? config.win->cy - 1 : config.win->cy);
+            break;
+        case 'h':
+            if (row && config.win->cx > 0) {
+                config.win->cx = editor_prev_char(row, config.win->cx);
+            }
+            break;
+        case 'l':
+            if (row && editor_next_char(row, config.win->cx) < row->size) {
+                config.win->cx = editor_next_char(row, config.win->cx);
+            }
+            break;
+        case CTRLKEY('d'):
+            if (editor_wrap_on()) {
+                editor_wrap_move(10);
+                break;
+            }
+            config.win->cy = (config.win->cy < config.buf->numrows - 1 - 10
+                              ? config.win->cy + 10 : config.buf->numrows - 1);
+            config.win->cy = config.win->cy < 0 ? 0 : config.win->cy;
+            break;
+        case CTRLKEY('u'):
+            if (editor_wrap_on()) {
+                editor_wrap_move(-10);
+                break;
+            }
+            config.win->cy = (config.win->cy > 10 ? config.win->cy - 10 : 0);
+            break;
+        case '$':
+            if (row) {
+                config.win->cx = editor_prev_char(row, row->size);
+            }
+            return;
+        case '0':
+            config.win->cx = 0;
+            return;
+        case 'w':
+        case 'b': {
+            int at = editor_word_start(row, key == 'w' ? 1 : -1);
+            if (at != -1) {
+                config.win->cx = at;
+            }
+            break;
+        }
+    }
+
+    row = editor_row(config.win->cy);
+    int rowlen = row ? row->size : 0;
+    if (config.win->cx >= rowlen) {
+        config.win->cx = rowlen == 0 ? 0 : editor_prev_char(row, rowlen);
+    } else if (editor_is_continuation(row, config.win->cx)) {
+        config.win->cx = editor_prev_char(row, config.win->cx + 1);
+    }
+}
+
+void
+editor_process_keypress()
+{
+    char c = editor_read_key();
+    struct perf_mark m = editor_perf_mark();
+    editor_handle_key(c);
+    editor_perf_stage(PERF_DISPATCH, m);
+}
+
+void
+editor_handle_key(char c)
+{
+    // every command is undone on its own, an insert session as a whole
+    if (config.mode == VIEW) {
+        editor_journal_break();
+    }
+
+    if (c == '\x1b' && editor_match_input("[200~")) {
+        if (!editor_pager_refuse()) {
+            editor_paste();
+        }
         return;
     }
-    r->chars = n_chars;
 
-    memcpy(r->chars, s, len);
+    if (config.mode == VIEW) {
+        editor_process_cmd(c); 
+    } else if (config.mode == INSERT) {
+        switch (c) {
+            case '\x1b':
+            case CTRLKEY('c'):
+                config.mode = VIEW;
+                break;
+            case '\r':
+                editor_insert_new_line();
+                break;
+            case 127:
+                editor_del_char(-1, -1);
+                break;
+            default:
+                editor_insert_char(c);
+                break;
+        }
+    } 
+}
+
+/*** syntax highlighting ***/
+
+enum Highlight {
+    HL_NORMAL, HL_COMMENT, HL_MLCOMMENT, HL_KEYWORD1, HL_KEYWORD2,
+    HL_STRING, HL_NUMBER
+};
+
+// what the lexer carries from the end of one row into the next
+enum HlState { HL_STATE_NORMAL, HL_STATE_COMMENT };
+
+struct syntax {
+    char *name;
+    char **filematch;  // file name suffixes, NULL terminated
+    char **keywords;   // statements
+    char **types;
+    char *comment;     // single line comment start
+    char *mcs;         // multi line comment start and end
+    char *mce;
+};
+
+char *c_filematch[] = {".c", ".h", ".cc", ".cpp", ".hh", ".hpp", NULL};
+char *c_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case",
+    "default", "do", "goto", "sizeof", "volatile", "const", "extern",
+    "register", "inline", "#include", "#define", "#if", "#ifdef",
+    "#ifndef", "#elif", "#else", "#endif", NULL
+};
+char *c_types[] = {
+    "int", "long", "double", "float", "char", "unsigned", "signed", "void",
+    "short", "size_t", "ssize_t", NULL
+};
+
+struct syntax hldb[] = {
+    {"c", c_filematch, c_keywords, c_types, "//", "/*", "*/"},
+};
+
+#define HLDB_ENTRIES (sizeof(hldb) / sizeof(hldb[0]))
+
+// pick the syntax from the file name, no highlighting when nothing fits
+void
+editor_select_syntax(const char *filename)
+{
+    config.buf->syntax = NULL;
+    size_t len = strlen(filename);
+    for (size_t i = 0; i < HLDB_ENTRIES; i++) {
+        for (char **m = hldb[i].filematch; *m != NULL; m++) {
+            size_t mlen = strlen(*m);
+            if (len >= mlen && strcmp(&filename[len - mlen], *m) == 0) {
+                config.buf->syntax = &hldb[i];
+                return;
+            }
+        }
+    }
+}
+
+int
+editor_is_separator(int c)
+{
+    return c == ' ' || c == '\t' || c == '\0' || strchr(",.()+-/*=~%<>[];{}&|!?:^", c) != NULL;
+}
+
+int
+editor_hl_starts(const char *s, int size, int at, const char *word)
+{
+    size_t len = strlen(word);
+    return at + len <= (size_t)size && memcmp(&s[at], word, len) == 0;
+}
+
+// the keyword of list starting at s[at], its length or 0
+int
+editor_hl_keyword(const char *s, int size, int at, char **list)
+{
+    for (char **k = list; *k != NULL; k++) {
+        int len = strlen(*k);
+        if (editor_hl_starts(s, size, at, *k)
+            && (at + len == size || editor_is_separator(s[at + len]))) {
+            return len;
+        }
+    }
+    return 0;
+}
+
+// lex one row entering in state, returns the state it leaves in. hl gets
+// a class per byte, with hl NULL only the state is worked out, which is
+// all rows that aren't on screen need
+int
+editor_hl_lex(struct syntax *syn, const char *s, int size, int state, unsigned char *hl)
+{
+    int clen = syn->comment ? strlen(syn->comment) : 0;
+    int slen = syn->mcs ? strlen(syn->mcs) : 0;
+    int elen = syn->mce ? strlen(syn->mce) : 0;
+    int in_comment = state == HL_STATE_COMMENT;
+    char in_string = 0;
+    int prev_sep = 1;
+
+    if (hl != NULL) {
+        memset(hl, HL_NORMAL, size);
+    }
+    int i = 0;
+    while (i < size) {
+        char c = s[i];
+
+        if (in_comment) {
+            if (elen && editor_hl_starts(s, size, i, syn->mce)) {
+                if (hl != NULL) {
+                    memset(&hl[i], HL_MLCOMMENT, elen);
+                }
+                i += elen;
+                in_comment = 0;
+                prev_sep = 1;
+            } else {
+                if (hl != NULL) {
+                    hl[i] = HL_MLCOMMENT;
+                }
+                i++;
+            }
+            continue;
+        }
+
+        if (in_string) {
+            if (hl != NULL) {
+                hl[i] = HL_STRING;
+            }
+            if (c == '\\' && i + 1 < size) {
+                if (hl != NULL) {
+                    hl[i + 1] = HL_STRING;
+                }
+                i += 2;
+                continue;
+            }
+            if (c == in_string) {
+                in_string = 0;
+            }
+            i++;
+            prev_sep = 1;
+            continue;
+        }
+
+        if (clen && editor_hl_starts(s, size, i, syn->comment)) {
+            if (hl != NULL) {
+                memset(&hl[i], HL_COMMENT, size - i);
+            }
+            break;
+        }
+        if (slen && editor_hl_starts(s, size, i, syn->mcs)) {
+            if (hl != NULL) {
+                memset(&hl[i], HL_MLCOMMENT, slen);
+            }
+            i += slen;
+            in_comment = 1;
+            continue;
+        }
+        if (c == '"' || c == '\'') {
+            if (hl != NULL) {
+                hl[i] = HL_STRING;
+            }
+            in_string = c;
+            i++;
+            continue;
+        }
+
+        if (hl != NULL) {
+            int prev_hl = i > 0 ? hl[i - 1] : HL_NORMAL;
+            if ((c >= '0' && c <= '9' && (prev_sep || prev_hl == HL_NUMBER))
+                || (c == '.' && prev_hl == HL_NUMBER)) {
+                hl[i] = HL_NUMBER;
+                i++;
+                prev_sep = 0;
+                continue;
+            }
+            if (prev_sep) {
+                int len = editor_hl_keyword(s, size, i, syn->keywords);
+                int type = HL_KEYWORD1;
+                if (len == 0) {
+                    len = editor_hl_keyword(s, size, i, syn->types);
+                    type = HL_KEYWORD2;
+                }
+                if (len > 0) {
+                    memset(&hl[i], type, len);
+                    i += len;
+                    prev_sep = 0;
+                    continue;
+                }
+            }
+        }
+
+        prev_sep = editor_is_separator(c);
+        i++;
+    }
+    return in_comment ? HL_STATE_COMMENT : HL_STATE_NORMAL;
+}
+
+// bring row y up to date for entering in state, filling in its highlight
+// array when it has a render cache or want_hl asks for one, returns 1 when
+// it had to be lexed again
+int
+editor_hl_update(int y, int *state, int want_hl)
+{
+    erow_t *row = editor_row(y);
+    struct render *r = want_hl ? editor_row_render(row) : row->r;
+    if (r != NULL && !r->lexed && editor_render_hl(r, row->size) == -1) {
+        r = NULL;
+    }
+    if (row->hl_known && row->hl_in == *state && (r == NULL || r->lexed)) {
+        *state = row->hl_out;
+        return 0;
+    }
+    row->hl_in = *state;
+    row->hl_out = editor_hl_lex(config.buf->syntax, row->chars, row->size, *state,
+                                r ? r->hl : NULL);
+    row->hl_known = 1;
+    if (r != NULL) {
+        r->lexed = 1;
+    }
+    *state = row->hl_out;
+    return 1;
+}
 
-    r->chars[len] = '\0';
+// row y of the current buffer was lexed again and may look different,
+// every window showing it draws it again, returns whether one does
+int
+editor_hl_damage(int y)
+{
+    int shown = 0;
+    for (struct window *w = config.windows; w != NULL; w = w->next) {
+        if (w->buf != config.buf) {
+            continue;
+        }
+        for (int i = w->top; i < w->top + w->screen_rows && i < screen.nlines; i++) {
+            if (screen.lines[i].filerow == y) {
+                screen.lines[i].filerow = -1;
+                shown = 1;
+            }
+        }
+    }
+    return shown;
+}
 
-    config.numrows++;
-    config.dirty++;
+// rows [at, at + n) changed, they are lexed again and so are the rows
+// after them, up to the first one whose state comes out as it was
+void
+editor_hl_changed(int at, int n)
+{
+    struct buffer *b = config.buf;
+    int none = b->hl_valid >= b->numrows;  // every row was right
+    if (none || b->hl_done < at + n) {
+        b->hl_done = at + n;
+    }
+    if (none || at < b->hl_valid) {
+        b->hl_valid = at;
+    }
 }
 
+// rows went in or out at row at, the rows known right after them move
 void
-editor_del_row(int at)
+editor_hl_shift(int at, int delta)
 {
-    if (at < 0 || at > config.numrows) {
-        return;
+    struct buffer *b = config.buf;
+    if (b->hl_done != INT_MAX && b->hl_done > at) {
+        b->hl_done = delta < 0 && b->hl_done - at < -delta ? at : b->hl_done + delta;
     }
-    free(config.row[at].chars);
-    memmove(&config.row[at], &config.row[at + 1], sizeof(erow_t) * (config.numrows - at - 1));
-    config.numrows--;
-    config.dirty++;
 }
 
+// row y was brought up to date, lexed again or not. Rows are lexed in
+// order, so right after the last known good one it had the right state
 void
-editor_row_insert_char(erow_t *row, int at, int c)
+editor_hl_relexed(int y, int relexed)
 {
-    if (at < 0 || at > row->size) {
-        at = row->size;
+    struct buffer *b = config.buf;
+    if (relexed) {
+        editor_hl_damage(y);
     }
-
-    char *n_chars = realloc(row->chars, row->size + 2);  // 2 = new char and \0
-    if (n_chars == NULL) {
-        return;
+    if (y == b->hl_valid) {
+        b->hl_valid = y + 1;
+    } else if (relexed && y > b->hl_valid && y >= b->hl_done) {
+        // lexed from a guess, the rows after it may no longer follow on
+        b->hl_done = INT_MAX;
     }
-    row->chars = n_chars;
-
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    config.dirty++;
 }
 
-void
-editor_row_append_string(erow_t *row, char *s, size_t len)
+// the state entering row at, exact when the rows before it were all
+// checked or few are missing, otherwise lexing starts HL_LOOKBACK rows up
+// from a guess and the idle pass corrects it later
+int
+editor_hl_state_at(int at)
 {
-    char *n_chars = realloc(row->chars, row->size + len + 1);
-    if (n_chars == NULL) {
-        return;
+    int state = HL_STATE_NORMAL;
+    int y = config.buf->hl_valid;
+    at = at > config.buf->numrows ? config.buf->numrows : at;
+    if (at - y > HL_LOOKBACK) {
+        y = at - HL_LOOKBACK;
+        erow_t *prev = editor_row(y - 1);
+        if (prev != NULL && prev->hl_known) {
+            state = prev->hl_out;
+        }
+    } else if (y > 0) {
+        state = editor_row(y - 1)->hl_out;
+    }
+    if (y > at) {
+        y = at;
+        state = at > 0 ? editor_row(at - 1)->hl_out : HL_STATE_NORMAL;
     }
-    row->chars = n_chars;
 
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
+    for (; y < at; y++) {
+        editor_hl_relexed(y, editor_hl_update(y, &state, 0));
+    }
+    return state;
 }
 
+// lex the rows the current window is about to show, before any window is
+// drawn, so one lexed again for it is drawn again in the others too
 void
-editor_row_del_char(erow_t *row, int at)
+editor_hl_prepare()
 {
-    if (at < 0 || at > row->size) {
+    if (config.buf->syntax == NULL) {
         return;
     }
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    config.dirty++;
+    struct window *w = config.win;
+    editor_index_rows(w->rowoff + w->screen_rows);
+    int state = editor_hl_state_at(w->rowoff);
+    int end = w->rowoff + w->screen_rows;
+    end = end > config.buf->numrows ? config.buf->numrows : end;
+    for (int y = w->rowoff; y < end; y++) {
+        editor_hl_relexed(y, editor_hl_update(y, &state, 1));
+    }
 }
 
-/*** editor operations ***/
+int
+editor_hl_pending()
+{
+    // the pager lexes what it shows from a little above, going through the
+    // whole file would page all of it in
+    return config.buf->syntax != NULL && !pager.on && config.buf->hl_valid < config.buf->numrows;
+}
 
+// check the next HL_STEP rows after the last known good one, rows on
+// screen that turn out different are redrawn. Once a row past the changed
+// ones is entered in the state it was lexed from, so are all after it
 void
-editor_insert_new_line()
+editor_hl_step()
 {
-    if (config.cx == 0) {
-        editor_insert_row(config.cy, "", 0);
-    } else {
-        erow_t *row = &config.row[config.cy];
-        editor_insert_row(config.cy + 1, &row->chars[config.cx], row->size - config.cx);
-        row = &config.row[config.cy];
-        row->size = config.cx;
-        row->chars[row->size] = '\0';
+    struct buffer *b = config.buf;
+    int state = editor_hl_state_at(b->hl_valid);
+    int end = b->hl_valid + HL_STEP;
+    end = end > b->numrows ? b->numrows : end;
+    int damaged = 0;
+    for (int y = b->hl_valid; y < end; y++) {
+        if (editor_hl_update(y, &state, 0)) {
+            damaged |= editor_hl_damage(y);
+        } else if (y >= b->hl_done) {
+            b->hl_valid = b->numrows;
+            break;
+        }
+        b->hl_valid = y + 1;
+    }
+    if (damaged) {
+        editor_refresh_screen();
     }
-    config.cy++;
-    config.cx = 0;
 }
 
-void
-editor_insert_char(int c)
+int
+editor_hl_color(int hl)
 {
-    if (config.cy == config.numrows) {
-        editor_insert_row(config.numrows, "", 0);
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT:
+            return 36;
+        case HL_KEYWORD1:
+            return 33;
+        case HL_KEYWORD2:
+            return 32;
+        case HL_STRING:
+            return 35;
+        case HL_NUMBER:
+            return 31;
+        default:
+            return 39;
     }
+}
 
-    editor_row_insert_char(&config.row[config.cy], config.cx, c);
-    config.cx++;
+/*** wrap ***/
+
+// with -R the rows come and go, there is nothing to keep their counts in
+int
+editor_wrap_on()
+{
+    return config.wrap && !pager.on;
 }
 
-void
-editor_del_char(int char_off, int cx_off)
+// first byte of row whose character starts on or after screen column col
+int
+editor_row_at_col(erow_t *row, struct render *r, int col)
 {
-    if ((config.cy == config.numrows) || (config.cx == 0 && config.cy == 0)) {
-        return;
+    struct rcheck c = editor_render_check_col(row, r, col);
+    const char *shown;
+    int width;
+    int shown_len;
+    while (c.at < row->size && c.col < col) {
+        c.at += editor_render_char(row, c.at, c.col, &width, &shown, &shown_len);
+        c.col += width;
     }
+    return c.at;
+}
 
-    erow_t *row = &config.row[config.cy];
-    if (config.cx > 0) {
-        editor_row_del_char(row, config.cx + char_off);
-        config.cx += cx_off;
-    } else {
-        config.cx = config.row[config.cy - 1].size;
-        editor_row_append_string(&config.row[config.cy - 1], row->chars, row->size);
-        editor_del_row(config.cy);
-        config.cy--;
+// whether the characters from byte at on all take no room
+int
+editor_row_blank_from(erow_t *row, int at, int col)
+{
+    const char *shown;
+    int width;
+    int shown_len;
+    while (at < row->size) {
+        at += editor_render_char(row, at, col, &width, &shown, &shown_len);
+        if (width > 0) {
+            return 0;
+        }
     }
+    return 1;
 }
 
-/*** file i/o ***/
-
-char*
-editor_rows_to_string(int *len)
+// column the screen line after the one starting on column s at byte at
+// starts on, -1 when s starts the last, *next gets its byte. A character
+// cut by the right edge goes down whole, unless nothing before it would
+// be left on the line
+int
+editor_wrap_next_from(erow_t *row, int at, int s, int cols, int *next)
 {
-    int total = 0;
-    for (int i = 0; i < config.numrows; i++) {
-        total += config.row[i].size + 1;
+    const char *shown;
+    int width;
+    int shown_len;
+    int col = s;
+    int prev = at;
+    int prev_col = s;
+    while (at < row->size && col < s + cols) {
+        prev = at;
+        prev_col = col;
+        at += editor_render_char(row, at, col, &width, &shown, &shown_len);
+        col += width;
     }
-    *len = total;
-
-    char *buf;
-    if ((buf = malloc(total)) == NULL) {
-        return NULL;
+    if (col <= s + cols && (at == row->size || editor_row_blank_from(row, at, col))) {
+        return -1;  // the rest fits
     }
-    char *p = buf;
-    for (int i = 0; i < config.numrows; i++) {
-        memcpy(p, config.row[i].chars, config.row[i].size);
-        p += config.row[i].size;
-        *p = '\n';
-        p++;
+    if (col == s + cols || at == 0 || prev_col <= s) {
+        *next = at;
+        return col;
     }
-    return buf;
+    // the character before at is cut by the edge
+    *next = prev;
+    return prev_col;
 }
 
-void
-editor_open(char *filename)
+int
+editor_wrap_next(erow_t *row, int s, int cols)
 {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        die("fopen");
+    struct render *r = editor_row_render(row);
+    if (r == NULL) {
+        return -1;
     }
+    int next;
+    return editor_wrap_next_from(row, editor_row_at_col(row, r, s), s, cols, &next);
+}
 
-    config.filename = strdup(filename);
-
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-            linelen--;
+// walk the screen lines of row until line k, the one holding column rx or
+// the last, whichever comes first, *start gets the column it starts on
+int
+editor_wrap_walk(erow_t *row, int k, int rx, int *start)
+{
+    int s = 0;
+    int at = 0;
+    int i = 0;
+    while (i < k) {
+        int n_at;
+        int next = editor_wrap_next_from(row, at, s, config.win->screen_cols, &n_at);
+        if (next == -1 || next > rx) {
+            break;
         }
-        editor_insert_row(config.numrows, line, linelen);
+        s = next;
+        at = n_at;
+        i++;
     }
-    config.dirty = 0;
-    free(line);
-    fclose(fp);
+    if (start != NULL) {
+        *start = s;
+    }
+    return i;
 }
 
+// counts taken at another width are no good
 void
-editor_save(char *new_filename)
+editor_wrap_width()
 {
-    char *filename;
-
-    if (new_filename == NULL) {
-        if (config.filename == NULL) {
-            editor_set_status_message("provide filename");
-            return;
-        } else {
-            filename = config.filename;
-        }
-    } else {
-        filename = new_filename;
+    if (config.buf->wrap_cols != config.win->screen_cols) {
+        rope_forget_lines(config.buf->rows.root);
+        config.buf->wrap_cols = config.win->screen_cols;
     }
+}
 
-    int len;
-    char *buf = editor_rows_to_string(&len);
-    if (buf == NULL) {
-        editor_set_status_message("failed file io");
-        return;
+// screen lines row y takes, counted the first time they are asked for and
+// kept in the rope until the row changes
+int
+editor_row_lines(int y)
+{
+    erow_t *row = editor_row(y);
+    if (row == NULL) {
+        return 1;
     }
-
-    int fd = open(filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                editor_set_status_message("Save file: %s, %d bytes written to disk", filename, len);
-                config.dirty = 0;
-                return;
-            }
-        }
-        close(fd);
+    if (row->vrows == 0) {
+        int n = editor_wrap_walk(row, INT_MAX, INT_MAX, NULL) + 1;
+        rope_set_lines(&config.buf->rows, y, n < VROWS_MAX ? n : VROWS_MAX);
     }
-    free(buf);
-    editor_set_status_message("Can't save!");
+    return row->vrows;
 }
 
-/*** input ***/
-
+// count the rows from y on in direction dir until they make n screen
+// lines, so the sums are right over the stretch about to be looked at,
+// rows never seen count as one line
 void
-editor_move_cursor(char key)
+editor_wrap_measure(int y, int dir, long long n)
 {
-    erow_t *row = (config.cy >= config.numrows) ? NULL : &config.row[config.cy];
+    while (n > 0 && y >= 0 && y < config.buf->numrows) {
+        n -= editor_row_lines(y);
+        y += dir;
+    }
+}
 
-    int space = 0;
-    switch (key) {
-        case 'j':
-            config.cy = (config.cy < config.numrows - 1 ? config.cy + 1 : config.cy);
-            break;
-        case 'k':
-            config.cy = (config.cy != 0 ? config.cy - 1 : config.cy);
-            break;
-        case 'h':
-            config.cx = (config.cx > 0 ? config.cx - 1 : config.cx);
-            break;
-        case 'l':
-            if (row && config.cx < row->size - 1) {
-                config.cx++;
-            }
-            break;
-        case CTRLKEY('d'):
-            config.cy = (config.cy < config.numrows - 1 - 10 ? config.cy + 10 : config.numrows - 1);
-            break;
-        case CTRLKEY('u'):
-            config.cy = (config.cy > 10 ? config.cy - 10 : 0);
-            break;
-        case '$':
-            config.cx = row->size - 1; 
-            return;
-        case '0':
-            config.cx = 0;
-            return;
-        case 'w':
-            for (int i = config.cx; i < row->size; i++) {
-                if (row->chars[i] == ' ') {
-                    for (int j = i; j < row->size; j++) {
-                        if (row->chars[j] != ' ') {
-                            config.cx = j;
-                            return;
-                        }
-                    }
-                }
-                if (33 <= row->chars[i] && row->chars[i] <= 46) {
-                    if (i == config.cx) {
-                        if (row->chars[i + 1] != ' ') {
-                            config.cx = i + 1;
-                            return;
-                        } else {
-                            continue;
-                        }
-                    }
-                    config.cx = i;
-                    return;
-                }
-            }
-            return;
-        case 'b':
-            // TODO: make movement to the start of the word
-            for (int i = config.cx; i >= 0; i--) {
-                if (row->chars[i] == ' ') {
-                    for (int j = i; j >= 0; j--) {
-                        if (row->chars[j] != ' ') {
-                            config.cx = j;
-                            return;
-                        }
-                    }
-                }
-                if (33 <= row->chars[i] && row->chars[i] <= 46) {
-                    if (i == config.cx) {
-                        if (row->chars[i - 1] != ' ') {
-                            config.cx = i - 1;
-                            return;
-                        } else {
-                            continue;
-                        }
-                    }
-                    config.cx = i;
-                    return;
-                }
-            }
+// screen line of the window's cursor row it is on, *start gets the column
+// that line starts on
+int
+editor_wrap_cursor(int *start)
+{
+    erow_t *row = editor_row(config.win->cy);
+    *start = 0;
+    if (row == NULL) {
+        return 0;
     }
+    return editor_wrap_walk(row, INT_MAX, editor_row_col(row, config.win->cx), start);
+}
 
-    row = (config.cy >= config.numrows) ? NULL : &config.row[config.cy];
-    int rowlen = row ? row->size : 0;
-    if (config.cx >= rowlen) {
-        config.cx = rowlen == 0 ? 0 : rowlen - 1;
+// Ctrl-d and Ctrl-u with wrap, n screen lines down or up, keeping the
+// column on the line
+void
+editor_wrap_move(int n)
+{
+    struct window *w = config.win;
+    editor_wrap_width();
+    if (editor_row(w->cy) == NULL) {
+        return;
+    }
+    int start;
+    int line = editor_wrap_cursor(&start);
+    int rx = editor_row_col(editor_row(w->cy), w->cx);
+    if (n > 0) {
+        editor_wrap_measure(w->cy, 1, line + n + 1);
+    } else {
+        editor_wrap_measure(w->cy - 1, -1, -n - line);
     }
+
+    long long v = rope_lines_before(&config.buf->rows, w->cy) + line + n;
+    long long before;
+    w->cy = rope_find_line(&config.buf->rows, v < 0 ? 0 : v, &before);
+    erow_t *row = editor_row(w->cy);
+    struct render *r = editor_row_render(row);
+    int s;
+    editor_wrap_walk(row, v < 0 ? 0 : v - before, INT_MAX, &s);
+    w->cx = r != NULL ? editor_row_at_col(row, r, s + rx - start) : 0;
 }
 
+// keep the cursor's screen line in view, rowoff and vskip are the first
+// one shown
 void
-editor_process_keypress()
+editor_wrap_scroll()
 {
-    char c = editor_read_key();
+    struct window *w = config.win;
+    rope_t *rows = &config.buf->rows;
+    editor_wrap_width();
+    w->coloff = 0;
+    if (w->rowoff >= config.buf->numrows) {
+        w->rowoff = config.buf->numrows > 0 ? config.buf->numrows - 1 : 0;
+    }
 
-    if (config.mode == VIEW) {
-        editor_process_cmd(c); 
-    } else if (config.mode == INSERT) {
-        switch (c) {
-            case '\x1b':
-            case CTRLKEY('c'):
-                config.mode = VIEW;
-                break;
-            case '\r':
-                editor_insert_new_line();
-                break;
-            case 127:
-                editor_del_char(-1, -1);
-                break;
-            default:
-                editor_insert_char(c);
-                break;
-        }
-    } 
+    int start;
+    int line = editor_wrap_cursor(&start);
+    w->rx = editor_row_col(editor_row(w->cy), w->cx);
+    editor_wrap_measure(w->rowoff, 1, w->screen_rows + w->vskip);
+    editor_wrap_measure(w->cy, -1, w->screen_rows + line);
+    if (w->vskip >= editor_row_lines(w->rowoff)) {
+        w->vskip = editor_row_lines(w->rowoff) - 1;
+    }
+
+    long long cur = rope_lines_before(rows, w->cy) + line;
+    long long top = rope_lines_before(rows, w->rowoff) + w->vskip;
+    if (cur < top) {
+        top = cur;
+    } else if (cur >= top + w->screen_rows) {
+        top = cur - w->screen_rows + 1;
+    }
+    long long before;
+    w->rowoff = rope_find_line(rows, top, &before);
+    w->vskip = top - before;
+
+    w->srow = cur - top;
+    w->scol = w->rx - start < w->screen_cols ? w->rx - start : w->screen_cols - 1;
 }
 
 /*** output ***/
@@ -736,10 +9409,7 @@ editor_process_keypress()
 void
 editor_draw_empty(struct abuf *ab, int from, int to)
 {
-    while (from < to) {
-        ab_append(ab, " ", 1);
-        from++;
-    }
+    ab_fill(ab, ' ', to - from);
 }
 
 void
@@ -749,94 +9419,363 @@ editor_draw_status_bar(struct abuf *ab)
 
     char buf[140];
     int len = snprintf(buf, sizeof(buf),
-                       "%s%.20s-%d lines mode: %s\x1b[m\x1b[7m, pos: %d, %d",
-                       config.dirty ? "(modified) " : "",
-                       config.filename ? config.filename : "No name",
-                       config.numrows,
+                       "%s%.20s-%d%s lines%s mode: %s\x1b[m\x1b[7m, pos: %d, %d",
+                       config.buf->dirty ? "(modified) " : config.buf->ondisk ? "(on disk) " : "",
+                       config.buf->filename ? config.buf->filename : "No name",
+                       config.buf->numrows,
+                       editor_rows_pending() || editor_loading() ? "+" : "",
+                       editor_progress(),
                        config.mode == VIEW ? "\x1b[32mVIEW" : "\x1b[31mINSERT",
-                       config.cy, config.cx);
-    len = len > config.screen_cols ? config.screen_cols : len;
+                       config.win->cy, config.win->cx);
+    len = len > config.win->screen_cols ? config.win->screen_cols : len;
     ab_append(ab, buf, len);
 
     // 12 - offset for special escape sequences
-    editor_draw_empty(ab, len - 12, config.screen_cols);
+    editor_draw_empty(ab, len - 12, config.win->screen_cols);
 
-    ab_append(ab, "\x1b[m", 4);
+    ab_append(ab, "\x1b[m", 3);
 }
 
 void
 editor_draw_message_bar(struct abuf *ab)
 {
     int msglen = strlen(config.status_msg);
-    msglen = msglen > config.screen_cols ? config.screen_cols : msglen;
+    msglen = msglen > config.term_cols ? config.term_cols : msglen;
     if (msglen && time(NULL) - config.status_msg_time < 3) {
         ab_append(ab, config.status_msg, msglen);
-        editor_draw_empty(ab, msglen, config.screen_cols);
-        return;
     }
-    editor_draw_empty(ab, 0, config.screen_cols);
 }
 
 void
-editor_scroll()
+editor_nowrap_scroll()
 {
-    if (config.cy < config.rowoff) {
-        config.rowoff = config.cy;
+    config.win->vskip = 0;
+    if (config.win->cy < config.win->rowoff) {
+        config.win->rowoff = config.win->cy;
     }
 
-    if (config.cy >= config.rowoff + config.screen_rows) {
-        config.rowoff = config.cy - config.screen_rows + 1;
+    if (config.win->cy >= config.win->rowoff + config.win->screen_rows) {
+        config.win->rowoff = config.win->cy - config.win->screen_rows + 1;
     }
 
-    if (config.cx < config.coloff) {
-        config.coloff = config.cx;
+    config.win->rx = editor_row_col(editor_row(config.win->cy), config.win->cx);
+    if (config.win->rx < config.win->coloff) {
+        config.win->coloff = config.win->rx;
     }
         
-    if (config.cx >= config.coloff + config.screen_cols) {
-        config.coloff = config.cx - config.screen_cols + 1;
+    if (config.win->rx >= config.win->coloff + config.win->screen_cols) {
+        config.win->coloff = config.win->rx - config.win->screen_cols + 1;
+    }
+    config.win->srow = config.win->cy - config.win->rowoff;
+    config.win->scol = config.win->rx - config.win->coloff;
+}
+
+void
+editor_scroll()
+{
+    if (editor_wrap_on()) {
+        editor_wrap_scroll();
+    } else {
+        editor_nowrap_scroll();
+    }
+    if (config.win->coloff != config.win->shown_coloff) {
+        // every visible line shifts sideways
+        editor_damage_rows(0);
+        config.win->shown_coloff = config.win->coloff;
+    }
+}
+
+// (re)allocate the shadow lines for the current window size
+void
+editor_screen_resize()
+{
+    int nlines = config.term_rows;
+    if (screen.nlines != nlines) {
+        for (int y = 0; y < screen.nlines; y++) {
+            free(screen.lines[y].text.b);
+        }
+        free(screen.lines);
+        if ((screen.lines = malloc(sizeof(struct sline) * nlines)) == NULL) {
+            die("malloc");
+        }
+        for (int y = 0; y < nlines; y++) {
+            struct sline init = {-1, 0, 0, ABUF_INIT};
+            screen.lines[y] = init;
+        }
+        screen.nlines = nlines;
+    }
+    screen.invalid = 1;
+}
+
+// send line y only if it differs from what the terminal shows
+void
+editor_emit_line(struct abuf *ab, int y, struct abuf *line)
+{
+    struct sline *sl = &screen.lines[y];
+    if (sl->text.len == line->len
+        && (line->len == 0 || memcmp(sl->text.b, line->b, line->len) == 0)) {
+        return;
+    }
+
+    // clear first, erasing after a full width line would eat its last column
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H\x1b[2K", y + 1);
+    ab_append(ab, buf, len);
+    ab_append(ab, line->b, line->len);
+
+    sl->text.len = 0;
+    ab_append(&sl->text, line->b, line->len);
+}
+
+// when the view moved by less than a window, let the terminal scroll the
+// lines it already has and shift the shadow to match
+void
+editor_scroll_screen(struct abuf *ab)
+{
+    long long first = config.win->rowoff;
+    if (editor_wrap_on()) {
+        first = rope_lines_before(&config.buf->rows, config.win->rowoff) + config.win->vskip;
+    }
+    long long moved = first - config.win->shown_top;
+    int rows = config.win->screen_rows;
+    config.win->shown_top = first;
+    if (moved == 0 || screen.invalid) {
+        return;
+    }
+    if (moved >= rows || -moved >= rows) {
+        return;
+    }
+    int d = moved;
+
+    // only the window's own lines move
+    char buf[48];
+    int top = config.win->top;
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dr\x1b[%d%c\x1b[r",
+                       top + 1, top + rows, d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+    ab_append(ab, buf, len);
+
+    // the lines scrolled in are blank, which is what an empty shadow means
+    struct sline *lines = &screen.lines[top];
+    struct sline tmp[d > 0 ? d : -d];
+    if (d > 0) {
+        memcpy(tmp, lines, sizeof(struct sline) * d);
+        memmove(lines, &lines[d], sizeof(struct sline) * (rows - d));
+        memcpy(&lines[rows - d], tmp, sizeof(struct sline) * d);
+        for (int y = rows - d; y < rows; y++) {
+            lines[y].filerow = -1;
+            lines[y].text.len = 0;
+        }
+    } else {
+        d = -d;
+        memcpy(tmp, &lines[rows - d], sizeof(struct sline) * d);
+        memmove(&lines[d], lines, sizeof(struct sline) * (rows - d));
+        memcpy(lines, tmp, sizeof(struct sline) * d);
+        for (int y = 0; y < d; y++) {
+            lines[y].filerow = -1;
+            lines[y].text.len = 0;
+        }
+    }
+}
+
+// the part of row between screen columns left and left + screen_cols,
+// with color changes where the highlighting changes
+// returns the columns drawn
+int
+editor_draw_row(struct abuf *line, erow_t *row, int left)
+{
+    struct render *r = editor_row_render(row);
+    if (r == NULL) {
+        return 0;
+    }
+    int right = left + config.win->screen_cols;
+
+    // first character starting at or after the left edge, what is left of
+    // a tab or wide character cut by the edge shows as blanks
+    int at = editor_row_at_col(row, r, left);
+    int col = editor_row_col(row, at);
+    ab_fill(line, ' ', col - left);
+
+    int color = 39;
+    int run = at;  // start of the bytes not appended yet
+    while (at < row->size) {
+        const char *shown;
+        int width;
+        int shown_len;
+        int k = editor_render_char(row, at, col, &width, &shown, &shown_len);
+        if (col + width > right) {
+            break;
+        }
+        int c = r->lexed ? editor_hl_color(r->hl[at]) : 39;
+        if (c != color || shown != NULL) {
+            ab_append(line, &row->chars[run], at - run);
+            run = at;
+        }
+        if (c != color) {
+            char buf[16];
+            int n = snprintf(buf, sizeof(buf), "\x1b[%dm", c);
+            ab_append(line, buf, n);
+            color = c;
+        }
+        if (shown != NULL) {
+            ab_append(line, shown, shown_len);
+            run = at + k;
+        }
+        at += k;
+        col += width;
     }
+    ab_append(line, &row->chars[run], at - run);
+    if (color != 39) {
+        ab_append(line, "\x1b[39m", 5);
+    }
+    // nothing drawn when the row ends left of the window
+    return col > left ? col - left : 0;
 }
 
 void
 editor_draw_rows(struct abuf *ab)
 {
-    for (int y = 0; y < config.screen_rows; y++) {
-        int filerow = y + config.rowoff;
-        if (y >= config.numrows) {
-            ab_append(ab, "~", 1);
+    editor_index_rows(config.win->rowoff + config.win->screen_rows);
+    int wrap = editor_wrap_on();
+    int filerow = config.win->rowoff;
+    int part = config.win->vskip;  // screen line of the row on this line
+    int left = config.win->coloff;
+    erow_t *row = NULL;
+    for (int y = 0; y < config.win->screen_rows; y++) {
+        if (y == 0 || part == 0) {
+            row = editor_row(filerow);
+            if (row != NULL && part > 0) {
+                editor_wrap_walk(row, part, INT_MAX, &left);
+            }
+        }
+        unsigned int gen = row ? row->gen : 0;
+        int shown = filerow;
+        int shown_part = part;
+        int shown_left = left;
+
+        // where the next line goes on from
+        int next = wrap && row != NULL ? editor_wrap_next(row, left, config.win->screen_cols) : -1;
+        if (next == -1) {
+            filerow++;
+            part = 0;
+            left = config.win->coloff;
         } else {
-            int len = config.row[filerow].size - config.coloff;
-            len = (len < 0) ? 0 : len;
+            part++;
+            left = next;
+        }
+
+        struct sline *sl = &screen.lines[config.win->top + y];
+        if (sl->filerow == shown && sl->part == shown_part && sl->gen == gen
+            && shown < screen.damage_from) {
+            continue;
+        }
+        sl->filerow = shown;
+        sl->part = shown_part;
+        sl->gen = gen;
 
-            ab_append(ab, &config.row[filerow].chars[config.coloff], len);
+        struct abuf *line = &scratch;
+        line->len = 0;
+        if (row == NULL) {
+            ab_append(line, "~", 1);
+        } else {
+            // rows :diff found changed fill the line with their color
+            int bg = editor_diff_color(shown);
+            if (bg) {
+                char buf[16];
+                ab_append(line, buf, snprintf(buf, sizeof(buf), "\x1b[%dm", bg));
+            }
+            int cols = editor_draw_row(line, row, shown_left);
+            if (bg) {
+                ab_fill(line, ' ', config.win->screen_cols - cols);
+                ab_append(line, "\x1b[49m", 5);
+            }
         }
-        ab_append(ab, "\x1b[K", 3);  // clear current line
-        ab_append(ab, "\r\n", 2);
+        editor_emit_line(ab, config.win->top + y, line);
+    }
+}
+
+// draw every window, each as if it had the cursor, so the rows come from
+// its own buffer
+void
+editor_draw_windows(struct abuf *ab)
+{
+    struct window *cur = config.win;
+    for (struct window *w = config.windows; w != NULL; w = w->next) {
+        config.win = w;
+        config.buf = w->buf;
+        struct perf_mark m = editor_perf_mark();
+        editor_clamp_window();
+        editor_scroll();
+        editor_perf_stage(PERF_SCROLL, m);
+        editor_hl_prepare();
+    }
+    for (struct window *w = config.windows; w != NULL; w = w->next) {
+        config.win = w;
+        config.buf = w->buf;
+        editor_scroll_screen(ab);
+        editor_draw_rows(ab);
+
+        scratch.len = 0;
+        editor_draw_status_bar(&scratch);
+        editor_emit_line(ab, w->top + w->screen_rows, &scratch);
     }
+    config.win = cur;
+    config.buf = cur->buf;
+    screen.damage_from = INT_MAX;
 }
 
 void
 editor_refresh_screen()
 {
-    editor_scroll();
-    struct abuf ab = ABUF_INIT;
+    struct perf_mark m = editor_perf_mark();
+    if (screen.nlines != config.term_rows) {
+        editor_screen_resize();
+    }
+
+    struct abuf *ab = &frame;
+    ab->len = 0;
+
+    ab_append(ab, "\x1b[?25l", 6); // hide cursor
+    if (screen.invalid) {
+        ab_append(ab, "\x1b[2J", 4);
+        for (int y = 0; y < screen.nlines; y++) {
+            screen.lines[y].filerow = -1;
+            screen.lines[y].text.len = 0;
+        }
+    }
+    editor_draw_windows(ab);
+    screen.invalid = 0;
 
-    ab_append(&ab, "\x1b[?25l", 6); // hide cursor
-    ab_append(&ab, "\x1b[H", 3);    // change position of cursor to 0,0
+    scratch.len = 0;
+    editor_draw_message_bar(&scratch);
+    editor_emit_line(ab, config.term_rows - 1, &scratch);
 
-    editor_draw_rows(&ab);
-    editor_draw_status_bar(&ab);
-    editor_draw_message_bar(&ab);
+    int cy = config.win->top + config.win->srow + 1;
+    int cx = config.win->scol + 1;
+    if (ab->len == 6) {
+        // nothing changed on screen, at most the cursor moved
+        ab->len = 0;
+        if (cy == screen.cy && cx == screen.cx) {
+            editor_perf_stage(PERF_DRAW, m);
+            editor_perf_frame(0);
+            return;
+        }
+    }
 
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (config.cy - config.rowoff) + 1,
-                                              (config.cx - config.coloff) + 1);  // move cursor to certain position
-    ab_append(&ab, buf, strlen(buf));
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy, cx);  // move cursor to certain position
+    ab_append(ab, buf, strlen(buf));
+    screen.cy = cy;
+    screen.cx = cx;
 
-    ab_append(&ab, "\x1b[?25h", 6);  // show cursor (to avoid flickering when redraw)
+    if (ab->len > (int)strlen(buf)) {
+        ab_append(ab, "\x1b[?25h", 6);  // show cursor (to avoid flickering when redraw)
+    }
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    ab_free(&ab);
+    editor_perf_stage(PERF_DRAW, m);
+    m = editor_perf_mark();
+    term->write(ab->b, ab->len);
+    editor_perf_stage(PERF_WRITE, m);
+    editor_perf_frame(ab->len);
 }
 
 void
@@ -847,45 +9786,63 @@ editor_set_status_message(const char *fmt, ...)
     vsnprintf(config.status_msg, sizeof(config.status_msg), fmt, ap);
     va_end(ap);
     config.status_msg_time = time(NULL);
+    editor_set_timer(TIMER_MESSAGE, 3000, editor_refresh_screen);  // clear it
 }
 
 /*** init ***/
 
+// the terminal size has to be known by now
 void
 init_editor()
 {
     config.mode = VIEW;
-    config.cx = 0;
-    config.cy = 0;
-    config.rowoff = 0;
-    config.coloff = 0;
-    config.numrows = 0;
-    config.row = NULL;
-    config.filename = NULL;
+    config.buffers = NULL;
+    config.windows = NULL;
     config.status_msg[0] = '\0';
     config.status_msg_time = time(NULL);
     config.cmd.size = 0;
-    config.dirty = 0;
+    memset(config.cmd.chars, '\0', sizeof(config.cmd.chars));
+    config.word = strdup(WORD_PATTERN);
 
-    if (get_window_size(&config.screen_rows, &config.screen_cols) == -1) {
-        die("get_window_size");
+    if ((config.buf = editor_new_buffer()) == NULL
+        || (config.win = editor_new_window(config.buf)) == NULL) {
+        die("malloc");
     }
-    config.screen_rows -= 2;
+    config.windows = config.win;
+    editor_layout();
 }
 
 int
 main(int argc, char *argv[])
 {
+    if (argc >= 3 && strcmp(argv[1], "--trace") == 0) {
+        editor_perf_trace(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
     enable_raw_mode();
+    if (term->size(&config.term_rows, &config.term_cols) == -1) {
+        die("get_window_size");
+    }
     init_editor();
-    if (argc >= 2) {
-        editor_open(argv[1]);
+    editor_init_events();
+    if (argc >= 3 && strcmp(argv[1], "-R") == 0) {
+        if (editor_pager_open(argv[2]) == -1) {
+            die("open");
+        }
+    } else if (argc >= 2) {
+        if (editor_open(argv[1]) == -1) {
+            die("open");
+        }
+        editor_swap_open();
     }
 
-    char c;
     while (1) {
         editor_refresh_screen();
-        editor_process_keypress();
+        // handle everything already typed or pasted before drawing again
+        do {
+            editor_process_keypress();
+        } while (editor_input_pending());
     };
     return 0;
 }